@@ -0,0 +1,170 @@
+#include "cpucompiler/compile_cache.h"
+#include "common/log.h"
+#include "common/string_helpers.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+Log_SetChannel(CompileCache);
+
+CompileCache::CompileCache(const std::string& directory) : m_directory(directory)
+{
+}
+
+CompileCache::~CompileCache()
+{
+}
+
+void CompileCache::AddKeyData(const void* data, size_t size)
+{
+  m_hash.update(llvm::ArrayRef<uint8_t>(static_cast<const uint8_t*>(data), size));
+}
+
+void CompileCache::AddKeyString(const std::string& str)
+{
+  // Length first, so adjacent strings can't run into each other.
+  AddKeyInt(str.size());
+  AddKeyData(str.data(), str.size());
+}
+
+void CompileCache::AddKeyInt(u64 value)
+{
+  AddKeyData(&value, sizeof(value));
+}
+
+bool CompileCache::AddKeyFile(const std::string& filename)
+{
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(filename);
+  if (!buffer)
+  {
+    Log_ErrorPrintf("Failed to read %s: %s", filename.c_str(), buffer.getError().message().c_str());
+    return false;
+  }
+
+  AddKeyString((*buffer)->getBuffer().str());
+  return true;
+}
+
+bool CompileCache::Finish()
+{
+  llvm::MD5::MD5Result result;
+  llvm::SmallString<32> str;
+  m_hash.final(result);
+  llvm::MD5::stringifyResult(result, str);
+  m_key = str.str().str();
+
+  std::error_code ec = llvm::sys::fs::create_directories(m_directory);
+  if (ec)
+  {
+    Log_ErrorPrintf("Failed to create cache directory %s: %s", m_directory.c_str(), ec.message().c_str());
+    return false;
+  }
+
+  return true;
+}
+
+std::string CompileCache::GetEntryPath(const char* extension) const
+{
+  return StringFromFormat("%s/%s.%s", m_directory.c_str(), m_key.c_str(), extension);
+}
+
+std::unique_ptr<llvm::Module> CompileCache::LoadModule(llvm::LLVMContext& context) const
+{
+  std::string path = GetEntryPath("bc");
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(path);
+  if (!buffer)
+    return nullptr;
+
+  llvm::Expected<std::unique_ptr<llvm::Module>> mod = llvm::parseBitcodeFile((*buffer)->getMemBufferRef(), context);
+  if (!mod)
+  {
+    Log_WarningPrintf("Ignoring unreadable cache entry %s: %s", path.c_str(), llvm::toString(mod.takeError()).c_str());
+    return nullptr;
+  }
+
+  return std::move(*mod);
+}
+
+bool CompileCache::StoreModule(llvm::Module* mod) const
+{
+  llvm::SmallVector<char, 0> data;
+  llvm::raw_svector_ostream os(data);
+  llvm::WriteBitcodeToFile(mod, os);
+  return StoreData("bc", data.data(), data.size());
+}
+
+bool CompileCache::LoadString(const char* extension, std::string* str) const
+{
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(GetEntryPath(extension));
+  if (!buffer)
+    return false;
+
+  *str = (*buffer)->getBuffer().str();
+  return true;
+}
+
+bool CompileCache::StoreString(const char* extension, const std::string& str) const
+{
+  return StoreData(extension, str.data(), str.size());
+}
+
+bool CompileCache::LoadFile(const char* extension, const std::string& filename) const
+{
+  std::string path = GetEntryPath(extension);
+  return llvm::sys::fs::exists(path) && !llvm::sys::fs::copy_file(path, filename);
+}
+
+bool CompileCache::StoreFile(const char* extension, const std::string& filename) const
+{
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(filename);
+  if (!buffer)
+  {
+    Log_ErrorPrintf("Failed to read %s: %s", filename.c_str(), buffer.getError().message().c_str());
+    return false;
+  }
+
+  return StoreData(extension, (*buffer)->getBufferStart(), (*buffer)->getBufferSize());
+}
+
+bool CompileCache::StoreData(const char* extension, const void* data, size_t size) const
+{
+  std::string path = GetEntryPath(extension);
+  std::string model = StringFromFormat("%s/%s-%%%%%%%%%%%%.tmp", m_directory.c_str(), m_key.c_str());
+  llvm::SmallString<128> temp_path;
+  int fd;
+  std::error_code ec = llvm::sys::fs::createUniqueFile(model, fd, temp_path);
+  if (ec)
+  {
+    Log_ErrorPrintf("Failed to create cache entry %s: %s", path.c_str(), ec.message().c_str());
+    return false;
+  }
+
+  {
+    llvm::raw_fd_ostream os(fd, true);
+    os.write(static_cast<const char*>(data), size);
+    os.close();
+    if (os.has_error())
+    {
+      os.clear_error();
+      Log_ErrorPrintf("Failed to write cache entry %s", path.c_str());
+      llvm::sys::fs::remove(temp_path);
+      return false;
+    }
+  }
+
+  ec = llvm::sys::fs::rename(temp_path, path);
+  if (ec)
+  {
+    Log_ErrorPrintf("Failed to store cache entry %s: %s", path.c_str(), ec.message().c_str());
+    llvm::sys::fs::remove(temp_path);
+    return false;
+  }
+
+  Log_DevPrintf("Stored cache entry %s", path.c_str());
+  return true;
+}
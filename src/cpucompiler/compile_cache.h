@@ -0,0 +1,57 @@
+#pragma once
+#include <memory>
+#include <string>
+#include "common/types.h"
+#include "llvm/Support/MD5.h"
+
+namespace llvm
+{
+class LLVMContext;
+class Module;
+}
+
+// On-disk cache of generated code, in a directory shared between compiler runs. Entries are named by a hash of
+// everything that affects the code: the source, the compiler itself, the runtime library and the options. An
+// unchanged program can then skip parsing, stream graph elaboration, code generation and optimization.
+// Entries are written to a temporary file and renamed into place, so concurrent compiler runs never see partial
+// files.
+class CompileCache
+{
+public:
+  CompileCache(const std::string& directory);
+  ~CompileCache();
+
+  // Adds to the key. All key data must be added before Finish().
+  void AddKeyData(const void* data, size_t size);
+  void AddKeyString(const std::string& str);
+  void AddKeyInt(u64 value);
+
+  // Adds the contents of the file to the key. Returns false if it can't be read.
+  bool AddKeyFile(const std::string& filename);
+
+  // Computes the key, and creates the directory if it doesn't exist.
+  bool Finish();
+
+  const std::string& GetKey() const { return m_key; }
+
+  // Path of the entry with this extension, e.g. "bc".
+  std::string GetEntryPath(const char* extension) const;
+
+  // Returns nullptr if the entry doesn't exist or is unreadable.
+  std::unique_ptr<llvm::Module> LoadModule(llvm::LLVMContext& context) const;
+  bool StoreModule(llvm::Module* mod) const;
+
+  bool LoadString(const char* extension, std::string* str) const;
+  bool StoreString(const char* extension, const std::string& str) const;
+
+  // Copies an entry out to, or in from, another file.
+  bool LoadFile(const char* extension, const std::string& filename) const;
+  bool StoreFile(const char* extension, const std::string& filename) const;
+
+private:
+  bool StoreData(const char* extension, const void* data, size_t size) const;
+
+  std::string m_directory;
+  llvm::MD5 m_hash;
+  std::string m_key;
+};
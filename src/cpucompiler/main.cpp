@@ -1,19 +1,47 @@
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <getopt.h>
 #include <iostream>
 #include <memory>
+#include <set>
+#include <string>
+#include <vector>
 #include "common/log.h"
+#include "cpucompiler/compile_cache.h"
 #include "cputarget/program_builder.h"
 #include "frontend/wrapped_llvm_context.h"
 #include "llvm/Bitcode/BitcodeWriter.h"
-#include "llvm/ExecutionEngine/ExecutionEngine.h"
-#include "llvm/ExecutionEngine/GenericValue.h"
-#include "llvm/ExecutionEngine/MCJIT.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Mangler.h"
 #include "llvm/IR/Module.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/Program.h"
 #include "llvm/Support/Signals.h"
+#include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
 #include "parser/ast.h"
 #include "parser/ast_printer.h"
 #include "parser/parser_state.h"
@@ -21,6 +49,13 @@
 #include "streamgraph/streamgraph.h"
 Log_SetChannel(CPUCompiler);
 
+// CPU and features native code is generated for. "native" selects the host's.
+struct NativeTargetOptions
+{
+  std::string cpu;
+  std::string attrs;
+};
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 static std::unique_ptr<ParserState> ParseFile(Frontend::WrappedLLVMContext* ctx, const char* filename, std::FILE* fp,
@@ -31,26 +66,74 @@ static std::unique_ptr<StreamGraph::StreamGraph> GenerateStreamGraph(Frontend::W
                                                                      ParserState* parser);
 static void DumpStreamGraph(StreamGraph::StreamGraph* streamgraph);
 
+static std::unique_ptr<llvm::TargetMachine>
+CreateTargetMachine(const NativeTargetOptions& target, llvm::CodeGenOpt::Level level,
+                    llvm::CodeModel::Model code_model = llvm::CodeModel::Default);
+static void GetVectorRegisterBits(const llvm::TargetMachine* target_machine, CPUTarget::CodeGenOptions* options);
+static std::unique_ptr<CompileCache> OpenCompileCache(const std::string& directory, const char* argv0,
+                                                      const char* filename, llvm::TargetMachine* target_machine,
+                                                      const CPUTarget::CodeGenOptions& options, bool optimize,
+                                                      const CPUTarget::OptimizationOptions& optimization_options,
+                                                      u32 max_fused_filters, u32 max_fission_ways, bool link_runtime);
 static std::unique_ptr<llvm::Module> GenerateCode(Frontend::WrappedLLVMContext* ctx, ParserState* parser,
-                                                  StreamGraph::StreamGraph* streamgraph, bool optimize);
+                                                  StreamGraph::StreamGraph* streamgraph,
+                                                  const CPUTarget::CodeGenOptions& options, bool optimize,
+                                                  const CPUTarget::OptimizationOptions& optimization_options,
+                                                  llvm::TargetMachine* target_machine, bool buffer_report,
+                                                  bool link_runtime, std::string* library_header);
 static void DumpModule(Frontend::WrappedLLVMContext* ctx, llvm::Module* mod);
+static std::string LocateRuntimeLibraryFile(const char* filename);
 static bool WriteModule(Frontend::WrappedLLVMContext* ctx, llvm::Module* mod, const char* filename);
-static bool WriteProgram(Frontend::WrappedLLVMContext* ctx, llvm::Module* mod, bool optimize_ir, const char* filename);
-static bool ExecuteModule(Frontend::WrappedLLVMContext* ctx, std::unique_ptr<llvm::Module> mod);
+static bool WriteProgram(Frontend::WrappedLLVMContext* ctx, llvm::Module* mod, llvm::TargetMachine* target_machine,
+                         const char* filename, const CompileCache* cache);
+static bool WriteLibrary(Frontend::WrappedLLVMContext* ctx, llvm::Module* mod, llvm::TargetMachine* target_machine,
+                         const char* filename, const std::string& header, const CompileCache* cache);
+static bool ExecuteModule(Frontend::WrappedLLVMContext* ctx, std::unique_ptr<llvm::Module> mod,
+                          const NativeTargetOptions& target, llvm::CodeGenOpt::Level level, bool lazy,
+                          const std::vector<std::string>& program_args);
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 static void usage(const char* progname)
 {
-  fprintf(stderr, "usage: %s [-w outfile] [-a] [-d] [-a] [-s] [-i] [-o] [-e] [-h]\n", progname);
+  fprintf(stderr, "usage: %s [-w outfile] [-O outfile] [-L outfile] [-a] [-d] [-a] [-s] [-i] [-o] [-e] [-j threads] "
+                  "[-B] [-F filters] [-f ways] [-V] [-P] [--vector-width width] [--buffer-report] [--iterations n] "
+                  "[--instance-state] [--mcpu cpu] [--mattr features] [--opt-level n] [--size-level n] "
+                  "[--no-loop-vectorize] [--no-slp-vectorize] [--unroll-threshold n] [--cache-dir dir] "
+                  "[--channel-stats] [--schedule strategy] [--scale factor] [--cache-size kb] [-h]\n",
+          progname);
   fprintf(stderr, "  -w: Write LLVM bitcode file.\n");
   fprintf(stderr, "  -d: Debug parser.\n");
   fprintf(stderr, "  -a: Dump abstract syntax tree.\n");
   fprintf(stderr, "  -s: Dump stream graph.\n");
   fprintf(stderr, "  -i: Dump LLVM IR.\n");
   fprintf(stderr, "  -o: Optimize LLVM IR.\n");
+  fprintf(stderr, "  --opt-level: Optimization level for -o, 0 to 3, defaults to 2.\n");
+  fprintf(stderr, "  --size-level: Optimize for size with -o, 1 for -Os, 2 for -Oz.\n");
+  fprintf(stderr, "  --no-loop-vectorize: Disable the loop vectorizer with -o.\n");
+  fprintf(stderr, "  --no-slp-vectorize: Disable the SLP vectorizer with -o.\n");
+  fprintf(stderr, "  --unroll-threshold: Cost threshold for unrolling loops with -o, 0 disables unrolling.\n");
   fprintf(stderr, "  -e: Execute program after compilation.\n");
   fprintf(stderr, "  -O: Compile program to binary.\n");
+  fprintf(stderr, "  -L: Compile program to a shared library with a C header, instead of a binary.\n");
+  fprintf(stderr, "  --mcpu: CPU to optimize and generate code for, or native for the host.\n");
+  fprintf(stderr, "  --mattr: Comma-separated CPU features to enable (+feature) or disable (-feature).\n");
+  fprintf(stderr, "  -j: Number of threads to partition the steady state across.\n");
+  fprintf(stderr, "  -B: Use static channel buffers, reset at each steady state.\n");
+  fprintf(stderr, "  -F: Fuse up to this many adjacent filters into a single work function.\n");
+  fprintf(stderr, "  -f: Replicate stateless bottleneck filters up to this many ways, use with -j.\n");
+  fprintf(stderr, "  -V: Vectorize work functions of stateless filters across firings.\n");
+  fprintf(stderr, "  -P: Count the cycles spent in each filter, reported when the program exits.\n");
+  fprintf(stderr, "  --vector-width: Firings per vector with -V, defaults to the target's vector registers.\n");
+  fprintf(stderr, "  --buffer-report: Print channel buffer sizes and the memory saved by analysis.\n");
+  fprintf(stderr, "  --channel-stats: Record channel high-water marks and stalls, reported when the program exits.\n");
+  fprintf(stderr, "  --schedule: Steady state schedule, single (default), push for the smallest channels, or phased\n"
+                  "              for the lowest latency. Single-threaded only.\n");
+  fprintf(stderr, "  --scale: Multiply firings per steady state by this factor, or auto to fit the cache size.\n");
+  fprintf(stderr, "  --cache-size: Kilobytes the working set is fitted to with --scale auto, defaults to 256.\n");
+  fprintf(stderr, "  --iterations: Stop the program executed with -e after this many steady states.\n");
+  fprintf(stderr, "  --instance-state: Keep program state in an instance struct instead of globals, see -L.\n");
+  fprintf(stderr, "  --cache-dir: Reuse generated code for unchanged programs and options from this directory.\n");
   fprintf(stderr, "  -h: Print this help message.\n");
   fprintf(stderr, "\n");
   std::exit(EXIT_FAILURE);
@@ -70,10 +153,59 @@ int main(int argc, char* argv[])
   bool write_llvm_ir = false;
   bool execute_program = false;
   bool write_program = false;
+  bool write_library = false;
+  bool buffer_report = false;
+  u32 max_fused_filters = 0;
+  u32 max_fission_ways = 0;
+  CPUTarget::CodeGenOptions codegen_options;
+  NativeTargetOptions target_options;
+  CPUTarget::OptimizationOptions optimization_options;
+  std::string cache_directory;
+
+  // Passed to the main function of the executed program, which handles the runtime's options.
+  std::vector<std::string> program_args = {"streamit"};
+
+  enum : int
+  {
+    OPTION_BUFFER_REPORT = 256,
+    OPTION_VECTOR_WIDTH,
+    OPTION_ITERATIONS,
+    OPTION_INSTANCE_STATE,
+    OPTION_MCPU,
+    OPTION_MATTR,
+    OPTION_OPT_LEVEL,
+    OPTION_SIZE_LEVEL,
+    OPTION_NO_LOOP_VECTORIZE,
+    OPTION_NO_SLP_VECTORIZE,
+    OPTION_UNROLL_THRESHOLD,
+    OPTION_CACHE_DIR,
+    OPTION_CHANNEL_STATS,
+    OPTION_SCHEDULE,
+    OPTION_SCALE,
+    OPTION_CACHE_SIZE
+  };
+  static const struct option long_options[] = {{"buffer-report", no_argument, nullptr, OPTION_BUFFER_REPORT},
+                                               {"vector-width", required_argument, nullptr, OPTION_VECTOR_WIDTH},
+                                               {"iterations", required_argument, nullptr, OPTION_ITERATIONS},
+                                               {"instance-state", no_argument, nullptr, OPTION_INSTANCE_STATE},
+                                               {"mcpu", required_argument, nullptr, OPTION_MCPU},
+                                               {"mattr", required_argument, nullptr, OPTION_MATTR},
+                                               {"opt-level", required_argument, nullptr, OPTION_OPT_LEVEL},
+                                               {"size-level", required_argument, nullptr, OPTION_SIZE_LEVEL},
+                                               {"no-loop-vectorize", no_argument, nullptr, OPTION_NO_LOOP_VECTORIZE},
+                                               {"no-slp-vectorize", no_argument, nullptr, OPTION_NO_SLP_VECTORIZE},
+                                               {"unroll-threshold", required_argument, nullptr,
+                                                OPTION_UNROLL_THRESHOLD},
+                                               {"cache-dir", required_argument, nullptr, OPTION_CACHE_DIR},
+                                               {"channel-stats", no_argument, nullptr, OPTION_CHANNEL_STATS},
+                                               {"schedule", required_argument, nullptr, OPTION_SCHEDULE},
+                                               {"scale", required_argument, nullptr, OPTION_SCALE},
+                                               {"cache-size", required_argument, nullptr, OPTION_CACHE_SIZE},
+                                               {nullptr, 0, nullptr, 0}};
 
   int c;
 
-  while ((c = getopt(argc, argv, "dasioehw:O:")) != -1)
+  while ((c = getopt_long(argc, argv, "dasioehBVPw:O:L:j:F:f:", long_options, nullptr)) != -1)
   {
     switch (c)
     {
@@ -87,6 +219,114 @@ int main(int argc, char* argv[])
       write_program = true;
       break;
 
+    case 'L':
+      output_filename = optarg;
+      write_library = true;
+      codegen_options.library = true;
+      break;
+
+    case 'j':
+      codegen_options.num_threads = static_cast<u32>(std::max(std::atoi(optarg), 1));
+      break;
+
+    case 'B':
+      codegen_options.static_buffers = true;
+      break;
+
+    case 'V':
+      codegen_options.vectorize = true;
+      break;
+
+    case 'P':
+      codegen_options.profile = true;
+      break;
+
+    case OPTION_VECTOR_WIDTH:
+      codegen_options.vector_width = static_cast<u32>(std::max(std::atoi(optarg), 0));
+      break;
+
+    case 'F':
+      max_fused_filters = static_cast<u32>(std::max(std::atoi(optarg), 0));
+      break;
+
+    case 'f':
+      max_fission_ways = static_cast<u32>(std::max(std::atoi(optarg), 0));
+      break;
+
+    case OPTION_BUFFER_REPORT:
+      buffer_report = true;
+      break;
+
+    case OPTION_ITERATIONS:
+      program_args.push_back("--iterations");
+      program_args.push_back(optarg);
+      break;
+
+    case OPTION_INSTANCE_STATE:
+      codegen_options.instance_state = true;
+      break;
+
+    case OPTION_MCPU:
+      target_options.cpu = optarg;
+      break;
+
+    case OPTION_MATTR:
+      target_options.attrs = optarg;
+      break;
+
+    case OPTION_OPT_LEVEL:
+      optimization_options.opt_level = static_cast<u32>(std::min(std::max(std::atoi(optarg), 0), 3));
+      break;
+
+    case OPTION_SIZE_LEVEL:
+      optimization_options.size_level = static_cast<u32>(std::min(std::max(std::atoi(optarg), 0), 2));
+      break;
+
+    case OPTION_NO_LOOP_VECTORIZE:
+      optimization_options.loop_vectorize = false;
+      break;
+
+    case OPTION_NO_SLP_VECTORIZE:
+      optimization_options.slp_vectorize = false;
+      break;
+
+    case OPTION_UNROLL_THRESHOLD:
+      optimization_options.unroll_threshold = std::atoi(optarg);
+      break;
+
+    case OPTION_CACHE_DIR:
+      cache_directory = optarg;
+      break;
+
+    case OPTION_CHANNEL_STATS:
+      codegen_options.channel_stats = true;
+      break;
+
+    case OPTION_SCHEDULE:
+      if (std::strcmp(optarg, "single") == 0)
+        codegen_options.schedule_strategy = CPUTarget::ScheduleStrategy::SingleAppearance;
+      else if (std::strcmp(optarg, "push") == 0)
+        codegen_options.schedule_strategy = CPUTarget::ScheduleStrategy::Push;
+      else if (std::strcmp(optarg, "phased") == 0)
+        codegen_options.schedule_strategy = CPUTarget::ScheduleStrategy::Phased;
+      else
+      {
+        fprintf(stderr, "%s: unknown schedule: %s\n", argv[0], optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case OPTION_SCALE:
+      if (std::strcmp(optarg, "auto") == 0)
+        codegen_options.steady_state_scale = 0;
+      else
+        codegen_options.steady_state_scale = static_cast<u32>(std::max(std::atoi(optarg), 1));
+      break;
+
+    case OPTION_CACHE_SIZE:
+      codegen_options.cache_size = static_cast<u32>(std::min(std::max(std::atoi(optarg), 1), 1024 * 1024)) * 1024;
+      break;
+
     case 'd':
       debug_parser = true;
       break;
@@ -134,26 +374,84 @@ int main(int argc, char* argv[])
     }
   }
 
-  std::unique_ptr<Frontend::WrappedLLVMContext> llvm_context = Frontend::WrappedLLVMContext::Create();
-  std::unique_ptr<ParserState> parser = ParseFile(llvm_context.get(), filename, fp, debug_parser);
-  std::fclose(fp);
-  if (!parser)
+  // The JIT resolves runtime calls to the compiler's own copy of the runtime, so only native code links it in.
+  bool link_runtime = (write_program || write_library) && !execute_program;
+
+  // The optimizer's cost models and code generation use the same target, so they agree on what is cheap.
+  static const llvm::CodeGenOpt::Level codegen_levels[] = {llvm::CodeGenOpt::None, llvm::CodeGenOpt::Less,
+                                                           llvm::CodeGenOpt::Default, llvm::CodeGenOpt::Aggressive};
+  llvm::CodeGenOpt::Level codegen_level =
+    optimize_llvm_ir ? codegen_levels[optimization_options.opt_level] : llvm::CodeGenOpt::None;
+  std::unique_ptr<llvm::TargetMachine> target_machine = CreateTargetMachine(target_options, codegen_level);
+  if (!target_machine)
     return EXIT_FAILURE;
+  GetVectorRegisterBits(target_machine.get(), &codegen_options);
 
-  if (dump_ast)
-    DumpAST(parser.get());
+  // Dumps and reports come from the parser and stream graph, so they always compile from source.
+  std::unique_ptr<CompileCache> cache;
+  if (!cache_directory.empty())
+  {
+    if (fp == stdin || debug_parser || dump_ast || dump_stream_graph || buffer_report)
+    {
+      Log_WarningPrintf("Not using the cache for stdin, -d, -a, -s or --buffer-report");
+    }
+    else
+    {
+      cache = OpenCompileCache(cache_directory, argv[0], filename, target_machine.get(), codegen_options,
+                               optimize_llvm_ir, optimization_options, max_fused_filters, max_fission_ways,
+                               link_runtime);
+    }
+  }
 
-  std::unique_ptr<StreamGraph::StreamGraph> streamgraph = GenerateStreamGraph(llvm_context.get(), parser.get());
-  if (!streamgraph)
-    return EXIT_FAILURE;
+  std::unique_ptr<Frontend::WrappedLLVMContext> llvm_context = Frontend::WrappedLLVMContext::Create();
+  std::string library_header;
+  std::unique_ptr<llvm::Module> module;
+  if (cache)
+  {
+    module = cache->LoadModule(llvm_context->GetLLVMContext());
+    if (module && codegen_options.library && !cache->LoadString("h", &library_header))
+      module.reset();
+    if (module)
+      Log_InfoPrintf("Using cached code for %s (%s)", filename, cache->GetKey().c_str());
+  }
 
-  if (dump_stream_graph)
-    DumpStreamGraph(streamgraph.get());
+  if (module)
+  {
+    std::fclose(fp);
+  }
+  else
+  {
+    std::unique_ptr<ParserState> parser = ParseFile(llvm_context.get(), filename, fp, debug_parser);
+    std::fclose(fp);
+    if (!parser)
+      return EXIT_FAILURE;
 
-  std::unique_ptr<llvm::Module> module =
-    GenerateCode(llvm_context.get(), parser.get(), streamgraph.get(), optimize_llvm_ir);
-  if (!module)
-    return EXIT_FAILURE;
+    if (dump_ast)
+      DumpAST(parser.get());
+
+    std::unique_ptr<StreamGraph::StreamGraph> streamgraph = GenerateStreamGraph(llvm_context.get(), parser.get());
+    if (!streamgraph)
+      return EXIT_FAILURE;
+
+    // Fission runs after fusion, otherwise the replicas would be fused straight back together.
+    if ((max_fused_filters > 1 && !streamgraph->FuseFilters(max_fused_filters)) ||
+        (max_fission_ways > 1 && !streamgraph->FissionFilters(max_fission_ways)))
+    {
+      return EXIT_FAILURE;
+    }
+
+    if (dump_stream_graph)
+      DumpStreamGraph(streamgraph.get());
+
+    module = GenerateCode(llvm_context.get(), parser.get(), streamgraph.get(), codegen_options, optimize_llvm_ir,
+                          optimization_options, target_machine.get(), buffer_report, link_runtime, &library_header);
+    if (!module)
+      return EXIT_FAILURE;
+
+    // A failure to store only costs the next run a full compile.
+    if (cache && cache->StoreModule(module.get()) && codegen_options.library)
+      cache->StoreString("h", library_header);
+  }
 
   if (dump_llvm_ir)
     DumpModule(llvm_context.get(), module.get());
@@ -162,10 +460,19 @@ int main(int argc, char* argv[])
     WriteModule(llvm_context.get(), module.get(), output_filename.c_str());
 
   if (write_program)
-    WriteProgram(llvm_context.get(), module.get(), optimize_llvm_ir, output_filename.c_str());
+    WriteProgram(llvm_context.get(), module.get(), target_machine.get(), output_filename.c_str(), cache.get());
+
+  if (write_library)
+  {
+    WriteLibrary(llvm_context.get(), module.get(), target_machine.get(), output_filename.c_str(), library_header,
+                 cache.get());
+  }
 
   if (execute_program)
-    ExecuteModule(llvm_context.get(), std::move(module));
+  {
+    ExecuteModule(llvm_context.get(), std::move(module), target_options, codegen_level,
+                  !codegen_options.IsThreaded(), program_args);
+  }
 
   return EXIT_SUCCESS;
 }
@@ -222,12 +529,80 @@ void DumpStreamGraph(StreamGraph::StreamGraph* streamgraph)
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+std::unique_ptr<CompileCache> OpenCompileCache(const std::string& directory, const char* argv0, const char* filename,
+                                               llvm::TargetMachine* target_machine,
+                                               const CPUTarget::CodeGenOptions& options, bool optimize,
+                                               const CPUTarget::OptimizationOptions& optimization_options,
+                                               u32 max_fused_filters, u32 max_fission_ways, bool link_runtime)
+{
+  std::unique_ptr<CompileCache> cache = std::make_unique<CompileCache>(directory);
+
+  // Bump when the cache layout or key changes.
+  cache->AddKeyString("streamit-cpu-compiler cache 1");
+  cache->AddKeyString(LLVM_VERSION_STRING);
+
+  // Any rebuild of the compiler replaces the executable, which is cheaper to identify than to hash.
+  llvm::sys::fs::file_status exe_status;
+  std::string exe_path = llvm::sys::fs::getMainExecutable(argv0, reinterpret_cast<void*>(&OpenCompileCache));
+  if (exe_path.empty() || llvm::sys::fs::status(exe_path, exe_status))
+  {
+    Log_WarningPrintf("Failed to identify the compiler executable, not using the cache");
+    return nullptr;
+  }
+  cache->AddKeyString(exe_path);
+  cache->AddKeyInt(exe_status.getSize());
+  cache->AddKeyInt(u64(exe_status.getLastModificationTime().time_since_epoch().count()));
+
+  if (!cache->AddKeyFile(filename))
+    return nullptr;
+
+  std::string runtime_bitcode_path = link_runtime ? LocateRuntimeLibraryFile("cpuruntimelibrary.bc") : std::string();
+  cache->AddKeyString(runtime_bitcode_path);
+  if (!runtime_bitcode_path.empty() && !cache->AddKeyFile(runtime_bitcode_path))
+    return nullptr;
+
+  // The target machine has "native" resolved, so hosts with different CPUs get different entries.
+  cache->AddKeyString(target_machine->getTargetTriple().str());
+  cache->AddKeyString(target_machine->getTargetCPU().str());
+  cache->AddKeyString(target_machine->getTargetFeatureString().str());
+  cache->AddKeyInt(options.num_threads);
+  cache->AddKeyInt(options.static_buffers);
+  cache->AddKeyInt(options.vectorize);
+  cache->AddKeyInt(options.vector_width);
+  cache->AddKeyInt(options.int_vector_register_bits);
+  cache->AddKeyInt(options.float_vector_register_bits);
+  cache->AddKeyInt(options.library);
+  cache->AddKeyInt(options.instance_state);
+  cache->AddKeyInt(options.profile);
+  cache->AddKeyInt(options.channel_stats);
+  cache->AddKeyInt(static_cast<u64>(options.schedule_strategy));
+  cache->AddKeyInt(options.steady_state_scale);
+  cache->AddKeyInt(options.cache_size);
+  cache->AddKeyInt(optimize);
+  cache->AddKeyInt(optimization_options.opt_level);
+  cache->AddKeyInt(optimization_options.size_level);
+  cache->AddKeyInt(optimization_options.loop_vectorize);
+  cache->AddKeyInt(optimization_options.slp_vectorize);
+  cache->AddKeyInt(u64(i64(optimization_options.unroll_threshold)));
+  cache->AddKeyInt(max_fused_filters);
+  cache->AddKeyInt(max_fission_ways);
+  cache->AddKeyInt(link_runtime);
+  if (!cache->Finish())
+    return nullptr;
+
+  return cache;
+}
+
 std::unique_ptr<llvm::Module> GenerateCode(Frontend::WrappedLLVMContext* ctx, ParserState* parser,
-                                           StreamGraph::StreamGraph* streamgraph, bool optimize)
+                                           StreamGraph::StreamGraph* streamgraph,
+                                           const CPUTarget::CodeGenOptions& options, bool optimize,
+                                           const CPUTarget::OptimizationOptions& optimization_options,
+                                           llvm::TargetMachine* target_machine, bool buffer_report, bool link_runtime,
+                                           std::string* library_header)
 {
   Log_InfoPrintf("Generating code...");
 
-  CPUTarget::ProgramBuilder builder(ctx, parser->GetEntryPointName());
+  CPUTarget::ProgramBuilder builder(ctx, parser->GetEntryPointName(), options);
   if (!builder.GenerateCode(streamgraph))
   {
     Log_ErrorPrintf("Code generation failed.");
@@ -241,8 +616,24 @@ std::unique_ptr<llvm::Module> GenerateCode(Frontend::WrappedLLVMContext* ctx, Pa
     return nullptr;
   }
 
+  if (buffer_report)
+    std::cout << builder.GetBufferReport(streamgraph);
+
+  if (options.library)
+    *library_header = builder.GetLibraryHeader(streamgraph);
+
+  // Linked before optimizing, so runtime calls can be inlined and specialized on the constant token sizes.
+  if (link_runtime)
+  {
+    std::string runtime_bitcode_path = LocateRuntimeLibraryFile("cpuruntimelibrary.bc");
+    if (runtime_bitcode_path.empty())
+      Log_WarningPrintf("Runtime library bitcode not found, runtime calls will not be inlined.");
+    else if (!builder.LinkRuntimeLibrary(runtime_bitcode_path))
+      return nullptr;
+  }
+
   if (optimize)
-    builder.OptimizeModule();
+    builder.OptimizeModule(optimization_options, target_machine);
 
   return builder.DetachModule();
 }
@@ -264,12 +655,12 @@ bool WriteModule(Frontend::WrappedLLVMContext* ctx, llvm::Module* mod, const cha
   return !ec;
 }
 
-static std::string LocateRuntimeLibraryLib()
+std::string LocateRuntimeLibraryFile(const char* filename)
 {
   std::string existing_path;
 
-  auto TryPath = [&existing_path](const char* path) {
-    std::FILE* f = fopen(path, "rb");
+  auto TryPath = [&existing_path](const std::string& path) {
+    std::FILE* f = fopen(path.c_str(), "rb");
     if (!f)
       return false;
 
@@ -278,9 +669,8 @@ static std::string LocateRuntimeLibraryLib()
     return true;
   };
 
-  if (!TryPath("libcpuruntimelibrary_static.a") &&
-      !TryPath("src/cputarget/runtimelibrary/libcpuruntimelibrary_static.a") &&
-      !TryPath("../src/cputarget/runtimelibrary/libcpuruntimelibrary_static.a"))
+  if (!TryPath(filename) && !TryPath(StringFromFormat("src/cputarget/runtimelibrary/%s", filename)) &&
+      !TryPath(StringFromFormat("../src/cputarget/runtimelibrary/%s", filename)))
   {
     return {};
   }
@@ -288,7 +678,176 @@ static std::string LocateRuntimeLibraryLib()
   return existing_path;
 }
 
-bool WriteProgram(Frontend::WrappedLLVMContext* ctx, llvm::Module* mod, bool optimize_ir, const char* filename)
+static std::string LocateRuntimeLibraryLib()
+{
+  return LocateRuntimeLibraryFile("libcpuruntimelibrary_static.a");
+}
+
+static std::string GetTargetCPU(const NativeTargetOptions& target)
+{
+  if (target.cpu == "native")
+    return llvm::sys::getHostCPUName();
+
+  return target.cpu.empty() ? std::string("generic") : target.cpu;
+}
+
+static std::vector<std::string> GetTargetFeatures(const NativeTargetOptions& target)
+{
+  // The host's features come first, so --mattr can turn them off again.
+  llvm::SubtargetFeatures features;
+  llvm::StringMap<bool> host_features;
+  if (target.cpu == "native" && llvm::sys::getHostCPUFeatures(host_features))
+  {
+    for (auto& it : host_features)
+      features.AddFeature(it.first(), it.second);
+  }
+
+  llvm::SmallVector<llvm::StringRef, 8> attrs;
+  llvm::StringRef(target.attrs).split(attrs, ',', -1, false);
+  for (llvm::StringRef attr : attrs)
+    features.AddFeature(attr.trim());
+
+  return features.getFeatures();
+}
+
+std::unique_ptr<llvm::TargetMachine> CreateTargetMachine(const NativeTargetOptions& target,
+                                                        llvm::CodeGenOpt::Level level,
+                                                        llvm::CodeModel::Model code_model)
+{
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+
+  std::string error_msg;
+  std::string triple = llvm::sys::getDefaultTargetTriple();
+  const llvm::Target* llvm_target = llvm::TargetRegistry::lookupTarget(triple, error_msg);
+  if (!llvm_target)
+  {
+    Log_ErrorPrintf("Failed to look up target %s: %s", triple.c_str(), error_msg.c_str());
+    return nullptr;
+  }
+
+  // Position-independent, so the object can go into a library, or a PIE executable which most linkers default to.
+  std::string cpu = GetTargetCPU(target);
+  std::string features = llvm::join(GetTargetFeatures(target), ",");
+  std::unique_ptr<llvm::TargetMachine> target_machine(llvm_target->createTargetMachine(
+    triple, cpu, features, llvm::TargetOptions(), llvm::Reloc::PIC_, code_model, level));
+  if (!target_machine)
+  {
+    Log_ErrorPrintf("Failed to create target machine for %s (%s)", triple.c_str(), cpu.c_str());
+    return nullptr;
+  }
+
+  return target_machine;
+}
+
+void GetVectorRegisterBits(const llvm::TargetMachine* target_machine, CPUTarget::CodeGenOptions* options)
+{
+  // Other targets keep the 128-bit default, and only x86 feature names are known to its subtarget.
+  const llvm::Triple& triple = target_machine->getTargetTriple();
+  if (triple.getArch() != llvm::Triple::x86 && triple.getArch() != llvm::Triple::x86_64)
+    return;
+
+  // AVX only has 256-bit floating-point operations, integer ones came with AVX2.
+  const llvm::MCSubtargetInfo* subtarget = target_machine->getMCSubtargetInfo();
+  if (subtarget->checkFeatures("+avx512f"))
+  {
+    options->int_vector_register_bits = 512;
+    options->float_vector_register_bits = 512;
+  }
+  else if (subtarget->checkFeatures("+avx2"))
+  {
+    options->int_vector_register_bits = 256;
+    options->float_vector_register_bits = 256;
+  }
+  else if (subtarget->checkFeatures("+avx"))
+  {
+    options->float_vector_register_bits = 256;
+  }
+}
+
+static bool WriteObjectFile(llvm::Module* mod, llvm::TargetMachine* target_machine, const char* filename)
+{
+  mod->setTargetTriple(target_machine->getTargetTriple().str());
+  mod->setDataLayout(target_machine->createDataLayout());
+
+  Log_InfoPrintf("Writing %s object for %s to %s...", target_machine->getTargetTriple().str().c_str(),
+                 target_machine->getTargetCPU().str().c_str(), filename);
+
+  std::error_code ec;
+  llvm::raw_fd_ostream os(filename, ec, llvm::sys::fs::F_None);
+  if (ec)
+  {
+    Log_ErrorPrintf("Failed to open %s: %s", filename, ec.message().c_str());
+    return false;
+  }
+
+  llvm::legacy::PassManager pm;
+  if (target_machine->addPassesToEmitFile(pm, os, llvm::TargetMachine::CGFT_ObjectFile))
+  {
+    Log_ErrorPrintf("Target %s can't emit object files", target_machine->getTargetTriple().str().c_str());
+    return false;
+  }
+
+  pm.run(*mod);
+  os.flush();
+  return !os.has_error();
+}
+
+static bool WriteCachedObjectFile(llvm::Module* mod, llvm::TargetMachine* target_machine, const char* filename,
+                                  const CompileCache* cache)
+{
+  // The object only depends on the module and target, which are both part of the key.
+  if (cache && cache->LoadFile("o", filename))
+  {
+    Log_InfoPrintf("Using cached object for %s", filename);
+    return true;
+  }
+
+  if (!WriteObjectFile(mod, target_machine, filename))
+    return false;
+
+  if (cache)
+    cache->StoreFile("o", filename);
+
+  return true;
+}
+
+// The compiler driver is only used to link, since it knows where the C++ runtime and startup files are.
+static bool LinkObjectFile(const char* object_filename, const std::string& runtime_library_path, bool shared,
+                           const char* filename)
+{
+  llvm::ErrorOr<std::string> driver = llvm::sys::findProgramByName("clang++");
+  if (!driver)
+    driver = llvm::sys::findProgramByName("c++");
+  if (!driver)
+  {
+    Log_ErrorPrintf("Failed to locate clang++ or c++ to link with");
+    return false;
+  }
+
+  std::vector<const char*> args = {driver->c_str(), "-pthread"};
+  if (shared)
+    args.push_back("-shared");
+  args.insert(args.end(), {"-o", filename, object_filename, runtime_library_path.c_str(), nullptr});
+
+  std::string cmdline;
+  for (size_t i = 0; args[i]; i++)
+    cmdline += StringFromFormat("%s%s", (i > 0) ? " " : "", args[i]);
+  Log_InfoPrintf("Linking: %s", cmdline.c_str());
+
+  std::string error_msg;
+  int res = llvm::sys::ExecuteAndWait(*driver, args.data(), nullptr, nullptr, 0, 0, &error_msg);
+  if (res != 0)
+  {
+    Log_ErrorPrintf("Linker returned error %d %s", res, error_msg.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+bool WriteProgram(Frontend::WrappedLLVMContext* ctx, llvm::Module* mod, llvm::TargetMachine* target_machine,
+                  const char* filename, const CompileCache* cache)
 {
   std::string runtime_library_path = LocateRuntimeLibraryLib();
   if (runtime_library_path.empty())
@@ -297,24 +856,55 @@ bool WriteProgram(Frontend::WrappedLLVMContext* ctx, llvm::Module* mod, bool opt
     return false;
   }
 
-  std::string bc_filename = StringFromFormat("%s.bc", filename);
-  if (!WriteModule(ctx, mod, bc_filename.c_str()))
+  std::string object_filename = StringFromFormat("%s.o", filename);
+  if (!WriteCachedObjectFile(mod, target_machine, object_filename.c_str(), cache) ||
+      !LinkObjectFile(object_filename.c_str(), runtime_library_path, false, filename))
+  {
     return false;
+  }
 
-  std::string cmdline = StringFromFormat("clang++ -o %s %s %s %s", filename, optimize_ir ? "-O3" : "",
-                                         bc_filename.c_str(), runtime_library_path.c_str());
-  Log_InfoPrintf("Executing: %s", cmdline.c_str());
-  int res = system(cmdline.c_str());
-  if (res != 0)
+  Log_InfoPrintf("Program written to %s", filename);
+  return true;
+}
+
+bool WriteLibrary(Frontend::WrappedLLVMContext* ctx, llvm::Module* mod, llvm::TargetMachine* target_machine,
+                  const char* filename, const std::string& header, const CompileCache* cache)
+{
+  // The runtime library is linked in, so it has to be built position-independent.
+  std::string runtime_library_path = LocateRuntimeLibraryLib();
+  if (runtime_library_path.empty())
   {
-    Log_ErrorPrintf("Clang returned error %d\n", res);
+    Log_ErrorPrintf("Failed to locate runtime library. Not writing library.");
     return false;
   }
 
-  Log_InfoPrintf("Program written to %s", filename);
+  std::string object_filename = StringFromFormat("%s.o", filename);
+  if (!WriteCachedObjectFile(mod, target_machine, object_filename.c_str(), cache) ||
+      !LinkObjectFile(object_filename.c_str(), runtime_library_path, true, filename))
+  {
+    return false;
+  }
+
+  // libfoo.so gets libfoo.h, anything else has .h appended.
+  std::string header_filename = filename;
+  if (header_filename.size() > 3 && header_filename.compare(header_filename.size() - 3, 3, ".so") == 0)
+    header_filename.erase(header_filename.size() - 3);
+  header_filename += ".h";
+
+  std::ofstream ofs(header_filename, std::ios::out | std::ios::trunc);
+  if (!ofs.is_open() || !(ofs << header))
+  {
+    Log_ErrorPrintf("Failed to write header to %s", header_filename.c_str());
+    return false;
+  }
+
+  Log_InfoPrintf("Library written to %s, header written to %s", filename, header_filename.c_str());
+  return true;
 }
 
-bool ExecuteModule(Frontend::WrappedLLVMContext* ctx, std::unique_ptr<llvm::Module> mod)
+bool ExecuteModule(Frontend::WrappedLLVMContext* ctx, std::unique_ptr<llvm::Module> mod,
+                   const NativeTargetOptions& target, llvm::CodeGenOpt::Level level, bool lazy,
+                   const std::vector<std::string>& program_args)
 {
   Log_InfoPrintf("Executing program...");
 
@@ -322,21 +912,88 @@ bool ExecuteModule(Frontend::WrappedLLVMContext* ctx, std::unique_ptr<llvm::Modu
   llvm::InitializeNativeTargetAsmPrinter();
   llvm::InitializeNativeTargetAsmParser();
 
-  std::string error_msg;
-  llvm::ExecutionEngine* execution_engine = llvm::EngineBuilder(std::move(mod)).setErrorStr(&error_msg).create();
+  // JIT code can be placed anywhere relative to the runtime library in this process, so use the JIT code model.
+  std::unique_ptr<llvm::TargetMachine> target_machine =
+    CreateTargetMachine(target, level, llvm::CodeModel::JITDefault);
+  if (!target_machine)
+    return false;
+
+  llvm::DataLayout data_layout = target_machine->createDataLayout();
+  mod->setTargetTriple(target_machine->getTargetTriple().str());
+  mod->setDataLayout(data_layout);
 
-  if (!execution_engine)
+  std::unique_ptr<llvm::orc::JITCompileCallbackManager> callback_manager =
+    llvm::orc::createLocalCompileCallbackManager(target_machine->getTargetTriple(), 0);
+  if (!callback_manager)
   {
-    Log_ErrorPrintf("Failed to create LLVM execution engine: %s", error_msg.c_str());
+    Log_ErrorPrintf("Lazy compilation is not supported for %s", target_machine->getTargetTriple().str().c_str());
     return false;
   }
 
-  execution_engine->finalizeObject();
+  // Each function is compiled the first time it is called, so the program starts producing output before the
+  // filters it doesn't need yet are compiled. The compile callbacks aren't safe to run from several threads at once,
+  // so threaded programs compile the whole module on the first call to main, before any threads are started.
+  auto partition = [lazy](llvm::Function& func) {
+    std::set<llvm::Function*> funcs;
+    if (lazy)
+    {
+      funcs.insert(&func);
+      return funcs;
+    }
 
-  llvm::Function* main_func = execution_engine->FindFunctionNamed("main");
-  assert(main_func && "main function exists in execution engine");
-  Log_InfoPrintf("Executing main function...");
-  execution_engine->runFunction(main_func, {});
+    for (llvm::Function& other : *func.getParent())
+    {
+      if (!other.isDeclaration())
+        funcs.insert(&other);
+    }
+
+    return funcs;
+  };
+
+  llvm::orc::ObjectLinkingLayer<> object_layer;
+  llvm::orc::IRCompileLayer<decltype(object_layer)> compile_layer(object_layer,
+                                                                   llvm::orc::SimpleCompiler(*target_machine));
+  llvm::orc::CompileOnDemandLayer<decltype(compile_layer)> cod_layer(
+    compile_layer, partition, *callback_manager,
+    llvm::orc::createLocalIndirectStubsManagerBuilder(target_machine->getTargetTriple()));
+
+  // The runtime library is linked into the compiler, so anything the program doesn't define is looked up in this
+  // process. The executable exports its symbols for this.
+  llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+  auto resolver = llvm::orc::createLambdaResolver(
+    [&cod_layer](const std::string& name) {
+      if (auto symbol = cod_layer.findSymbol(name, false))
+        return symbol;
+      return llvm::JITSymbol(nullptr);
+    },
+    [](const std::string& name) {
+      if (auto address = llvm::RTDyldMemoryManager::getSymbolAddressInProcess(name))
+        return llvm::JITSymbol(address, llvm::JITSymbolFlags::Exported);
+      return llvm::JITSymbol(nullptr);
+    });
+
+  std::vector<std::unique_ptr<llvm::Module>> modules;
+  modules.push_back(std::move(mod));
+  cod_layer.addModuleSet(std::move(modules), llvm::make_unique<llvm::SectionMemoryManager>(), std::move(resolver));
+
+  std::string main_name;
+  {
+    llvm::raw_string_ostream os(main_name);
+    llvm::Mangler::getNameWithPrefix(os, "main", data_layout);
+  }
+  llvm::JITSymbol main_symbol = cod_layer.findSymbol(main_name, true);
+  assert(main_symbol && "main function exists in JIT");
+  auto main_func = reinterpret_cast<int (*)(int, char**)>(static_cast<uintptr_t>(main_symbol.getAddress()));
+
+  std::vector<std::string> args_storage(program_args);
+  std::vector<char*> args;
+  for (std::string& arg : args_storage)
+    args.push_back(&arg[0]);
+  args.push_back(nullptr);
+
+  Log_InfoPrintf("Executing main function (%s compilation)...", lazy ? "lazy" : "whole module");
+  int res = main_func(int(args_storage.size()), args.data());
+  Log_InfoPrintf("Program exited with code %d", res);
   return true;
 }
 
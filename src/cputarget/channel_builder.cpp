@@ -1,4 +1,5 @@
 #include "cputarget/channel_builder.h"
+#include <algorithm>
 #include <cassert>
 #include <vector>
 #include "common/log.h"
@@ -10,8 +11,12 @@
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/AtomicOrdering.h"
+#include "llvm/Support/MathExtras.h"
 #include "parser/ast.h"
+#include "streamgraph/buffer_size_analysis.h"
 #include "streamgraph/streamgraph.h"
 Log_SetChannel(CPUTarget::ChannelBuilder);
 
@@ -19,8 +24,88 @@ namespace CPUTarget
 {
 static u32 FIFO_QUEUE_SIZE_MULTIPLIER = 16;
 
-ChannelBuilder::ChannelBuilder(Frontend::WrappedLLVMContext* context, llvm::Module* mod)
-  : m_context(context), m_module(mod)
+// Layout of the lock-free queues used in threaded mode.
+// The producer and consumer indices live on separate cache lines to avoid false sharing.
+static const u32 SPSC_CACHE_LINE_SIZE = 64;
+enum SPSCField : u32
+{
+  SPSC_FIELD_HEAD,
+  SPSC_FIELD_CACHED_TAIL,
+  SPSC_FIELD_PRODUCER_PAD,
+  SPSC_FIELD_TAIL,
+  SPSC_FIELD_CACHED_HEAD,
+  SPSC_FIELD_CONSUMER_PAD,
+  SPSC_FIELD_DATA
+};
+
+// Layout of the counters kept for each channel with channel_stats, read by streamit_write_channel_stats.
+// Empty stalls are counted by the consumer, so they get their own cache line.
+enum ChannelStatsField : u32
+{
+  STATS_FIELD_MAX_SIZE,
+  STATS_FIELD_CAPACITY,
+  STATS_FIELD_FULL_STALLS,
+  STATS_FIELD_EMPTY_STALLS = SPSC_CACHE_LINE_SIZE / 8,
+  STATS_FIELD_COUNT
+};
+
+// Converts a free-running channel index to a position in the buffer.
+// Ring buffers are a power of two in size, so a mask is enough. Static buffers are linear and never wrap.
+static llvm::Value* BuildBufferPosition(llvm::IRBuilder<>& builder, llvm::Value* index, u32 buffer_size,
+                                        bool static_buffers)
+{
+  if (static_buffers)
+    return index;
+
+  return builder.CreateAnd(index, builder.getInt32(buffer_size - 1), "pos");
+}
+
+static llvm::Value* BuildStatsFieldPtr(llvm::IRBuilder<>& builder, llvm::GlobalVariable* stats_var,
+                                       ChannelStatsField field)
+{
+  return builder.CreateConstInBoundsGEP2_32(stats_var->getValueType(), stats_var, 0, field);
+}
+
+// Raises the channel's high-water mark to size, if it is above it. Only the producer calls this.
+static void BuildMaxSizeUpdate(llvm::IRBuilder<>& builder, llvm::GlobalVariable* stats_var, llvm::Value* size)
+{
+  // stats.max_size = max(stats.max_size, size)
+  llvm::Value* max_size_ptr = BuildStatsFieldPtr(builder, stats_var, STATS_FIELD_MAX_SIZE);
+  llvm::Value* max_size = builder.CreateLoad(max_size_ptr, "max_size");
+  llvm::Value* size64 = builder.CreateZExt(size, builder.getInt64Ty(), "size64");
+  llvm::Value* comp = builder.CreateICmpUGT(size64, max_size, "max_comp");
+  builder.CreateStore(builder.CreateSelect(comp, size64, max_size, "new_max_size"), max_size_ptr);
+}
+
+// Counts a stall the first time a channel access waits. Retries of the same access aren't counted again.
+static void BuildStallUpdate(llvm::IRBuilder<>& builder, llvm::GlobalVariable* stats_var, ChannelStatsField field,
+                             llvm::Value* first_attempt)
+{
+  // stats.field += first_attempt
+  llvm::Value* stalls_ptr = BuildStatsFieldPtr(builder, stats_var, field);
+  llvm::Value* stalls = builder.CreateLoad(stalls_ptr, "stalls");
+  builder.CreateStore(builder.CreateAdd(stalls, builder.CreateZExt(first_attempt, builder.getInt64Ty())), stalls_ptr);
+}
+
+// Moves the unconsumed elements of a linear buffer to the front, so the next steady state starts at index zero.
+static void BuildLinearBufferReset(llvm::IRBuilder<>& builder, llvm::Value* head_ptr, llvm::Value* tail_ptr,
+                                   llvm::Value* data_ptr, llvm::Type* data_type, llvm::Value* consumed,
+                                   llvm::Value* residue)
+{
+  // memmove(&data[0], &data[consumed], residue * sizeof(data_type))
+  llvm::Value* src_ptr = builder.CreateInBoundsGEP(data_type, data_ptr, {consumed}, "src_ptr");
+  llvm::Value* num_bytes = builder.CreateMul(builder.CreateZExt(residue, builder.getInt64Ty()),
+                                             llvm::ConstantExpr::getSizeOf(data_type), "num_bytes");
+  builder.CreateMemMove(data_ptr, src_ptr, num_bytes, 1);
+
+  // *head_ptr = residue
+  // *tail_ptr = 0
+  builder.CreateStore(residue, head_ptr);
+  builder.CreateStore(builder.getInt32(0), tail_ptr);
+}
+
+ChannelBuilder::ChannelBuilder(Frontend::WrappedLLVMContext* context, llvm::Module* mod, const CodeGenOptions& options)
+  : m_context(context), m_module(mod), m_options(options)
 {
 }
 
@@ -28,19 +113,76 @@ ChannelBuilder::~ChannelBuilder()
 {
 }
 
+u32 ChannelBuilder::GetInputBufferSize(const CodeGenOptions& options,
+                                       const StreamGraph::BufferSizeAnalysis* buffer_sizes,
+                                       const StreamGraph::Node* node)
+{
+  if (!buffer_sizes || !buffer_sizes->IsValid())
+    return GetDefaultInputBufferSize(node);
+
+  // Joins have one buffer per input, all of the same size.
+  const StreamGraph::Join* join = dynamic_cast<const StreamGraph::Join*>(node);
+  u32 num_inputs = join ? join->GetIncomingStreams() : 1;
+  u32 size = 0;
+  for (u32 input_index = 0; input_index < num_inputs; input_index++)
+  {
+    // Static buffers are compacted at each steady state, so need room for everything written since.
+    size = std::max(size, options.static_buffers ? buffer_sizes->GetLinearBufferSize(node, input_index) :
+                                                    buffer_sizes->GetBufferSize(node, input_index));
+  }
+
+  if (options.static_buffers)
+    return size;
+
+  // Leave room for a second steady state in threaded mode, so the producer can run ahead of the consumer.
+  if (options.IsThreaded())
+    size *= 2;
+
+  // Capacities are rounded up to a power of two, so the free-running head/tail can be wrapped with a mask.
+  return u32(llvm::PowerOf2Ceil(size));
+}
+
+u32 ChannelBuilder::GetDefaultInputBufferSize(const StreamGraph::Node* node)
+{
+  return u32(llvm::PowerOf2Ceil(node->GetNetPop() * FIFO_QUEUE_SIZE_MULTIPLIER));
+}
+
+bool ChannelBuilder::HasStaticChannels(const CodeGenOptions& options, const StreamGraph::Filter* filter)
+{
+  return (options.static_buffers && !filter->IsFused() && !filter->GetFilterPermutation()->IsBuiltin());
+}
+
+const StreamGraph::Filter* ChannelBuilder::GetStaticOutputFilter(const CodeGenOptions& options,
+                                                                 const StreamGraph::Filter* filter)
+{
+  // Splits and joins move tokens one at a time, so filters feeding them push as usual.
+  if (!HasStaticChannels(options, filter) || filter->GetOutputType()->isVoidTy() || !filter->HasOutputConnection())
+    return nullptr;
+
+  return dynamic_cast<const StreamGraph::Filter*>(filter->GetOutputConnection());
+}
+
 bool ChannelBuilder::GenerateCode(StreamGraph::Filter* filter)
 {
   m_instance_name = filter->GetName();
   if (filter->GetInputType()->isVoidTy())
     return true;
 
-  // Base the fifo queue size off the filter's multiplicity.
-  m_input_buffer_size = filter->GetNetPop() * FIFO_QUEUE_SIZE_MULTIPLIER;
+  m_input_buffer_size = GetInputBufferSize(m_options, m_buffer_sizes, filter);
   Log_InfoPrintf("Filter instance %s is using a buffer size of %u elements", filter->GetName().c_str(),
                  m_input_buffer_size);
 
-  return (GenerateFilterGlobals(filter) && GenerateFilterPeekFunction(filter) && GenerateFilterPopFunction(filter) &&
-          GenerateFilterPushFunction(filter));
+  if (m_options.IsThreaded())
+    return GenerateSPSCChannel(m_instance_name, filter->GetInputType(), m_input_buffer_size);
+
+  if (!GenerateFilterGlobals(filter) || !GenerateFilterPeekFunction(filter) || !GenerateFilterPopFunction(filter) ||
+      !GenerateFilterPushFunction(filter) || !GenerateFilterBufferFunction(filter) ||
+      !GenerateFilterPopNFunction(filter) || !GenerateFilterPushNFunction(filter))
+  {
+    return false;
+  }
+
+  return !m_options.static_buffers || GenerateFilterResetFunction(filter);
 }
 
 bool ChannelBuilder::GenerateCode(StreamGraph::Split* split)
@@ -51,11 +193,27 @@ bool ChannelBuilder::GenerateCode(StreamGraph::Split* split)
 
 bool ChannelBuilder::GenerateCode(StreamGraph::Join* join)
 {
-  m_input_buffer_size = join->GetNetPop() * FIFO_QUEUE_SIZE_MULTIPLIER;
+  m_input_buffer_size = GetInputBufferSize(m_options, m_buffer_sizes, join);
   Log_InfoPrintf("Join %s is using a buffer size of %u elements", join->GetName().c_str(), m_input_buffer_size);
 
   m_instance_name = join->GetName();
-  return (GenerateJoinGlobals(join) && GenerateJoinSyncFunction(join) && GenerateJoinPushFunction(join));
+  if (m_options.IsThreaded())
+  {
+    u32 capacity = m_input_buffer_size;
+    for (u32 input_index = 1; input_index <= join->GetIncomingStreams(); input_index++)
+    {
+      std::string input_name = StringFromFormat("%s_%u", m_instance_name.c_str(), input_index);
+      if (!GenerateSPSCChannel(input_name, join->GetInputType(), capacity))
+        return false;
+    }
+
+    return GenerateJoinWorkFunction(join);
+  }
+
+  if (!GenerateJoinGlobals(join) || !GenerateJoinSyncFunction(join) || !GenerateJoinPushFunction(join))
+    return false;
+
+  return !m_options.static_buffers || GenerateJoinResetFunction(join);
 }
 
 bool ChannelBuilder::GenerateFilterGlobals(StreamGraph::Filter* filter)
@@ -65,12 +223,13 @@ bool ChannelBuilder::GenerateFilterGlobals(StreamGraph::Filter* filter)
   // data_type data[FIFO_QUEUE_SIZE]
   // int head
   // int tail
-  // int size
+  //
+  // head and tail are free-running, the number of elements in the queue is (head - tail).
   //
   llvm::ArrayType* data_array_ty = llvm::ArrayType::get(filter->GetInputType(), m_input_buffer_size);
   m_input_buffer_type =
     llvm::StructType::create(StringFromFormat("%s_buf_type", m_instance_name.c_str()), data_array_ty,
-                             m_context->GetIntType(), m_context->GetIntType(), m_context->GetIntType(), nullptr);
+                             m_context->GetIntType(), m_context->GetIntType(), nullptr);
 
   // Create global variable
   m_input_buffer_var = new llvm::GlobalVariable(*m_module, m_input_buffer_type, true, llvm::GlobalValue::PrivateLinkage,
@@ -80,6 +239,8 @@ bool ChannelBuilder::GenerateFilterGlobals(StreamGraph::Filter* filter)
   llvm::ConstantAggregateZero* buffer_initializer = llvm::ConstantAggregateZero::get(m_input_buffer_type);
   m_input_buffer_var->setConstant(false);
   m_input_buffer_var->setInitializer(buffer_initializer);
+
+  m_stats_var = m_options.channel_stats ? GenerateChannelStats(m_instance_name, m_input_buffer_size) : nullptr;
   return true;
 }
 
@@ -109,9 +270,9 @@ bool ChannelBuilder::GenerateFilterPeekFunction(StreamGraph::Filter* filter)
                                                     {builder.getInt32(0), builder.getInt32(2)}, "tail_ptr");
   llvm::Value* pos_1 = builder.CreateLoad(tail_ptr, "pos_1");
 
-  // pos = (pos_1 + index) % m_input_buffer_size
+  // pos = (pos_1 + index) & (FIFO_QUEUE_SIZE - 1)
   llvm::Value* pos_2 = builder.CreateAdd(pos_1, index, "pos_2");
-  llvm::Value* pos = builder.CreateURem(pos_2, builder.getInt32(m_input_buffer_size), "tail");
+  llvm::Value* pos = BuildBufferPosition(builder, pos_2, m_input_buffer_size, m_options.static_buffers);
 
   // value_ptr = &buf.data[pos]
   // value = *value_ptr
@@ -146,29 +307,18 @@ bool ChannelBuilder::GenerateFilterPopFunction(StreamGraph::Filter* filter)
                                                     {builder.getInt32(0), builder.getInt32(2)}, "tail_ptr");
   llvm::Value* tail = builder.CreateLoad(tail_ptr, "tail");
 
-  // value_ptr = &buf.data[tail]
+  // pos = tail & (FIFO_QUEUE_SIZE - 1)
+  // value_ptr = &buf.data[pos]
   // value = *value_ptr
+  llvm::Value* pos = BuildBufferPosition(builder, tail, m_input_buffer_size, m_options.static_buffers);
   llvm::Value* value_ptr = builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
-                                                     {builder.getInt32(0), builder.getInt32(0), tail}, "value_ptr");
+                                                     {builder.getInt32(0), builder.getInt32(0), pos}, "value_ptr");
   llvm::Value* value = builder.CreateLoad(value_ptr, "value");
 
-  // new_tail = (tail + 1) % FIFO_QUEUE_SIZE
-  llvm::Value* new_tail_1 = builder.CreateAdd(tail, builder.getInt32(1), "new_tail_1");
-  llvm::Value* new_tail = builder.CreateURem(new_tail_1, builder.getInt32(m_input_buffer_size), "new_tail");
-
-  // *tail_ptr = new_tail
+  // *tail_ptr = tail + 1
+  llvm::Value* new_tail = builder.CreateAdd(tail, builder.getInt32(1), "new_tail");
   builder.CreateStore(new_tail, tail_ptr);
 
-  // size_ptr = &buf.size
-  // size_1 = *size_ptr
-  // size_2 = size_1 - 1
-  // *size_ptr = size_2
-  llvm::Value* size_ptr = builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
-                                                    {builder.getInt32(0), builder.getInt32(3)}, "size_ptr");
-  llvm::Value* size_1 = builder.CreateLoad(size_ptr, "size");
-  llvm::Value* size_2 = builder.CreateSub(size_1, builder.getInt32(1), "size");
-  builder.CreateStore(size_2, size_ptr);
-
   // return value
   builder.CreateRet(value);
   return true;
@@ -202,27 +352,27 @@ bool ChannelBuilder::GenerateFilterPushFunction(StreamGraph::Filter* filter)
                                                     {builder.getInt32(0), builder.getInt32(1)}, "head_ptr");
   llvm::Value* head = builder.CreateLoad(head_ptr, "head");
 
-  // value_ptr = &buf.data[head]
-  // value_ptr = *value_ptr
+  // pos = head & (FIFO_QUEUE_SIZE - 1)
+  // value_ptr = &buf.data[pos]
+  // *value_ptr = value
+  llvm::Value* pos = BuildBufferPosition(builder, head, m_input_buffer_size, m_options.static_buffers);
   llvm::Value* value_ptr = builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
-                                                     {builder.getInt32(0), builder.getInt32(0), head}, "value_ptr");
+                                                     {builder.getInt32(0), builder.getInt32(0), pos}, "value_ptr");
   builder.CreateStore(value, value_ptr);
 
-  // new_head = (head + 1) % FIFO_QUEUE_SIZE
-  // *head_ptr = new_head
-  llvm::Value* new_head_1 = builder.CreateAdd(head, builder.getInt32(1), "new_head_1");
-  llvm::Value* new_head = builder.CreateURem(new_head_1, builder.getInt32(m_input_buffer_size), "new_head");
+  // *head_ptr = head + 1
+  llvm::Value* new_head = builder.CreateAdd(head, builder.getInt32(1), "new_head");
   builder.CreateStore(new_head, head_ptr);
 
-  // size_ptr = &buf.size
-  // size_1 = *size_ptr
-  // size_2 = size_1 + 1
-  // *size_ptr = size_2
-  llvm::Value* size_ptr = builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
-                                                    {builder.getInt32(0), builder.getInt32(3)}, "size_ptr");
-  llvm::Value* size_1 = builder.CreateLoad(size_ptr, "size");
-  llvm::Value* size_2 = builder.CreateAdd(size_1, builder.getInt32(1), "size");
-  builder.CreateStore(size_2, size_ptr);
+  if (m_stats_var)
+  {
+    // stats.max_size = max(stats.max_size, new_head - buf.tail)
+    llvm::Value* tail_ptr = builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
+                                                      {builder.getInt32(0), builder.getInt32(2)}, "tail_ptr");
+    llvm::Value* size = builder.CreateSub(new_head, builder.CreateLoad(tail_ptr, "tail"), "size");
+    BuildMaxSizeUpdate(builder, m_stats_var, size);
+  }
+
   builder.CreateRetVoid();
   return true;
 }
@@ -342,11 +492,12 @@ bool ChannelBuilder::GenerateSplitPushFunction(StreamGraph::Split* split)
     builder.CreateCondBr(written_comp, next_input_bb, exit_bb);
 
     // written = 0
-    // next_input = (next_input + 1) % num_inputs
+    // last_index = (last_index + 1 == num_outputs) ? 0 : (last_index + 1)
     builder.SetInsertPoint(next_input_bb);
     builder.CreateStore(builder.getInt32(0), m_written_var);
     last_index = builder.CreateAdd(last_index, builder.getInt32(1), "last_index");
-    last_index = builder.CreateURem(last_index, builder.getInt32(num_outputs), "last_index");
+    llvm::Value* last_index_wrap = builder.CreateICmpEQ(last_index, builder.getInt32(num_outputs), "last_index_wrap");
+    last_index = builder.CreateSelect(last_index_wrap, builder.getInt32(0), last_index, "last_index");
     builder.CreateStore(last_index, m_last_index_var);
     builder.CreateBr(exit_bb);
     builder.SetInsertPoint(exit_bb);
@@ -373,8 +524,9 @@ bool ChannelBuilder::GenerateJoinGlobals(StreamGraph::Join* join)
   //    int written_for_input
   //    int heads[num_inputs]
   //    int tails[num_inputs]
-  //    int sizes[num_inputs]
   //    data_type buf[num_inputs][FIFO_QUEUE_SIZE]
+  //
+  // heads and tails are free-running, the number of elements for an input is (head - tail).
 
   // globals
   //    int distribution_sizes[num_inputs]
@@ -385,7 +537,7 @@ bool ChannelBuilder::GenerateJoinGlobals(StreamGraph::Join* join)
   llvm::ArrayType* int_array_ty = llvm::ArrayType::get(m_context->GetIntType(), num_inputs);
   m_input_buffer_type =
     llvm::StructType::create(StringFromFormat("%s_buf_type", m_instance_name.c_str()), m_context->GetIntType(),
-                             m_context->GetIntType(), int_array_ty, int_array_ty, int_array_ty, buf_array_ty, nullptr);
+                             m_context->GetIntType(), int_array_ty, int_array_ty, buf_array_ty, nullptr);
   if (!m_input_buffer_type)
     return false;
 
@@ -449,11 +601,16 @@ bool ChannelBuilder::GenerateJoinSyncFunction(StreamGraph::Join* join)
                                                           {builder.getInt32(0), builder.getInt32(0)}, "next_input_ptr");
   llvm::Value* next_input = builder.CreateLoad(next_input_ptr, "next_input");
 
-  // size_ptr = &buf.sizes[next_input]
-  // size = *size_ptr
-  llvm::Value* size_ptr = builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
-                                                    {builder.getInt32(0), builder.getInt32(4), next_input}, "size_ptr");
-  llvm::Value* size = builder.CreateLoad(size_ptr, "size");
+  // head_ptr = &buf.heads[next_input]
+  // tail_ptr = &buf.tails[next_input]
+  // size = *head_ptr - *tail_ptr
+  llvm::Value* head_ptr = builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
+                                                    {builder.getInt32(0), builder.getInt32(2), next_input}, "head_ptr");
+  llvm::Value* tail_ptr = builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
+                                                    {builder.getInt32(0), builder.getInt32(3), next_input}, "tail_ptr");
+  llvm::Value* head = builder.CreateLoad(head_ptr, "head");
+  llvm::Value* tail = builder.CreateLoad(tail_ptr, "tail");
+  llvm::Value* size = builder.CreateSub(head, tail, "size");
 
   // (size == 0) ? goto exit : goto loop_body;
   llvm::Value* comp = builder.CreateICmpEQ(size, builder.getInt32(0), "size_eq_zero");
@@ -462,27 +619,18 @@ bool ChannelBuilder::GenerateJoinSyncFunction(StreamGraph::Join* join)
   // loop_body:
   builder.SetInsertPoint(loop_body_bb);
 
-  // tail_ptr = &buf.tails[next_input]
-  // tail = *tail_ptr
-  llvm::Value* tail_ptr = builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
-                                                    {builder.getInt32(0), builder.getInt32(3), next_input}, "tail_ptr");
-  llvm::Value* tail = builder.CreateLoad(tail_ptr, "tail");
-
-  // value_ptr = &buf.data[next_input][tail]
+  // pos = tail & (FIFO_QUEUE_SIZE - 1)
+  // value_ptr = &buf.data[next_input][pos]
   // value = *value_ptr
+  llvm::Value* pos = BuildBufferPosition(builder, tail, m_input_buffer_size, m_options.static_buffers);
   llvm::Value* value_ptr = builder.CreateInBoundsGEP(
-    m_input_buffer_type, m_input_buffer_var, {builder.getInt32(0), builder.getInt32(5), next_input, tail}, "value_ptr");
+    m_input_buffer_type, m_input_buffer_var, {builder.getInt32(0), builder.getInt32(4), next_input, pos}, "value_ptr");
   llvm::Value* value = builder.CreateLoad(value_ptr, "value");
 
-  // tail = (tail + 1) % FIFO_QUEUE_SIZE
+  // *tail_ptr = tail + 1
   tail = builder.CreateAdd(tail, builder.getInt32(1), "tail");
-  tail = builder.CreateURem(tail, builder.getInt32(m_input_buffer_size), "tail");
   builder.CreateStore(tail, tail_ptr);
 
-  // size = size - 1
-  size = builder.CreateSub(size, builder.getInt32(1), "size");
-  builder.CreateStore(size, size_ptr);
-
   // call output_stream_name_push(value)
   // BuildDebugPrintf(m_context, builder, "join write val=%u,next_input=%u", {value, next_input});
   builder.CreateCall(output_func, {value});
@@ -503,11 +651,12 @@ bool ChannelBuilder::GenerateJoinSyncFunction(StreamGraph::Join* join)
   llvm::Value* written_eq_distribution = builder.CreateICmpUGE(written, distribution, "written_eq_distribution");
   builder.CreateCondBr(written_eq_distribution, next_input_bb, compare_bb);
 
-  // next_input = (next_input + 1) % num_inputs
+  // next_input = (next_input + 1 == num_inputs) ? 0 : (next_input + 1)
   builder.SetInsertPoint(next_input_bb);
   builder.CreateStore(builder.getInt32(0), written_ptr);
   next_input = builder.CreateAdd(next_input, builder.getInt32(1), "next_input");
-  next_input = builder.CreateURem(next_input, builder.getInt32(num_inputs), "next_input");
+  llvm::Value* next_input_wrap = builder.CreateICmpEQ(next_input, builder.getInt32(num_inputs), "next_input_wrap");
+  next_input = builder.CreateSelect(next_input_wrap, builder.getInt32(0), next_input, "next_input");
   builder.CreateStore(next_input, next_input_ptr);
 
   // goto compare_bb
@@ -560,29 +709,19 @@ bool ChannelBuilder::GenerateJoinPushFunction(StreamGraph::Join* join)
       m_input_buffer_type, m_input_buffer_var, {builder.getInt32(0), builder.getInt32(2), src_stream}, "head_ptr");
     llvm::Value* head = builder.CreateLoad(head_ptr, "head");
 
-    // value_ptr = &buf.data[head]
-    // value_ptr = *value_ptr
+    // pos = head & (FIFO_QUEUE_SIZE - 1)
+    // value_ptr = &buf.data[src_stream][pos]
+    // *value_ptr = value
+    llvm::Value* pos = BuildBufferPosition(builder, head, m_input_buffer_size, m_options.static_buffers);
     llvm::Value* value_ptr =
       builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
-                                {builder.getInt32(0), builder.getInt32(5), src_stream, head}, "value_ptr");
+                                {builder.getInt32(0), builder.getInt32(4), src_stream, pos}, "value_ptr");
     builder.CreateStore(value, value_ptr);
 
-    // new_head = (head + 1) % FIFO_QUEUE_SIZE
-    // *head_ptr = new_head
-    llvm::Value* new_head_1 = builder.CreateAdd(head, builder.getInt32(1), "new_head_1");
-    llvm::Value* new_head = builder.CreateURem(new_head_1, builder.getInt32(m_input_buffer_size), "new_head");
+    // *head_ptr = head + 1
+    llvm::Value* new_head = builder.CreateAdd(head, builder.getInt32(1), "new_head");
     builder.CreateStore(new_head, head_ptr);
 
-    // size_ptr = &buf.size
-    // size_1 = *size_ptr
-    // size_2 = size_1 + 1
-    // *size_ptr = size_2
-    llvm::Value* size_ptr = builder.CreateInBoundsGEP(
-      m_input_buffer_type, m_input_buffer_var, {builder.getInt32(0), builder.getInt32(4), src_stream}, "size_ptr");
-    llvm::Value* size_1 = builder.CreateLoad(size_ptr, "size");
-    llvm::Value* size_2 = builder.CreateAdd(size_1, builder.getInt32(1), "size");
-    builder.CreateStore(size_2, size_ptr);
-
     // TODO: This call can be skipped when next_input != src_stream.
     builder.CreateCall(sync_func);
     builder.CreateRetVoid();
@@ -609,6 +748,24 @@ bool ChannelBuilder::GenerateJoinPushFunction(StreamGraph::Join* join)
     llvm::Value* value = &(*func_args_iter++);
     value->setName("value");
 
+    // The source stream is a constant here, so each input can have its own stats.
+    // Measured before the push, as the sync function may drain the input straight away.
+    if (m_options.channel_stats)
+    {
+      std::string input_name = StringFromFormat("%s_%u", m_instance_name.c_str(), source_stream_index);
+      llvm::GlobalVariable* stats_var = GenerateChannelStats(input_name, m_input_buffer_size);
+      llvm::Value* input_index = builder.getInt32(i32(source_stream_index - 1));
+
+      // stats.max_size = max(stats.max_size, buf.heads[input] - buf.tails[input] + 1)
+      llvm::Value* head_ptr = builder.CreateInBoundsGEP(
+        m_input_buffer_type, m_input_buffer_var, {builder.getInt32(0), builder.getInt32(2), input_index}, "head_ptr");
+      llvm::Value* tail_ptr = builder.CreateInBoundsGEP(
+        m_input_buffer_type, m_input_buffer_var, {builder.getInt32(0), builder.getInt32(3), input_index}, "tail_ptr");
+      llvm::Value* size = builder.CreateSub(builder.CreateLoad(head_ptr, "head"), builder.CreateLoad(tail_ptr, "tail"));
+      size = builder.CreateAdd(size, builder.getInt32(1), "size");
+      BuildMaxSizeUpdate(builder, stats_var, size);
+    }
+
     builder.CreateCall(push_func, {builder.getInt32(i32(source_stream_index - 1)), value});
     builder.CreateRetVoid();
   }
@@ -616,4 +773,509 @@ bool ChannelBuilder::GenerateJoinPushFunction(StreamGraph::Join* join)
   return true;
 }
 
+bool ChannelBuilder::GenerateFilterBufferFunction(StreamGraph::Filter* filter)
+{
+  llvm::Constant* func_cons = m_module->getOrInsertFunction(StringFromFormat("%s_buffer", m_instance_name.c_str()),
+                                                            filter->GetInputType()->getPointerTo(), nullptr);
+  if (!func_cons)
+    return false;
+  llvm::Function* func = llvm::cast<llvm::Function>(func_cons);
+  if (!func)
+    return false;
+
+  func->setLinkage(llvm::GlobalValue::PrivateLinkage);
+
+  // return &buf.data[0]
+  llvm::BasicBlock* entry_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "entry", func);
+  llvm::IRBuilder<> builder(entry_bb);
+  builder.CreateRet(builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
+                                              {builder.getInt32(0), builder.getInt32(0), builder.getInt32(0)},
+                                              "data_ptr"));
+  return true;
+}
+
+bool ChannelBuilder::GenerateFilterPopNFunction(StreamGraph::Filter* filter)
+{
+  llvm::Constant* func_cons = m_module->getOrInsertFunction(StringFromFormat("%s_pop_n", m_instance_name.c_str()),
+                                                            m_context->GetIntType(), m_context->GetIntType(), nullptr);
+  if (!func_cons)
+    return false;
+  llvm::Function* func = llvm::cast<llvm::Function>(func_cons);
+  if (!func)
+    return false;
+
+  func->setLinkage(llvm::GlobalValue::PrivateLinkage);
+
+  llvm::BasicBlock* entry_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "entry", func);
+  llvm::IRBuilder<> builder(entry_bb);
+
+  llvm::Value* count = &(*func->arg_begin());
+  count->setName("count");
+
+  // Only one thread uses the channel, so the tokens can still be read after the tail has moved past them.
+  // tail = buf.tail
+  // buf.tail = tail + count
+  // return tail
+  llvm::Value* tail_ptr = builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
+                                                    {builder.getInt32(0), builder.getInt32(2)}, "tail_ptr");
+  llvm::Value* tail = builder.CreateLoad(tail_ptr, "tail");
+  builder.CreateStore(builder.CreateAdd(tail, count, "new_tail"), tail_ptr);
+  builder.CreateRet(tail);
+  return true;
+}
+
+bool ChannelBuilder::GenerateFilterPushNFunction(StreamGraph::Filter* filter)
+{
+  llvm::Constant* func_cons = m_module->getOrInsertFunction(StringFromFormat("%s_push_n", m_instance_name.c_str()),
+                                                            m_context->GetIntType(), m_context->GetIntType(), nullptr);
+  if (!func_cons)
+    return false;
+  llvm::Function* func = llvm::cast<llvm::Function>(func_cons);
+  if (!func)
+    return false;
+
+  func->setLinkage(llvm::GlobalValue::PrivateLinkage);
+
+  llvm::BasicBlock* entry_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "entry", func);
+  llvm::IRBuilder<> builder(entry_bb);
+
+  llvm::Value* count = &(*func->arg_begin());
+  count->setName("count");
+
+  // The caller writes the tokens after the head has moved, which is fine with only one thread using the channel.
+  // head = buf.head
+  // buf.head = head + count
+  // return head
+  llvm::Value* head_ptr = builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
+                                                    {builder.getInt32(0), builder.getInt32(1)}, "head_ptr");
+  llvm::Value* head = builder.CreateLoad(head_ptr, "head");
+  llvm::Value* new_head = builder.CreateAdd(head, count, "new_head");
+  builder.CreateStore(new_head, head_ptr);
+
+  if (m_stats_var)
+  {
+    // stats.max_size = max(stats.max_size, new_head - buf.tail)
+    llvm::Value* tail_ptr = builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
+                                                      {builder.getInt32(0), builder.getInt32(2)}, "tail_ptr");
+    llvm::Value* size = builder.CreateSub(new_head, builder.CreateLoad(tail_ptr, "tail"), "size");
+    BuildMaxSizeUpdate(builder, m_stats_var, size);
+  }
+
+  builder.CreateRet(head);
+  return true;
+}
+
+bool ChannelBuilder::GenerateFilterResetFunction(StreamGraph::Filter* filter)
+{
+  llvm::Constant* func_cons = m_module->getOrInsertFunction(StringFromFormat("%s_reset", m_instance_name.c_str()),
+                                                            m_context->GetVoidType(), m_context->GetIntType(), nullptr);
+  if (!func_cons)
+    return false;
+  llvm::Function* func = llvm::cast<llvm::Function>(func_cons);
+  if (!func)
+    return false;
+
+  func->setLinkage(llvm::GlobalValue::PrivateLinkage);
+
+  llvm::BasicBlock* entry_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "entry", func);
+  llvm::IRBuilder<> builder(entry_bb);
+
+  llvm::Value* consumed = &(*func->arg_begin());
+  consumed->setName("consumed");
+
+  // data_ptr = &buf.data[0]
+  // head_ptr = &buf.head
+  // tail_ptr = &buf.tail
+  llvm::Value* data_ptr = builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
+                                                    {builder.getInt32(0), builder.getInt32(0), builder.getInt32(0)},
+                                                    "data_ptr");
+  llvm::Value* head_ptr = builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
+                                                    {builder.getInt32(0), builder.getInt32(1)}, "head_ptr");
+  llvm::Value* tail_ptr = builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
+                                                    {builder.getInt32(0), builder.getInt32(2)}, "tail_ptr");
+
+  // A filter writing at static positions doesn't move the head, but it pushes exactly what this filter pops in a
+  // steady state, so the residue is always what the init schedule leaves.
+  // residue = #init_residue# or (*head_ptr - consumed)
+  const StreamGraph::Filter* producer = dynamic_cast<const StreamGraph::Filter*>(m_input_producer);
+  llvm::Value* residue;
+  if (producer && GetStaticOutputFilter(m_options, producer) == filter)
+    residue = builder.getInt32(m_buffer_sizes->GetInitResidue(filter));
+  else
+    residue = builder.CreateSub(builder.CreateLoad(head_ptr, "head"), consumed, "residue");
+
+  BuildLinearBufferReset(builder, head_ptr, tail_ptr, data_ptr, filter->GetInputType(), consumed, residue);
+  builder.CreateRetVoid();
+  return true;
+}
+
+bool ChannelBuilder::GenerateJoinResetFunction(StreamGraph::Join* join)
+{
+  llvm::Constant* func_cons = m_module->getOrInsertFunction(StringFromFormat("%s_reset", m_instance_name.c_str()),
+                                                            m_context->GetVoidType(), nullptr);
+  if (!func_cons)
+    return false;
+  llvm::Function* func = llvm::cast<llvm::Function>(func_cons);
+  if (!func)
+    return false;
+
+  func->setLinkage(llvm::GlobalValue::PrivateLinkage);
+
+  llvm::BasicBlock* entry_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "entry", func);
+  llvm::IRBuilder<> builder(entry_bb);
+
+  // The join position (next_input/written) carries over, only the input buffers are compacted.
+  for (u32 input_index = 0; input_index < join->GetIncomingStreams(); input_index++)
+  {
+    llvm::Value* data_ptr =
+      builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
+                                {builder.getInt32(0), builder.getInt32(4), builder.getInt32(input_index),
+                                 builder.getInt32(0)},
+                                "data_ptr");
+    llvm::Value* head_ptr =
+      builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
+                                {builder.getInt32(0), builder.getInt32(2), builder.getInt32(input_index)}, "head_ptr");
+    llvm::Value* tail_ptr =
+      builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
+                                {builder.getInt32(0), builder.getInt32(3), builder.getInt32(input_index)}, "tail_ptr");
+
+    // residue = *head_ptr - *tail_ptr
+    llvm::Value* tail = builder.CreateLoad(tail_ptr, "tail");
+    llvm::Value* residue = builder.CreateSub(builder.CreateLoad(head_ptr, "head"), tail, "residue");
+    BuildLinearBufferReset(builder, head_ptr, tail_ptr, data_ptr, join->GetInputType(), tail, residue);
+  }
+
+  builder.CreateRetVoid();
+  return true;
+}
+
+bool ChannelBuilder::GenerateSPSCChannel(const std::string& name, llvm::Type* data_type, u32 capacity)
+{
+  // head and tail are free-running, so all slots are usable: empty is head == tail, full is head - tail == size.
+  m_input_buffer_size = u32(llvm::PowerOf2Ceil(capacity));
+
+  // Create struct type
+  //
+  // int head               (written by producer)
+  // int cached_tail        (producer's last seen tail)
+  // byte pad[]
+  // int tail               (written by consumer)
+  // int cached_head        (consumer's last seen head)
+  // byte pad[]
+  // data_type data[FIFO_QUEUE_SIZE]
+  //
+  llvm::ArrayType* pad_ty = llvm::ArrayType::get(m_context->GetByteType(), SPSC_CACHE_LINE_SIZE - 8);
+  llvm::ArrayType* data_array_ty = llvm::ArrayType::get(data_type, m_input_buffer_size);
+  m_input_buffer_type = llvm::StructType::create(StringFromFormat("%s_buf_type", name.c_str()),
+                                                 m_context->GetIntType(), m_context->GetIntType(), pad_ty,
+                                                 m_context->GetIntType(), m_context->GetIntType(), pad_ty,
+                                                 data_array_ty, nullptr);
+
+  // Create global variable, aligned so the padding actually separates the cache lines
+  m_input_buffer_var = new llvm::GlobalVariable(*m_module, m_input_buffer_type, true, llvm::GlobalValue::PrivateLinkage,
+                                                nullptr, StringFromFormat("%s_buf", name.c_str()));
+  m_input_buffer_var->setConstant(false);
+  m_input_buffer_var->setInitializer(llvm::ConstantAggregateZero::get(m_input_buffer_type));
+  m_input_buffer_var->setAlignment(SPSC_CACHE_LINE_SIZE);
+
+  m_stats_var = m_options.channel_stats ? GenerateChannelStats(name, m_input_buffer_size) : nullptr;
+
+  return (GenerateSPSCPeekFunction(name, data_type, false) && GenerateSPSCPeekFunction(name, data_type, true) &&
+          GenerateSPSCPushFunction(name, data_type));
+}
+
+bool ChannelBuilder::GenerateSPSCPeekFunction(const std::string& name, llvm::Type* data_type, bool pop)
+{
+  llvm::FunctionType* func_ty = pop ? llvm::FunctionType::get(data_type, false) :
+                                      llvm::FunctionType::get(data_type, {m_context->GetIntType()}, false);
+  llvm::Constant* func_cons =
+    m_module->getOrInsertFunction(StringFromFormat("%s_%s", name.c_str(), pop ? "pop" : "peek"), func_ty);
+  if (!func_cons)
+    return false;
+  llvm::Function* func = llvm::cast<llvm::Function>(func_cons);
+  if (!func)
+    return false;
+
+  func->setLinkage(llvm::GlobalValue::PrivateLinkage);
+
+  llvm::Constant* yield_func =
+    m_module->getOrInsertFunction("streamit_thread_yield", m_context->GetIntType(), nullptr);
+  if (!yield_func)
+    return false;
+
+  llvm::BasicBlock* entry_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "entry", func);
+  llvm::BasicBlock* refresh_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "refresh", func);
+  llvm::BasicBlock* wait_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "wait", func);
+  llvm::BasicBlock* stopped_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "stopped", func);
+  llvm::BasicBlock* ready_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "ready", func);
+  llvm::IRBuilder<> builder(entry_bb);
+
+  llvm::Value* index;
+  if (pop)
+  {
+    index = builder.getInt32(0);
+  }
+  else
+  {
+    index = &(*func->arg_begin());
+    index->setName("index");
+  }
+
+  // tail and cached_head are only touched by the consumer, so they can be accessed without synchronization.
+  // available = cached_head - tail
+  llvm::Value* tail_ptr = builder.CreateInBoundsGEP(
+    m_input_buffer_type, m_input_buffer_var, {builder.getInt32(0), builder.getInt32(SPSC_FIELD_TAIL)}, "tail_ptr");
+  llvm::Value* tail = builder.CreateLoad(tail_ptr, "tail");
+  llvm::Value* cached_head_ptr = builder.CreateInBoundsGEP(
+    m_input_buffer_type, m_input_buffer_var, {builder.getInt32(0), builder.getInt32(SPSC_FIELD_CACHED_HEAD)},
+    "cached_head_ptr");
+  llvm::Value* cached_head = builder.CreateLoad(cached_head_ptr, "cached_head");
+  llvm::Value* available = builder.CreateSub(cached_head, tail, "available");
+  llvm::Value* comp = builder.CreateICmpUGT(available, index, "comp");
+  builder.CreateCondBr(comp, ready_bb, refresh_bb);
+
+  // refresh:
+  // cached_head = atomic_load_acquire(&buf.head)
+  builder.SetInsertPoint(refresh_bb);
+  llvm::PHINode* first_attempt = nullptr;
+  if (m_stats_var)
+  {
+    first_attempt = builder.CreatePHI(builder.getInt1Ty(), 2, "first_attempt");
+    first_attempt->addIncoming(builder.getTrue(), entry_bb);
+    first_attempt->addIncoming(builder.getFalse(), wait_bb);
+  }
+  llvm::Value* head_ptr = builder.CreateInBoundsGEP(
+    m_input_buffer_type, m_input_buffer_var, {builder.getInt32(0), builder.getInt32(SPSC_FIELD_HEAD)}, "head_ptr");
+  llvm::LoadInst* head = builder.CreateLoad(head_ptr, "head");
+  head->setAtomic(llvm::AtomicOrdering::Acquire);
+  head->setAlignment(4);
+  builder.CreateStore(head, cached_head_ptr);
+  available = builder.CreateSub(head, tail, "available");
+  comp = builder.CreateICmpUGT(available, index, "comp");
+  builder.CreateCondBr(comp, ready_bb, wait_bb);
+
+  // wait:
+  // Producer hasn't caught up yet.
+  // if (streamit_thread_yield()) goto stopped else goto refresh
+  builder.SetInsertPoint(wait_bb);
+  if (m_stats_var)
+    BuildStallUpdate(builder, m_stats_var, STATS_FIELD_EMPTY_STALLS, first_attempt);
+  llvm::Value* stopping = builder.CreateCall(yield_func, {}, "stopping");
+  builder.CreateCondBr(builder.CreateICmpNE(stopping, builder.getInt32(0)), stopped_bb, refresh_bb);
+
+  // stopped:
+  // The output is complete and the producer has stopped, so the value is never used.
+  // return 0
+  builder.SetInsertPoint(stopped_bb);
+  builder.CreateRet(llvm::Constant::getNullValue(data_type));
+
+  // ready:
+  // value = buf.data[(tail + index) & (FIFO_QUEUE_SIZE - 1)]
+  builder.SetInsertPoint(ready_bb);
+  llvm::Value* pos = builder.CreateAdd(tail, index, "pos");
+  pos = builder.CreateAnd(pos, builder.getInt32(m_input_buffer_size - 1), "pos");
+  llvm::Value* value_ptr =
+    builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
+                              {builder.getInt32(0), builder.getInt32(SPSC_FIELD_DATA), pos}, "value_ptr");
+  llvm::Value* value = builder.CreateLoad(value_ptr, "value");
+
+  if (pop)
+  {
+    // atomic_store_release(&buf.tail, tail + 1)
+    // The release ordering ensures the slot has been read before the producer can reuse it.
+    llvm::Value* new_tail = builder.CreateAdd(tail, builder.getInt32(1), "new_tail");
+    llvm::StoreInst* store = builder.CreateStore(new_tail, tail_ptr);
+    store->setAtomic(llvm::AtomicOrdering::Release);
+    store->setAlignment(4);
+  }
+
+  builder.CreateRet(value);
+  return true;
+}
+
+bool ChannelBuilder::GenerateSPSCPushFunction(const std::string& name, llvm::Type* data_type)
+{
+  llvm::FunctionType* func_ty = llvm::FunctionType::get(m_context->GetVoidType(), {data_type}, false);
+  llvm::Constant* func_cons = m_module->getOrInsertFunction(StringFromFormat("%s_push", name.c_str()), func_ty);
+  if (!func_cons)
+    return false;
+  llvm::Function* func = llvm::cast<llvm::Function>(func_cons);
+  if (!func)
+    return false;
+
+  func->setLinkage(llvm::GlobalValue::PrivateLinkage);
+
+  llvm::Constant* yield_func =
+    m_module->getOrInsertFunction("streamit_thread_yield", m_context->GetIntType(), nullptr);
+  if (!yield_func)
+    return false;
+
+  llvm::BasicBlock* entry_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "entry", func);
+  llvm::BasicBlock* refresh_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "refresh", func);
+  llvm::BasicBlock* wait_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "wait", func);
+  llvm::BasicBlock* stopped_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "stopped", func);
+  llvm::BasicBlock* ready_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "ready", func);
+  llvm::IRBuilder<> builder(entry_bb);
+
+  llvm::Value* value = &(*func->arg_begin());
+  value->setName("value");
+
+  // head and cached_tail are only touched by the producer, so they can be accessed without synchronization.
+  // if (head - cached_tail != FIFO_QUEUE_SIZE) goto ready else goto refresh
+  llvm::Value* head_ptr = builder.CreateInBoundsGEP(
+    m_input_buffer_type, m_input_buffer_var, {builder.getInt32(0), builder.getInt32(SPSC_FIELD_HEAD)}, "head_ptr");
+  llvm::Value* head = builder.CreateLoad(head_ptr, "head");
+  llvm::Value* cached_tail_ptr = builder.CreateInBoundsGEP(
+    m_input_buffer_type, m_input_buffer_var, {builder.getInt32(0), builder.getInt32(SPSC_FIELD_CACHED_TAIL)},
+    "cached_tail_ptr");
+  llvm::Value* cached_tail = builder.CreateLoad(cached_tail_ptr, "cached_tail");
+  llvm::Value* used = builder.CreateSub(head, cached_tail, "used");
+  llvm::Value* comp = builder.CreateICmpNE(used, builder.getInt32(m_input_buffer_size), "comp");
+  builder.CreateCondBr(comp, ready_bb, refresh_bb);
+
+  // refresh:
+  // cached_tail = atomic_load_acquire(&buf.tail)
+  builder.SetInsertPoint(refresh_bb);
+  llvm::PHINode* first_attempt = nullptr;
+  if (m_stats_var)
+  {
+    first_attempt = builder.CreatePHI(builder.getInt1Ty(), 2, "first_attempt");
+    first_attempt->addIncoming(builder.getTrue(), entry_bb);
+    first_attempt->addIncoming(builder.getFalse(), wait_bb);
+  }
+  llvm::Value* tail_ptr = builder.CreateInBoundsGEP(
+    m_input_buffer_type, m_input_buffer_var, {builder.getInt32(0), builder.getInt32(SPSC_FIELD_TAIL)}, "tail_ptr");
+  llvm::LoadInst* tail = builder.CreateLoad(tail_ptr, "tail");
+  tail->setAtomic(llvm::AtomicOrdering::Acquire);
+  tail->setAlignment(4);
+  builder.CreateStore(tail, cached_tail_ptr);
+  used = builder.CreateSub(head, tail, "used");
+  comp = builder.CreateICmpNE(used, builder.getInt32(m_input_buffer_size), "comp");
+  builder.CreateCondBr(comp, ready_bb, wait_bb);
+
+  // wait:
+  // Queue is full, consumer hasn't caught up yet.
+  // if (streamit_thread_yield()) goto stopped else goto refresh
+  builder.SetInsertPoint(wait_bb);
+  if (m_stats_var)
+    BuildStallUpdate(builder, m_stats_var, STATS_FIELD_FULL_STALLS, first_attempt);
+  llvm::Value* stopping = builder.CreateCall(yield_func, {}, "stopping");
+  builder.CreateCondBr(builder.CreateICmpNE(stopping, builder.getInt32(0)), stopped_bb, refresh_bb);
+
+  // stopped:
+  // The output is complete and the consumer has stopped, so the value is dropped.
+  builder.SetInsertPoint(stopped_bb);
+  builder.CreateRetVoid();
+
+  // ready:
+  // buf.data[head & (FIFO_QUEUE_SIZE - 1)] = value
+  // atomic_store_release(&buf.head, head + 1)
+  builder.SetInsertPoint(ready_bb);
+  llvm::Value* pos = builder.CreateAnd(head, builder.getInt32(m_input_buffer_size - 1), "pos");
+  llvm::Value* value_ptr =
+    builder.CreateInBoundsGEP(m_input_buffer_type, m_input_buffer_var,
+                              {builder.getInt32(0), builder.getInt32(SPSC_FIELD_DATA), pos}, "value_ptr");
+  builder.CreateStore(value, value_ptr);
+  llvm::Value* new_head = builder.CreateAdd(head, builder.getInt32(1), "new_head");
+  llvm::StoreInst* store = builder.CreateStore(new_head, head_ptr);
+  store->setAtomic(llvm::AtomicOrdering::Release);
+  store->setAlignment(4);
+
+  if (m_stats_var)
+  {
+    // The cached tail may be stale, which would overstate the size, so read the consumer's current one.
+    // stats.max_size = max(stats.max_size, new_head - atomic_load_monotonic(&buf.tail))
+    llvm::LoadInst* current_tail = builder.CreateLoad(tail_ptr, "current_tail");
+    current_tail->setAtomic(llvm::AtomicOrdering::Monotonic);
+    current_tail->setAlignment(4);
+    BuildMaxSizeUpdate(builder, m_stats_var, builder.CreateSub(new_head, current_tail, "size"));
+  }
+
+  builder.CreateRetVoid();
+  return true;
+}
+
+bool ChannelBuilder::GenerateJoinWorkFunction(StreamGraph::Join* join)
+{
+  // One firing of the join moves a full round of the distribution from the input queues to the output.
+  // for_each_input:
+  //   for (i = 0; i < distribution[input]; i++)
+  //     output_name_push(join_name_input_pop())
+  llvm::Constant* output_func =
+    m_module->getOrInsertFunction(StringFromFormat("%s_push", join->GetOutputChannelName().c_str()),
+                                  m_context->GetVoidType(), join->GetOutputType(), nullptr);
+  if (!output_func)
+  {
+    Log::Error("ChannelBuilder", "Failed to get output function '%s_push'", join->GetOutputChannelName().c_str());
+    return false;
+  }
+
+  llvm::Constant* func_cons = m_module->getOrInsertFunction(StringFromFormat("%s_work", m_instance_name.c_str()),
+                                                            m_context->GetVoidType(), nullptr);
+  if (!func_cons)
+    return false;
+  llvm::Function* func = llvm::cast<llvm::Function>(func_cons);
+  if (!func)
+    return false;
+
+  func->setLinkage(llvm::GlobalValue::PrivateLinkage);
+
+  llvm::BasicBlock* entry_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "entry", func);
+  llvm::IRBuilder<> builder(entry_bb);
+  llvm::AllocaInst* i_var = builder.CreateAlloca(m_context->GetIntType(), nullptr, "i");
+
+  for (u32 input_index = 1; input_index <= join->GetIncomingStreams(); input_index++)
+  {
+    llvm::Constant* pop_func =
+      m_module->getOrInsertFunction(StringFromFormat("%s_%u_pop", m_instance_name.c_str(), input_index),
+                                    join->GetInputType(), nullptr);
+    if (!pop_func)
+      return false;
+
+    u32 count = u32(join->GetDistribution().at(input_index - 1));
+    llvm::BasicBlock* compare_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "compare", func);
+    llvm::BasicBlock* body_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "body", func);
+    llvm::BasicBlock* exit_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "exit", func);
+
+    // i = 0
+    builder.CreateStore(builder.getInt32(0), i_var);
+    builder.CreateBr(compare_bb);
+
+    // if (i < count) goto body else goto exit
+    builder.SetInsertPoint(compare_bb);
+    llvm::Value* i = builder.CreateLoad(i_var, "i");
+    llvm::Value* comp = builder.CreateICmpULT(i, builder.getInt32(count), "i_comp");
+    builder.CreateCondBr(comp, body_bb, exit_bb);
+
+    // output_name_push(join_name_input_pop())
+    // i = i + 1
+    builder.SetInsertPoint(body_bb);
+    llvm::Value* value = builder.CreateCall(pop_func);
+    builder.CreateCall(output_func, {value});
+    i = builder.CreateAdd(i, builder.getInt32(1), "i");
+    builder.CreateStore(i, i_var);
+    builder.CreateBr(compare_bb);
+
+    builder.SetInsertPoint(exit_bb);
+  }
+
+  builder.CreateRetVoid();
+  return true;
+}
+
+llvm::GlobalVariable* ChannelBuilder::GenerateChannelStats(const std::string& name, u32 capacity)
+{
+  // u64 stats[STATS_FIELD_COUNT] = {max_size, capacity, full_stalls, ..., empty_stalls}
+  llvm::Type* counter_type = llvm::Type::getInt64Ty(m_context->GetLLVMContext());
+  llvm::ArrayType* stats_type = llvm::ArrayType::get(counter_type, STATS_FIELD_COUNT);
+  std::vector<llvm::Constant*> values(STATS_FIELD_COUNT, llvm::ConstantInt::get(counter_type, 0));
+  values[STATS_FIELD_CAPACITY] = llvm::ConstantInt::get(counter_type, capacity);
+
+  llvm::GlobalVariable* stats_var =
+    new llvm::GlobalVariable(*m_module, stats_type, false, llvm::GlobalValue::PrivateLinkage,
+                             llvm::ConstantArray::get(stats_type, values), StringFromFormat("%s_stats", name.c_str()));
+  stats_var->setAlignment(SPSC_CACHE_LINE_SIZE);
+  return stats_var;
+}
+
 } // namespace Frontend
@@ -1,6 +1,8 @@
 #pragma once
+#include <string>
 #include <unordered_map>
 #include "common/types.h"
+#include "cputarget/codegen_options.h"
 
 namespace llvm
 {
@@ -9,6 +11,7 @@ class Function;
 class GlobalVariable;
 class Module;
 class Type;
+class Value;
 }
 
 namespace Frontend
@@ -18,6 +21,8 @@ class WrappedLLVMContext;
 
 namespace StreamGraph
 {
+class BufferSizeAnalysis;
+class Node;
 class Filter;
 class Split;
 class Join;
@@ -28,11 +33,33 @@ namespace CPUTarget
 class ChannelBuilder
 {
 public:
-  ChannelBuilder(Frontend::WrappedLLVMContext* context, llvm::Module* mod);
+  ChannelBuilder(Frontend::WrappedLLVMContext* context, llvm::Module* mod, const CodeGenOptions& options);
   ~ChannelBuilder();
 
   Frontend::WrappedLLVMContext* GetContext() const { return m_context; }
 
+  // Channel sizes come from the buffer size analysis when one is provided and valid.
+  void SetBufferSizes(const StreamGraph::BufferSizeAnalysis* buffer_sizes) { m_buffer_sizes = buffer_sizes; }
+
+  // Number of elements allocated for each input channel of a filter or join.
+  static u32 GetInputBufferSize(const CodeGenOptions& options, const StreamGraph::BufferSizeAnalysis* buffer_sizes,
+                                const StreamGraph::Node* node);
+
+  // Fixed multiple of the consumer's rate, used when the schedule can't be analyzed.
+  static u32 GetDefaultInputBufferSize(const StreamGraph::Node* node);
+
+  // Static buffer mode: filters with a work block of their own are passed where each firing starts in their input
+  // channel, and in the input channel of the filter they feed, worked out from the schedule. Builtin and fused
+  // filters, splits and joins still go through the channel's head and tail.
+  static bool HasStaticChannels(const CodeGenOptions& options, const StreamGraph::Filter* filter);
+
+  // The filter whose input channel this filter writes at static positions, if any.
+  static const StreamGraph::Filter* GetStaticOutputFilter(const CodeGenOptions& options,
+                                                          const StreamGraph::Filter* filter);
+
+  // The node feeding the input channel. When it writes at static positions, the channel's head isn't kept up to date.
+  void SetInputProducer(const StreamGraph::Node* producer) { m_input_producer = producer; }
+
   // TODO: Enum for mode, 0=roundrobin, 1=duplicate
   bool GenerateCode(StreamGraph::Filter* filter);
   bool GenerateCode(StreamGraph::Split* split);
@@ -44,6 +71,12 @@ private:
   bool GenerateFilterPopFunction(StreamGraph::Filter* filter);
   bool GenerateFilterPushFunction(StreamGraph::Filter* filter);
 
+  // <name>_buffer returns the start of the channel's data, for reading and writing tokens in place. <name>_pop_n and
+  // <name>_push_n move the tail or head by a number of tokens at once, returning where it was.
+  bool GenerateFilterBufferFunction(StreamGraph::Filter* filter);
+  bool GenerateFilterPopNFunction(StreamGraph::Filter* filter);
+  bool GenerateFilterPushNFunction(StreamGraph::Filter* filter);
+
   bool GenerateSplitGlobals(StreamGraph::Split* split);
   bool GenerateSplitPushFunction(StreamGraph::Split* split);
 
@@ -51,16 +84,35 @@ private:
   bool GenerateJoinSyncFunction(StreamGraph::Join* join);
   bool GenerateJoinPushFunction(StreamGraph::Join* join);
 
+  // Static buffer mode: <name>_reset moves the peek residue to the front of the buffer. Filter channels are passed the
+  // number of tokens consumed since the last reset, since static reads leave the tail alone.
+  bool GenerateFilterResetFunction(StreamGraph::Filter* filter);
+  bool GenerateJoinResetFunction(StreamGraph::Join* join);
+
+  // Threaded mode: every channel is a lock-free single-producer/single-consumer queue.
+  // Joins are pull-driven, with one queue per input, drained by <join>_work.
+  bool GenerateSPSCChannel(const std::string& name, llvm::Type* data_type, u32 capacity);
+  bool GenerateSPSCPeekFunction(const std::string& name, llvm::Type* data_type, bool pop);
+  bool GenerateSPSCPushFunction(const std::string& name, llvm::Type* data_type);
+  bool GenerateJoinWorkFunction(StreamGraph::Join* join);
+
+  // Channel stats mode: <name>_stats holds the high-water mark and stall counts of a channel.
+  llvm::GlobalVariable* GenerateChannelStats(const std::string& name, u32 capacity);
+
   Frontend::WrappedLLVMContext* m_context;
   llvm::Module* m_module;
+  CodeGenOptions m_options;
   std::string m_instance_name;
 
+  const StreamGraph::BufferSizeAnalysis* m_buffer_sizes = nullptr;
+  const StreamGraph::Node* m_input_producer = nullptr;
   u32 m_input_buffer_size = 0;
   llvm::Type* m_input_buffer_type = nullptr;
   llvm::GlobalVariable* m_input_buffer_var = nullptr;
   llvm::GlobalVariable* m_last_index_var = nullptr;
   llvm::GlobalVariable* m_written_var = nullptr;
   llvm::GlobalVariable* m_distribution_var = nullptr;
+  llvm::GlobalVariable* m_stats_var = nullptr;
 };
 
 } // namespace CPUTarget
\ No newline at end of file
@@ -0,0 +1,86 @@
+#pragma once
+#include "common/types.h"
+
+namespace CPUTarget
+{
+// Order of the firings within a single-threaded steady state.
+enum class ScheduleStrategy
+{
+  // Each filter runs its whole multiplicity at once. Fewest call sites, but channels hold a whole steady state of
+  // tokens, and output only appears once the last filter runs.
+  SingleAppearance,
+
+  // Demand-driven, the filter furthest downstream which has input fires next. Smallest channels.
+  Push,
+
+  // Interleaves a share of every filter's firings per phase, so output appears after the first phase.
+  Phased
+};
+
+// Options controlling how the CPU target lays out channels and the schedule.
+struct CodeGenOptions
+{
+  // Number of worker threads the steady state is partitioned across.
+  // Anything above one switches every channel to a lock-free single-producer/single-consumer queue.
+  u32 num_threads = 1;
+
+  // Reset every channel to a linear layout at each steady state boundary, copying the peek residue to the front.
+  // Channel accesses then never wrap, at the cost of a small copy per steady state, and filters are passed where each
+  // firing starts in their channels, worked out from the schedule. Single-threaded only.
+  bool static_buffers = false;
+
+  // Run all firings of stateless filters in a steady state through a vectorizable loop, with this many firings per
+  // vector. Zero picks the width from the target's vector registers.
+  bool vectorize = false;
+  u32 vector_width = 0;
+
+  // Widest vector registers of the target, in bits, for integer and floating-point elements. Set from the target
+  // machine, so they follow the CPU and features code is generated for.
+  u32 int_vector_register_bits = 128;
+  u32 float_vector_register_bits = 128;
+
+  // Build an embeddable library instead of a program. <name>_init, <name>_process and <name>_reset replace main, and
+  // the InputReader and OutputWriter use buffers passed to each call to process instead of files. Single-threaded only.
+  bool library = false;
+
+  // Keep all channels, filter state and counters in an instance struct passed to every generated function, instead
+  // of globals, so several instances of the program can run at once. <name>_create and <name>_destroy manage them.
+  // Single-threaded only.
+  bool instance_state = false;
+
+  // Time the firings of each filter with the CPU's cycle counter, and report the totals when the program exits.
+  // Programs only, so not with library or instance_state.
+  bool profile = false;
+
+  // Record the most elements each channel held, and in threaded mode how often its producer found it full and its
+  // consumer found it empty. Reported when the program exits. Programs only, so not with library or instance_state.
+  bool channel_stats = false;
+
+  // Single-threaded only, threads always run their filters single appearance.
+  ScheduleStrategy schedule_strategy = ScheduleStrategy::SingleAppearance;
+
+  // Multiply every node's firings per steady state by this factor, amortizing the loop and call overhead of each
+  // firing across more of them. Zero picks the largest factor whose working set, channel buffers plus filter state,
+  // fits in cache_size bytes.
+  u32 steady_state_scale = 1;
+  u32 cache_size = 256 * 1024;
+
+  bool IsThreaded() const { return num_threads > 1; }
+};
+
+// Options controlling the IR optimization pipeline.
+struct OptimizationOptions
+{
+  // Equivalent of -O0 to -O3, and of -Os (1) and -Oz (2).
+  u32 opt_level = 2;
+  u32 size_level = 0;
+
+  // Only used at opt_level 2 and above.
+  bool loop_vectorize = true;
+  bool slp_vectorize = true;
+
+  // Cost threshold for unrolling loops. Zero disables unrolling, negative uses LLVM's default.
+  int unroll_threshold = -1;
+};
+
+} // namespace CPUTarget
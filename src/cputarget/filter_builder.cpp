@@ -1,7 +1,11 @@
 #include "cputarget/filter_builder.h"
+#include <algorithm>
 #include <cassert>
+#include <functional>
+#include <vector>
 #include "common/log.h"
 #include "common/string_helpers.h"
+#include "cputarget/channel_builder.h"
 #include "cputarget/debug_print_builder.h"
 #include "frontend/constant_expression_builder.h"
 #include "frontend/function_builder.h"
@@ -11,6 +15,7 @@
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/Metadata.h"
 #include "llvm/IR/Module.h"
 #include "parser/ast.h"
 #include "streamgraph/streamgraph.h"
@@ -18,6 +23,53 @@ Log_SetChannel(CPUTarget::FilterBuilder);
 
 namespace CPUTarget
 {
+// Upper bound on the tokens staged on the stack for one side of a vector work function, when it can't use the
+// channel buffer in place.
+static const u32 MAX_VECTOR_STAGING_SIZE = 4096;
+
+// InputReader and OutputWriter move at most this many tokens per call to the runtime.
+static const u32 MAX_IO_CHUNK_SIZE = 65536;
+
+// Local channels connect the members of a fused filter. They are a stack array and a position pointer, and are empty
+// at the start of every firing of the fused filter, so they never wrap. Vector work functions also use them to access
+// ring buffers in place, which pass a mask to wrap the position with.
+static llvm::Value* BuildLocalChannelIndex(llvm::IRBuilder<>& builder, llvm::Value* index, llvm::Value* mask)
+{
+  return mask ? builder.CreateAnd(index, mask, "pos") : index;
+}
+
+static llvm::Value* BuildLocalChannelPeek(llvm::IRBuilder<>& builder, llvm::Value* buffer, llvm::Value* position_ptr,
+                                          llvm::Value* idx_value, llvm::Value* mask = nullptr)
+{
+  // return buffer[(position + idx) & mask]
+  llvm::Value* position = builder.CreateLoad(position_ptr, "position");
+  llvm::Value* index = BuildLocalChannelIndex(builder, builder.CreateAdd(position, idx_value), mask);
+  return builder.CreateLoad(builder.CreateInBoundsGEP(buffer, {index}, "ptr"), "value");
+}
+
+static llvm::Value* BuildLocalChannelPop(llvm::IRBuilder<>& builder, llvm::Value* buffer, llvm::Value* position_ptr,
+                                         llvm::Value* mask = nullptr)
+{
+  // value = buffer[position & mask]
+  // position = position + 1
+  llvm::Value* position = builder.CreateLoad(position_ptr, "position");
+  llvm::Value* index = BuildLocalChannelIndex(builder, position, mask);
+  llvm::Value* value = builder.CreateLoad(builder.CreateInBoundsGEP(buffer, {index}, "ptr"), "value");
+  builder.CreateStore(builder.CreateAdd(position, builder.getInt32(1)), position_ptr);
+  return value;
+}
+
+static void BuildLocalChannelPush(llvm::IRBuilder<>& builder, llvm::Value* buffer, llvm::Value* position_ptr,
+                                  llvm::Value* value, llvm::Value* mask = nullptr)
+{
+  // buffer[position & mask] = value
+  // position = position + 1
+  llvm::Value* position = builder.CreateLoad(position_ptr, "position");
+  llvm::Value* index = BuildLocalChannelIndex(builder, position, mask);
+  builder.CreateStore(value, builder.CreateInBoundsGEP(buffer, {index}, "ptr"));
+  builder.CreateStore(builder.CreateAdd(position, builder.getInt32(1)), position_ptr);
+}
+
 // Dummy interface for push/pop/peek
 struct FragmentBuilder : public Frontend::FunctionBuilder::TargetFragmentBuilder
 {
@@ -28,8 +80,25 @@ struct FragmentBuilder : public Frontend::FunctionBuilder::TargetFragmentBuilder
   {
   }
 
+  // Reads and writes to channels inside a fused filter go to a local buffer instead of the channel functions.
+  void SetLocalInputChannel(llvm::Value* buffer, llvm::Value* position, llvm::Value* mask)
+  {
+    m_input_buffer = buffer;
+    m_input_position = position;
+    m_input_mask = mask;
+  }
+  void SetLocalOutputChannel(llvm::Value* buffer, llvm::Value* position, llvm::Value* mask)
+  {
+    m_output_buffer = buffer;
+    m_output_position = position;
+    m_output_mask = mask;
+  }
+
   llvm::Value* BuildPop(llvm::IRBuilder<>& builder) override final
   {
+    if (m_input_buffer)
+      return BuildLocalChannelPop(builder, m_input_buffer, m_input_position, m_input_mask);
+
     if (!m_pop_function)
     {
       // Not valid, should have been caught at semantic analysis time.
@@ -41,6 +110,9 @@ struct FragmentBuilder : public Frontend::FunctionBuilder::TargetFragmentBuilder
 
   llvm::Value* BuildPeek(llvm::IRBuilder<>& builder, llvm::Value* idx_value) override final
   {
+    if (m_input_buffer)
+      return BuildLocalChannelPeek(builder, m_input_buffer, m_input_position, idx_value, m_input_mask);
+
     if (!m_peek_function)
     {
       // Not valid, should have been caught at semantic analysis time.
@@ -55,6 +127,12 @@ struct FragmentBuilder : public Frontend::FunctionBuilder::TargetFragmentBuilder
 
   bool BuildPush(llvm::IRBuilder<>& builder, llvm::Value* value) override final
   {
+    if (m_output_buffer)
+    {
+      BuildLocalChannelPush(builder, m_output_buffer, m_output_position, value, m_output_mask);
+      return true;
+    }
+
     if (!m_push_function)
     {
       // Not valid, should have been caught at semantic analysis time.
@@ -72,10 +150,16 @@ private:
   llvm::Constant* m_peek_function;
   llvm::Constant* m_pop_function;
   llvm::Constant* m_push_function;
+  llvm::Value* m_input_buffer = nullptr;
+  llvm::Value* m_input_position = nullptr;
+  llvm::Value* m_input_mask = nullptr;
+  llvm::Value* m_output_buffer = nullptr;
+  llvm::Value* m_output_position = nullptr;
+  llvm::Value* m_output_mask = nullptr;
 };
 
-FilterBuilder::FilterBuilder(Frontend::WrappedLLVMContext* context, llvm::Module* mod)
-  : m_context(context), m_module(mod)
+FilterBuilder::FilterBuilder(Frontend::WrappedLLVMContext* context, llvm::Module* mod, const CodeGenOptions& options)
+  : m_context(context), m_module(mod), m_options(options)
 {
 }
 
@@ -85,11 +169,36 @@ FilterBuilder::~FilterBuilder()
 
 bool FilterBuilder::GenerateCode(const StreamGraph::Filter* filter)
 {
+  m_filter = filter;
+  m_instance_name = filter->GetName();
+  m_function_prefix = filter->GetName();
+  m_output_channel_name = filter->GetOutputChannelName();
+  if (filter->IsFused())
+    return GenerateFusedFilter();
+
+  m_filter_permutation = filter->GetFilterPermutation();
+  m_filter_decl = m_filter_permutation->GetFilterDeclaration();
+  m_static_channels = ChannelBuilder::HasStaticChannels(m_options, filter);
+  m_static_output_filter = ChannelBuilder::GetStaticOutputFilter(m_options, filter);
+  return GenerateFilterFunctions();
+}
+
+bool FilterBuilder::GenerateMemberCode(const StreamGraph::Filter* filter, const std::string& function_prefix,
+                                       bool local_input, bool local_output)
+{
+  m_filter = filter;
   m_filter_permutation = filter->GetFilterPermutation();
   m_filter_decl = m_filter_permutation->GetFilterDeclaration();
   m_instance_name = filter->GetName();
+  m_function_prefix = function_prefix;
   m_output_channel_name = filter->GetOutputChannelName();
+  m_local_input = local_input;
+  m_local_output = local_output;
+  return GenerateFilterFunctions();
+}
 
+bool FilterBuilder::GenerateFilterFunctions()
+{
   if (!GenerateGlobals() || !GenerateChannelPrototypes())
     return false;
 
@@ -103,8 +212,8 @@ bool FilterBuilder::GenerateCode(const StreamGraph::Filter* filter)
 
   if (m_filter_decl->HasInitBlock())
   {
-    std::string name = StringFromFormat("%s_init", m_instance_name.c_str());
-    m_init_function = GenerateFunction(m_filter_decl->GetInitBlock(), name);
+    std::string name = StringFromFormat("%s_init", m_function_prefix.c_str());
+    m_init_function = GenerateFunction(m_filter_decl->GetInitBlock(), name, false);
     if (!m_init_function)
       return false;
   }
@@ -113,10 +222,17 @@ bool FilterBuilder::GenerateCode(const StreamGraph::Filter* filter)
     m_init_function = nullptr;
   }
 
+  // Static channels are passed to prework and work as local channels, by <name>_work.
+  if (m_static_channels)
+  {
+    m_local_input = !m_filter->GetInputType()->isVoidTy();
+    m_local_output = (m_static_output_filter != nullptr);
+  }
+
   if (m_filter_decl->HasPreworkBlock())
   {
-    std::string name = StringFromFormat("%s_prework", m_instance_name.c_str());
-    m_prework_function = GenerateFunction(m_filter_decl->GetPreworkBlock(), name);
+    std::string name = StringFromFormat("%s_prework", m_function_prefix.c_str());
+    m_prework_function = GenerateFunction(m_filter_decl->GetPreworkBlock(), name, true);
     if (!m_prework_function)
       return false;
   }
@@ -127,10 +243,21 @@ bool FilterBuilder::GenerateCode(const StreamGraph::Filter* filter)
 
   if (m_filter_decl->HasWorkBlock())
   {
-    std::string name = StringFromFormat("%s_work", m_instance_name.c_str());
-    m_work_function = GenerateFunction(m_filter_decl->GetWorkBlock(), name);
+    // When there is a prework block or static channels, <name>_work dispatches to either prework or the work block.
+    bool dispatch = (m_prework_function || m_static_channels);
+    std::string name = StringFromFormat(dispatch ? "%s_work_steady" : "%s_work", m_function_prefix.c_str());
+    m_work_function = GenerateFunction(m_filter_decl->GetWorkBlock(), name, true);
     if (!m_work_function)
       return false;
+
+    if (m_static_channels)
+    {
+      m_local_input = false;
+      m_local_output = false;
+    }
+
+    if (dispatch && !GenerateWorkDispatchFunction())
+      return false;
   }
   else
   {
@@ -140,11 +267,474 @@ bool FilterBuilder::GenerateCode(const StreamGraph::Filter* filter)
   return true;
 }
 
-llvm::Function* FilterBuilder::GenerateFunction(AST::FilterWorkBlock* block, const std::string& name)
+// Emits body count times, as a loop unless count is one. Returns the loop's back-edge branch, if any.
+static llvm::BranchInst* BuildRepeat(Frontend::WrappedLLVMContext* context, llvm::IRBuilder<>& builder,
+                                     llvm::AllocaInst* i_var, u32 count, const std::function<void()>& body)
+{
+  if (count == 1)
+  {
+    body();
+    return nullptr;
+  }
+
+  llvm::Function* func = builder.GetInsertBlock()->getParent();
+  llvm::BasicBlock* compare_bb = llvm::BasicBlock::Create(context->GetLLVMContext(), "", func);
+  llvm::BasicBlock* body_bb = llvm::BasicBlock::Create(context->GetLLVMContext(), "", func);
+  llvm::BasicBlock* exit_bb = llvm::BasicBlock::Create(context->GetLLVMContext(), "", func);
+
+  // for (i = 0; i < count; i++)
+  builder.CreateStore(builder.getInt32(0), i_var);
+  builder.CreateBr(compare_bb);
+  builder.SetInsertPoint(compare_bb);
+  llvm::Value* i = builder.CreateLoad(i_var, "i");
+  builder.CreateCondBr(builder.CreateICmpULT(i, builder.getInt32(count)), body_bb, exit_bb);
+
+  // Body can't contain another loop, since i_var is shared.
+  builder.SetInsertPoint(body_bb);
+  body();
+  i = builder.CreateLoad(i_var, "i");
+  builder.CreateStore(builder.CreateAdd(i, builder.getInt32(1)), i_var);
+  llvm::BranchInst* back_edge = builder.CreateBr(compare_bb);
+
+  builder.SetInsertPoint(exit_bb);
+  return back_edge;
+}
+
+bool FilterBuilder::CanVectorize(const StreamGraph::Filter* filter)
+{
+  // Firings are independent only when there is no state carried between them.
+  const StreamGraph::FilterPermutation* perm = filter->GetFilterPermutation();
+  if (filter->IsFused() || !perm || perm->IsBuiltin() || perm->HasPrework() ||
+      !perm->GetFilterDeclaration()->IsStateless() || !perm->GetFilterDeclaration()->HasWorkBlock())
+  {
+    return false;
+  }
+
+  if (filter->GetMultiplicity() < 2 || (!filter->GetInputType()->isVoidTy() && filter->GetPopRate() == 0))
+    return false;
+
+  // Inputs and outputs for all firings are staged on the stack when they can't be accessed in place.
+  u32 input_size = (filter->GetMultiplicity() - 1) * filter->GetPopRate() +
+                   std::max(filter->GetPeekRate(), filter->GetPopRate());
+  u32 output_size = filter->GetMultiplicity() * filter->GetPushRate();
+  return (input_size <= MAX_VECTOR_STAGING_SIZE && output_size <= MAX_VECTOR_STAGING_SIZE);
+}
+
+u32 FilterBuilder::GetVectorWidth() const
+{
+  if (m_options.vector_width > 0)
+    return m_options.vector_width;
+
+  // Fill the widest vector register of the target with the widest element the filter moves.
+  u32 register_bits = m_filter->GetInputType()->isIntegerTy() ? m_options.int_vector_register_bits :
+                                                                  m_options.float_vector_register_bits;
+  u32 element_bits = std::max(m_filter->GetInputType()->getScalarSizeInBits(),
+                              m_filter->GetOutputType()->getScalarSizeInBits());
+  return std::max(register_bits / std::max(element_bits, 8u), 1u);
+}
+
+bool FilterBuilder::GenerateVectorWorkFunction()
+{
+  const u32 multiplicity = m_filter->GetMultiplicity();
+  const u32 pop_rate = m_filter->GetPopRate();
+  const u32 push_rate = m_filter->GetPushRate();
+  const bool has_input = !m_filter->GetInputType()->isVoidTy();
+  const bool has_output = !m_filter->GetOutputType()->isVoidTy() && push_rate > 0;
+  const u32 input_size = has_input ? ((multiplicity - 1) * pop_rate + std::max(m_filter->GetPeekRate(), pop_rate)) : 0;
+  const u32 output_size = has_output ? (multiplicity * push_rate) : 0;
+  const u32 vector_width = GetVectorWidth();
+
+  // Single-threaded channels are read in place, and the next filter's channel written in place, each retired with one
+  // move of the tail or head. Lock-free queues wait and publish per token, and splits and joins route every token,
+  // so those sides go through a staging buffer on the stack instead.
+  const bool in_place_input = has_input && !m_options.IsThreaded();
+  const StreamGraph::Filter* output_filter =
+    (has_output && !m_options.IsThreaded() && m_filter->HasOutputConnection()) ?
+      dynamic_cast<const StreamGraph::Filter*>(m_filter->GetOutputConnection()) :
+      nullptr;
+  const bool in_place_output = (output_filter != nullptr);
+
+  // Ring buffers wrap with a mask of their size, static buffers don't wrap.
+  auto get_mask = [this](const StreamGraph::Node* node) -> u32 {
+    return m_options.static_buffers ? 0 : (ChannelBuilder::GetInputBufferSize(m_options, m_buffer_sizes, node) - 1);
+  };
+
+  // The kernel is the work block with its channels pointing into the channel or staging buffers.
+  m_local_input = has_input;
+  m_local_output = has_output;
+  m_local_input_mask = in_place_input ? get_mask(m_filter) : 0;
+  m_local_output_mask = in_place_output ? get_mask(output_filter) : 0;
+  llvm::Function* kernel_func = GenerateFunction(m_filter_decl->GetWorkBlock(),
+                                                 StringFromFormat("%s_work_kernel", m_function_prefix.c_str()), true);
+  m_local_input = false;
+  m_local_output = false;
+  m_local_input_mask = 0;
+  m_local_output_mask = 0;
+  if (!kernel_func)
+    return false;
+
+  llvm::Function* func = llvm::cast<llvm::Function>(m_module->getOrInsertFunction(
+    StringFromFormat("%s_work_vector", m_function_prefix.c_str()), m_context->GetVoidType(), nullptr));
+  if (!func)
+    return false;
+
+  func->setLinkage(llvm::GlobalValue::PrivateLinkage);
+  llvm::IRBuilder<> builder(llvm::BasicBlock::Create(m_context->GetLLVMContext(), "entry", func));
+  llvm::AllocaInst* i_var = builder.CreateAlloca(m_context->GetIntType(), nullptr, "i");
+  llvm::AllocaInst* input_position = builder.CreateAlloca(m_context->GetIntType(), nullptr, "input_position");
+  llvm::AllocaInst* output_position = builder.CreateAlloca(m_context->GetIntType(), nullptr, "output_position");
+  llvm::Value* input = nullptr;
+  llvm::Value* output = nullptr;
+  llvm::Value* input_base = builder.getInt32(0);
+  llvm::Value* output_base = builder.getInt32(0);
+  if (in_place_input)
+  {
+    // input = <name>_buffer()
+    // input_base = <name>_pop_n(multiplicity * pop_rate)
+    llvm::Constant* buffer_func =
+      m_module->getOrInsertFunction(StringFromFormat("%s_buffer", m_instance_name.c_str()),
+                                    m_filter->GetInputType()->getPointerTo(), nullptr);
+    llvm::Constant* pop_n_func =
+      m_module->getOrInsertFunction(StringFromFormat("%s_pop_n", m_instance_name.c_str()), m_context->GetIntType(),
+                                    m_context->GetIntType(), nullptr);
+    if (!buffer_func || !pop_n_func)
+      return false;
+
+    input = builder.CreateCall(buffer_func, {}, "input");
+    input_base = builder.CreateCall(pop_n_func, {builder.getInt32(multiplicity * pop_rate)}, "input_base");
+  }
+  else if (has_input)
+  {
+    llvm::AllocaInst* buffer =
+      builder.CreateAlloca(llvm::ArrayType::get(m_filter->GetInputType(), input_size), nullptr, "input_buffer");
+    input = builder.CreateInBoundsGEP(buffer, {builder.getInt32(0), builder.getInt32(0)}, "input");
+
+    // input[i] = peek(i)
+    BuildRepeat(m_context, builder, i_var, input_size, [&]() {
+      llvm::Value* i = builder.CreateLoad(i_var, "i");
+      builder.CreateStore(builder.CreateCall(m_peek_function, {i}), builder.CreateInBoundsGEP(input, {i}));
+    });
+  }
+  if (in_place_output)
+  {
+    // output = <output>_buffer()
+    // output_base = <output>_push_n(output_size)
+    llvm::Constant* buffer_func =
+      m_module->getOrInsertFunction(StringFromFormat("%s_buffer", output_filter->GetName().c_str()),
+                                    m_filter->GetOutputType()->getPointerTo(), nullptr);
+    llvm::Constant* push_n_func =
+      m_module->getOrInsertFunction(StringFromFormat("%s_push_n", output_filter->GetName().c_str()),
+                                    m_context->GetIntType(), m_context->GetIntType(), nullptr);
+    if (!buffer_func || !push_n_func)
+      return false;
+
+    output = builder.CreateCall(buffer_func, {}, "output");
+    output_base = builder.CreateCall(push_n_func, {builder.getInt32(output_size)}, "output_base");
+  }
+  else if (has_output)
+  {
+    llvm::AllocaInst* buffer =
+      builder.CreateAlloca(llvm::ArrayType::get(m_filter->GetOutputType(), output_size), nullptr, "output_buffer");
+    output = builder.CreateInBoundsGEP(buffer, {builder.getInt32(0), builder.getInt32(0)}, "output");
+  }
+
+  // for (i = 0; i < multiplicity; i++)
+  //   input_position = input_base + i * pop_rate
+  //   output_position = output_base + i * push_rate
+  //   kernel(input, &input_position, output, &output_position)
+  // Each firing reads and writes with a stride of its rate, which the loop vectorizer turns into gathers and
+  // scatters, or interleaved loads and stores.
+  llvm::BranchInst* back_edge = BuildRepeat(m_context, builder, i_var, multiplicity, [&]() {
+    llvm::Value* i = builder.CreateLoad(i_var, "i");
+    std::vector<llvm::Value*> args;
+    if (has_input)
+    {
+      builder.CreateStore(builder.CreateAdd(input_base, builder.CreateMul(i, builder.getInt32(pop_rate))),
+                          input_position);
+      args.push_back(input);
+      args.push_back(input_position);
+    }
+    if (has_output)
+    {
+      builder.CreateStore(builder.CreateAdd(output_base, builder.CreateMul(i, builder.getInt32(push_rate))),
+                          output_position);
+      args.push_back(output);
+      args.push_back(output_position);
+    }
+    builder.CreateCall(kernel_func, args);
+  });
+  if (back_edge)
+  {
+    llvm::LLVMContext& ctx = m_context->GetLLVMContext();
+    llvm::Metadata* enable_md[] = {llvm::MDString::get(ctx, "llvm.loop.vectorize.enable"),
+                                   llvm::ConstantAsMetadata::get(builder.getTrue())};
+    llvm::Metadata* width_md[] = {llvm::MDString::get(ctx, "llvm.loop.vectorize.width"),
+                                  llvm::ConstantAsMetadata::get(builder.getInt32(vector_width))};
+    auto temp_md = llvm::MDNode::getTemporary(ctx, llvm::None);
+    llvm::Metadata* loop_md[] = {temp_md.get(), llvm::MDNode::get(ctx, enable_md), llvm::MDNode::get(ctx, width_md)};
+    llvm::MDNode* loop_id = llvm::MDNode::get(ctx, loop_md);
+    loop_id->replaceOperandWith(0, loop_id);
+    back_edge->setMetadata(llvm::LLVMContext::MD_loop, loop_id);
+  }
+
+  // Staged input is removed from the channel, and staged output sent on, once the kernel has run.
+  if (has_input && !in_place_input && pop_rate > 0)
+    BuildRepeat(m_context, builder, i_var, multiplicity * pop_rate, [&]() { builder.CreateCall(m_pop_function); });
+  if (has_output && !in_place_output)
+  {
+    BuildRepeat(m_context, builder, i_var, output_size, [&]() {
+      llvm::Value* i = builder.CreateLoad(i_var, "i");
+      builder.CreateCall(m_push_function, {builder.CreateLoad(builder.CreateInBoundsGEP(output, {i}))});
+    });
+  }
+
+  builder.CreateRetVoid();
+  Log_DevPrintf("Generated vector work function for %s, %u firings at width %u", m_instance_name.c_str(), multiplicity,
+                vector_width);
+  return true;
+}
+
+bool FilterBuilder::GenerateFusedFilter()
+{
+  const StreamGraph::Filter::FusedMemberList& members = m_filter->GetFusedMembers();
+  const StreamGraph::Split* split = m_filter->GetFusedSplit();
+  const StreamGraph::Join* join = m_filter->GetFusedJoin();
+  const bool horizontal = (split != nullptr);
+  if (!GenerateChannelPrototypes())
+    return false;
+
+  // Chain members read from the previous member, splitjoin members from the split and write to the join.
+  std::vector<llvm::Function*> member_work_functions;
+  std::vector<llvm::Function*> member_init_functions;
+  for (size_t i = 0; i < members.size(); i++)
+  {
+    bool local_input = horizontal || i > 0;
+    bool local_output = horizontal || i < (members.size() - 1);
+    std::string prefix = StringFromFormat("%s_%s", m_instance_name.c_str(), members[i].filter->GetName().c_str());
+    FilterBuilder fb(m_context, m_module, m_options);
+    if (!fb.GenerateMemberCode(members[i].filter, prefix, local_input, local_output) || !fb.GetWorkFunction())
+      return false;
+
+    member_work_functions.push_back(fb.GetWorkFunction());
+    if (fb.GetInitFunction())
+      member_init_functions.push_back(fb.GetInitFunction());
+  }
+
+  if (!member_init_functions.empty())
+  {
+    m_init_function = llvm::cast<llvm::Function>(m_module->getOrInsertFunction(
+      StringFromFormat("%s_init", m_instance_name.c_str()), m_context->GetVoidType(), nullptr));
+    if (!m_init_function)
+      return false;
+
+    m_init_function->setLinkage(llvm::GlobalValue::PrivateLinkage);
+    llvm::IRBuilder<> builder(llvm::BasicBlock::Create(m_context->GetLLVMContext(), "entry", m_init_function));
+    for (llvm::Function* init_func : member_init_functions)
+      builder.CreateCall(init_func);
+    builder.CreateRetVoid();
+  }
+
+  m_work_function = llvm::cast<llvm::Function>(m_module->getOrInsertFunction(
+    StringFromFormat("%s_work", m_instance_name.c_str()), m_context->GetVoidType(), nullptr));
+  if (!m_work_function)
+    return false;
+
+  m_work_function->setLinkage(llvm::GlobalValue::PrivateLinkage);
+  llvm::IRBuilder<> builder(llvm::BasicBlock::Create(m_context->GetLLVMContext(), "entry", m_work_function));
+  llvm::AllocaInst* i_var = builder.CreateAlloca(m_context->GetIntType(), nullptr, "i");
+
+  // Allocate local channels, sized to what passes through them in one firing.
+  struct LocalChannel
+  {
+    llvm::Value* buffer;
+    llvm::Value* read_position;
+    llvm::Value* write_position;
+  };
+  auto create_channel = [this, &builder](llvm::Type* type, u32 size, const std::string& name) {
+    llvm::AllocaInst* buffer = builder.CreateAlloca(llvm::ArrayType::get(type, size), nullptr, name);
+    LocalChannel channel;
+    channel.buffer = builder.CreateInBoundsGEP(buffer, {builder.getInt32(0), builder.getInt32(0)}, name + "_ptr");
+    channel.read_position = builder.CreateAlloca(m_context->GetIntType(), nullptr, name + "_read_position");
+    channel.write_position = builder.CreateAlloca(m_context->GetIntType(), nullptr, name + "_write_position");
+    builder.CreateStore(builder.getInt32(0), channel.read_position);
+    builder.CreateStore(builder.getInt32(0), channel.write_position);
+    return channel;
+  };
+
+  std::vector<LocalChannel> input_channels(members.size());
+  std::vector<LocalChannel> output_channels(members.size());
+  for (size_t i = 0; i < members.size(); i++)
+  {
+    const StreamGraph::Filter* filter = members[i].filter;
+    std::string name = StringFromFormat("%s_local", filter->GetName().c_str());
+    if (horizontal)
+    {
+      input_channels[i] = create_channel(filter->GetInputType(), filter->GetPopRate() * members[i].firings,
+                                         StringFromFormat("%s_in", name.c_str()));
+      output_channels[i] = create_channel(filter->GetOutputType(), filter->GetPushRate() * members[i].firings,
+                                          StringFromFormat("%s_out", name.c_str()));
+    }
+    else if (i < (members.size() - 1))
+    {
+      // The output of each chain member is the input of the next.
+      output_channels[i] = create_channel(filter->GetOutputType(), filter->GetPushRate() * members[i].firings, name);
+      input_channels[i + 1] = output_channels[i];
+    }
+  }
+
+  // Split the input across the members' input channels.
+  if (horizontal)
+  {
+    BuildRepeat(m_context, builder, i_var, m_filter->GetFusedSplitFirings(), [&]() {
+      const std::vector<int>& distribution = split->GetDistribution();
+      if (split->GetMode() == StreamGraph::Split::Mode::Duplicate)
+      {
+        llvm::Value* value = builder.CreateCall(m_pop_function);
+        for (size_t i = 0; i < members.size(); i++)
+          BuildLocalChannelPush(builder, input_channels[i].buffer, input_channels[i].write_position, value);
+        return;
+      }
+
+      for (size_t i = 0; i < members.size(); i++)
+      {
+        for (int j = 0; j < distribution[i]; j++)
+        {
+          llvm::Value* value = builder.CreateCall(m_pop_function);
+          BuildLocalChannelPush(builder, input_channels[i].buffer, input_channels[i].write_position, value);
+        }
+      }
+    });
+  }
+
+  // Fire each member in turn.
+  for (size_t i = 0; i < members.size(); i++)
+  {
+    std::vector<llvm::Value*> args;
+    if (horizontal || i > 0)
+    {
+      args.push_back(input_channels[i].buffer);
+      args.push_back(input_channels[i].read_position);
+    }
+    if (horizontal || i < (members.size() - 1))
+    {
+      args.push_back(output_channels[i].buffer);
+      args.push_back(output_channels[i].write_position);
+    }
+
+    llvm::Function* work_func = member_work_functions[i];
+    BuildRepeat(m_context, builder, i_var, members[i].firings, [&]() { builder.CreateCall(work_func, args); });
+  }
+
+  // Join the members' output channels.
+  if (horizontal)
+  {
+    BuildRepeat(m_context, builder, i_var, m_filter->GetFusedJoinFirings(), [&]() {
+      const std::vector<int>& distribution = join->GetDistribution();
+      for (size_t i = 0; i < members.size(); i++)
+      {
+        for (int j = 0; j < distribution[i]; j++)
+        {
+          llvm::Value* value =
+            BuildLocalChannelPop(builder, output_channels[i].buffer, output_channels[i].read_position);
+          if (m_push_function)
+            builder.CreateCall(m_push_function, {value});
+        }
+      }
+    });
+  }
+
+  builder.CreateRetVoid();
+  return true;
+}
+
+bool FilterBuilder::GenerateWorkDispatchFunction()
+{
+  std::vector<llvm::Type*> arg_types;
+  if (m_static_channels)
+    arg_types = {m_context->GetIntType(), m_context->GetIntType()};
+
+  llvm::Constant* func_cons =
+    m_module->getOrInsertFunction(StringFromFormat("%s_work", m_function_prefix.c_str()),
+                                  llvm::FunctionType::get(m_context->GetVoidType(), arg_types, false));
+  llvm::Function* func = llvm::cast<llvm::Function>(func_cons);
+  if (!func)
+    return false;
+
+  func->setLinkage(llvm::GlobalValue::PrivateLinkage);
+
+  llvm::BasicBlock* entry_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "entry", func);
+  llvm::IRBuilder<> builder(entry_bb);
+
+  // The schedule passes where this firing starts in the input channel, and in the input channel of the next filter.
+  // input_position = #input_position#
+  // output_position = #output_position#
+  // args = {<name>_buffer(), &input_position, <output>_buffer(), &output_position}
+  std::vector<llvm::Value*> args;
+  if (m_static_channels)
+  {
+    auto func_args_iter = func->arg_begin();
+    llvm::Value* input_position = &(*func_args_iter++);
+    llvm::Value* output_position = &(*func_args_iter++);
+    input_position->setName("input_position");
+    output_position->setName("output_position");
+    if (m_input_buffer_function)
+    {
+      llvm::AllocaInst* position_var = builder.CreateAlloca(m_context->GetIntType(), nullptr, "input_position_var");
+      builder.CreateStore(input_position, position_var);
+      args.push_back(builder.CreateCall(m_input_buffer_function, {}, "input_buffer"));
+      args.push_back(position_var);
+    }
+    if (m_output_buffer_function)
+    {
+      llvm::AllocaInst* position_var = builder.CreateAlloca(m_context->GetIntType(), nullptr, "output_position_var");
+      builder.CreateStore(output_position, position_var);
+      args.push_back(builder.CreateCall(m_output_buffer_function, {}, "output_buffer"));
+      args.push_back(position_var);
+    }
+  }
+
+  if (!m_prework_function)
+  {
+    builder.CreateCall(m_work_function, args);
+    builder.CreateRetVoid();
+    return true;
+  }
+
+  llvm::GlobalVariable* prework_done_var =
+    new llvm::GlobalVariable(*m_module, m_context->GetBooleanType(), true, llvm::GlobalValue::PrivateLinkage, nullptr,
+                             StringFromFormat("%s_prework_done", m_instance_name.c_str()));
+  prework_done_var->setConstant(false);
+  prework_done_var->setInitializer(llvm::ConstantInt::getFalse(m_context->GetLLVMContext()));
+
+  llvm::BasicBlock* prework_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "prework", func);
+  llvm::BasicBlock* work_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "work", func);
+
+  // if (prework_done) goto work else goto prework
+  llvm::Value* prework_done = builder.CreateLoad(prework_done_var, "prework_done");
+  builder.CreateCondBr(prework_done, work_bb, prework_bb);
+
+  // prework_done = true
+  // prework()
+  builder.SetInsertPoint(prework_bb);
+  builder.CreateStore(builder.getTrue(), prework_done_var);
+  builder.CreateCall(m_prework_function, args);
+  builder.CreateRetVoid();
+
+  // work()
+  builder.SetInsertPoint(work_bb);
+  builder.CreateCall(m_work_function, args);
+  builder.CreateRetVoid();
+  return true;
+}
+
+llvm::Function* FilterBuilder::GenerateFunction(AST::FilterWorkBlock* block, const std::string& name,
+                                                bool channel_args)
 {
   assert(m_module->getFunction(name.c_str()) == nullptr);
   llvm::Type* ret_type = llvm::Type::getVoidTy(m_context->GetLLVMContext());
-  llvm::Constant* func_cons = m_module->getOrInsertFunction(name.c_str(), ret_type, nullptr);
+  llvm::FunctionType* func_type =
+    llvm::FunctionType::get(ret_type, channel_args ? GetLocalChannelArgTypes() : std::vector<llvm::Type*>(), false);
+  llvm::Constant* func_cons = m_module->getOrInsertFunction(name.c_str(), func_type);
   llvm::Function* func = llvm::cast<llvm::Function>(func_cons);
   if (!func)
     return nullptr;
@@ -152,8 +742,26 @@ llvm::Function* FilterBuilder::GenerateFunction(AST::FilterWorkBlock* block, con
   // All our filter functions should be private/static. This way they can be inlined.
   func->setLinkage(llvm::GlobalValue::PrivateLinkage);
 
-  // Start at the entry basic block for the work function.
+  // Local channels are passed as (buffer, position) pairs, input first.
   FragmentBuilder fragment_builder(m_context, name, m_peek_function, m_pop_function, m_push_function);
+  auto get_mask = [this](u32 mask) -> llvm::Value* {
+    return mask ? llvm::ConstantInt::get(m_context->GetIntType(), mask) : nullptr;
+  };
+  auto arg_iter = func->arg_begin();
+  if (channel_args && m_local_input)
+  {
+    llvm::Value* buffer = &(*arg_iter++);
+    llvm::Value* position = &(*arg_iter++);
+    fragment_builder.SetLocalInputChannel(buffer, position, get_mask(m_local_input_mask));
+  }
+  if (channel_args && m_local_output)
+  {
+    llvm::Value* buffer = &(*arg_iter++);
+    llvm::Value* position = &(*arg_iter++);
+    fragment_builder.SetLocalOutputChannel(buffer, position, get_mask(m_local_output_mask));
+  }
+
+  // Start at the entry basic block for the work function.
   Frontend::FunctionBuilder entry_bb_builder(m_context, m_module, &fragment_builder, func);
 
   // Add global variable references
@@ -197,36 +805,70 @@ bool FilterBuilder::GenerateGlobals()
   return true;
 }
 
+std::vector<llvm::Type*> FilterBuilder::GetLocalChannelArgTypes() const
+{
+  std::vector<llvm::Type*> types;
+  if (m_local_input)
+  {
+    types.push_back(m_filter->GetInputType()->getPointerTo());
+    types.push_back(m_context->GetIntType()->getPointerTo());
+  }
+  if (m_local_output)
+  {
+    types.push_back(m_filter->GetOutputType()->getPointerTo());
+    types.push_back(m_context->GetIntType()->getPointerTo());
+  }
+
+  return types;
+}
+
 bool FilterBuilder::GenerateChannelPrototypes()
 {
   // TODO: Don't generate these prototypes when the rate is zero?
-  if (!m_filter_permutation->GetInputType()->isVoidTy())
+  if (!m_filter->GetInputType()->isVoidTy() && !m_local_input)
   {
     // Peek
     llvm::FunctionType* llvm_peek_fn =
-      llvm::FunctionType::get(m_filter_permutation->GetInputType(), {m_context->GetIntType()}, false);
+      llvm::FunctionType::get(m_filter->GetInputType(), {m_context->GetIntType()}, false);
     m_peek_function = m_module->getOrInsertFunction(StringFromFormat("%s_peek", m_instance_name.c_str()), llvm_peek_fn);
     if (!m_peek_function)
       return false;
 
     // Pop
-    llvm::FunctionType* llvm_pop_fn = llvm::FunctionType::get(m_filter_permutation->GetInputType(), false);
+    llvm::FunctionType* llvm_pop_fn = llvm::FunctionType::get(m_filter->GetInputType(), false);
     m_pop_function = m_module->getOrInsertFunction(StringFromFormat("%s_pop", m_instance_name.c_str()), llvm_pop_fn);
     if (!m_pop_function)
       return false;
   }
 
-  if (!m_filter_permutation->GetOutputType()->isVoidTy())
+  if (!m_filter->GetOutputType()->isVoidTy() && !m_local_output)
   {
     // Push - this needs the name of the output filter
     llvm::FunctionType* llvm_push_fn =
-      llvm::FunctionType::get(m_context->GetVoidType(), {m_filter_permutation->GetOutputType()}, false);
+      llvm::FunctionType::get(m_context->GetVoidType(), {m_filter->GetOutputType()}, false);
     m_push_function =
       m_module->getOrInsertFunction(StringFromFormat("%s_push", m_output_channel_name.c_str()), llvm_push_fn);
     if (!m_push_function)
       return false;
   }
 
+  // Static channels are read and written directly, from the start of the buffer.
+  if (m_static_channels && !m_filter->GetInputType()->isVoidTy())
+  {
+    m_input_buffer_function = m_module->getOrInsertFunction(StringFromFormat("%s_buffer", m_instance_name.c_str()),
+                                                            m_filter->GetInputType()->getPointerTo(), nullptr);
+    if (!m_input_buffer_function)
+      return false;
+  }
+  if (m_static_output_filter)
+  {
+    m_output_buffer_function =
+      m_module->getOrInsertFunction(StringFromFormat("%s_buffer", m_static_output_filter->GetName().c_str()),
+                                    m_filter->GetOutputType()->getPointerTo(), nullptr);
+    if (!m_output_buffer_function)
+      return false;
+  }
+
   return true;
 }
 
@@ -321,6 +963,9 @@ bool FilterBuilder::GenerateBuiltinFilter_InputReader()
     builder.CreateCall(read_func, {value_copy_ptr_type, builder.getInt32(value_size), builder.getInt32(1)});
     fragment_builder.BuildPush(builder, builder.CreateLoad(value_copy));
     builder.CreateRetVoid();
+
+    if (!GenerateBulkIOFunction(m_filter_permutation->GetOutputType(), true))
+      return false;
   }
 
   return true;
@@ -384,8 +1029,80 @@ bool FilterBuilder::GenerateBuiltinFilter_OutputWriter()
                                     m_context->GetIntType(), m_context->GetIntType(), nullptr);
     builder.CreateCall(write_func, {value_copy_ptr_type, builder.getInt32(value_size), builder.getInt32(1)});
     builder.CreateRetVoid();
+
+    if (!GenerateBulkIOFunction(m_filter_permutation->GetInputType(), false))
+      return false;
+  }
+
+  return true;
+}
+
+bool FilterBuilder::GenerateBulkIOFunction(llvm::Type* data_type, bool input)
+{
+  const u32 total_tokens = m_filter->GetMultiplicity() * (input ? m_filter->GetPushRate() : m_filter->GetPopRate());
+  if (total_tokens < 2)
+    return true;
+
+  const u32 chunk_size = std::min(total_tokens, MAX_IO_CHUNK_SIZE);
+  const u32 num_chunks = total_tokens / chunk_size;
+  const u32 remainder = total_tokens % chunk_size;
+  const u32 value_size = (data_type->getPrimitiveSizeInBits() + 7) / 8;
+
+  // The runtime hands out a pointer to the tokens, which is into the file itself when it is memory-mapped.
+  llvm::Constant* acquire_func;
+  llvm::Constant* commit_func = nullptr;
+  if (input)
+  {
+    const char* func_name =
+      data_type->isFloatingPointTy() ? "streamit_acquire_input_file_float" : "streamit_acquire_input_file_int";
+    acquire_func = m_module->getOrInsertFunction(func_name, m_context->GetPointerType(), m_context->GetIntType(),
+                                                 m_context->GetIntType(), nullptr);
   }
+  else
+  {
+    acquire_func = m_module->getOrInsertFunction("streamit_acquire_output_file", m_context->GetPointerType(),
+                                                 m_context->GetIntType(), m_context->GetIntType(), nullptr);
+    commit_func = m_module->getOrInsertFunction("streamit_commit_output_file", m_context->GetVoidType(),
+                                                m_context->GetPointerType(), m_context->GetIntType(),
+                                                m_context->GetIntType(), nullptr);
+  }
+
+  llvm::Function* func = llvm::cast<llvm::Function>(m_module->getOrInsertFunction(
+    StringFromFormat("%s_work_bulk", m_instance_name.c_str()), m_context->GetVoidType(), nullptr));
+  if (!acquire_func || (!input && !commit_func) || !func)
+    return false;
+
+  func->setLinkage(llvm::GlobalValue::PrivateLinkage);
+  llvm::IRBuilder<> builder(llvm::BasicBlock::Create(m_context->GetLLVMContext(), "entry", func));
+  llvm::AllocaInst* chunk_var = builder.CreateAlloca(m_context->GetIntType(), nullptr, "chunk");
+  llvm::AllocaInst* i_var = builder.CreateAlloca(m_context->GetIntType(), nullptr, "i");
+
+  // InputReader:  data = acquire_input(sizeof(T), count); for (i = 0; i < count; i++) push(data[i])
+  // OutputWriter: data = acquire_output(sizeof(T), count); for (i = 0; i < count; i++) data[i] = pop();
+  //               commit_output(data, sizeof(T), count)
+  auto build_chunk = [&](u32 count) {
+    llvm::Value* raw_data = builder.CreateCall(acquire_func, {builder.getInt32(value_size), builder.getInt32(count)});
+    llvm::Value* data = builder.CreatePointerCast(raw_data, data_type->getPointerTo(), "data");
+    BuildRepeat(m_context, builder, i_var, count, [&]() {
+      llvm::Value* i = builder.CreateLoad(i_var, "i");
+      llvm::Value* value_ptr = builder.CreateInBoundsGEP(data, {i});
+      if (input)
+        builder.CreateCall(m_push_function, {builder.CreateLoad(value_ptr)});
+      else
+        builder.CreateStore(builder.CreateCall(m_pop_function), value_ptr);
+    });
 
+    if (!input)
+      builder.CreateCall(commit_func, {raw_data, builder.getInt32(value_size), builder.getInt32(count)});
+  };
+
+  BuildRepeat(m_context, builder, chunk_var, num_chunks, [&]() { build_chunk(chunk_size); });
+  if (remainder > 0)
+    build_chunk(remainder);
+
+  builder.CreateRetVoid();
+  Log_DevPrintf("Generated bulk %s function for %s, %u tokens in %u calls", input ? "read" : "write",
+                m_instance_name.c_str(), total_tokens, num_chunks + (remainder > 0 ? 1 : 0));
   return true;
 }
 
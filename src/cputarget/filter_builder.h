@@ -1,5 +1,9 @@
 #pragma once
+#include <string>
 #include <unordered_map>
+#include <vector>
+#include "common/types.h"
+#include "cputarget/codegen_options.h"
 
 namespace llvm
 {
@@ -26,6 +30,7 @@ class WrappedLLVMContext;
 
 namespace StreamGraph
 {
+class BufferSizeAnalysis;
 class FilterPermutation;
 class Filter;
 }
@@ -35,7 +40,7 @@ namespace CPUTarget
 class FilterBuilder
 {
 public:
-  FilterBuilder(Frontend::WrappedLLVMContext* context, llvm::Module* mod);
+  FilterBuilder(Frontend::WrappedLLVMContext* context, llvm::Module* mod, const CodeGenOptions& options);
   ~FilterBuilder();
 
   Frontend::WrappedLLVMContext* GetContext() const { return m_context; }
@@ -48,23 +53,60 @@ public:
   llvm::Constant* GetPopFunction() const { return m_pop_function; }
   llvm::Constant* GetPushFunction() const { return m_push_function; }
 
+  // Vector work functions read and write channel buffers in place, so need their sizes to wrap positions.
+  void SetBufferSizes(const StreamGraph::BufferSizeAnalysis* buffer_sizes) { m_buffer_sizes = buffer_sizes; }
+
   bool GenerateCode(const StreamGraph::Filter* filter);
 
+  // Generates a member of a fused filter, with functions named by the prefix. When the input or output of the member
+  // is a local channel of the fused filter, the work function takes the channel's buffer and position as arguments.
+  bool GenerateMemberCode(const StreamGraph::Filter* filter, const std::string& function_prefix, bool local_input,
+                          bool local_output);
+
+  // Stateless filters can have all firings of a steady state run by <name>_work_vector, as a loop the vectorizer can
+  // process several firings of at once, with the vector width and registers from the options. Single-threaded
+  // channels are read, and written when the output goes to a filter, in place.
+  static bool CanVectorize(const StreamGraph::Filter* filter);
+  bool GenerateVectorWorkFunction();
+
 private:
-  llvm::Function* GenerateFunction(AST::FilterWorkBlock* block, const std::string& name);
+  bool GenerateFilterFunctions();
+  bool GenerateFusedFilter();
+  llvm::Function* GenerateFunction(AST::FilterWorkBlock* block, const std::string& name, bool channel_args);
+  std::vector<llvm::Type*> GetLocalChannelArgTypes() const;
+  u32 GetVectorWidth() const;
   bool GenerateGlobals();
   bool GenerateChannelPrototypes();
+
+  // <name>_work runs prework on the first firing and the work block after, and with static channels, takes where the
+  // firing starts in the input and output channels and passes them on as local channels.
+  bool GenerateWorkDispatchFunction();
+
   bool GenerateBuiltinFilter();
   bool GenerateBuiltinFilter_Identity();
   bool GenerateBuiltinFilter_InputReader();
   bool GenerateBuiltinFilter_OutputWriter();
 
+  // <name>_work_bulk moves all tokens of the InputReader or OutputWriter's steady state with one runtime call per
+  // chunk, instead of one per firing.
+  bool GenerateBulkIOFunction(llvm::Type* data_type, bool input);
+
   Frontend::WrappedLLVMContext* m_context;
   llvm::Module* m_module;
+  CodeGenOptions m_options;
+  const StreamGraph::BufferSizeAnalysis* m_buffer_sizes = nullptr;
+  const StreamGraph::Filter* m_filter = nullptr;
   const StreamGraph::FilterPermutation* m_filter_permutation = nullptr;
   const AST::FilterDeclaration* m_filter_decl = nullptr;
   std::string m_instance_name;
+  std::string m_function_prefix;
   std::string m_output_channel_name;
+  bool m_local_input = false;
+  bool m_local_output = false;
+  u32 m_local_input_mask = 0;
+  u32 m_local_output_mask = 0;
+  bool m_static_channels = false;
+  const StreamGraph::Filter* m_static_output_filter = nullptr;
   std::unordered_map<const AST::Declaration*, llvm::Value*> m_global_variable_map;
 
   llvm::Function* m_init_function = nullptr;
@@ -74,6 +116,8 @@ private:
   llvm::Constant* m_peek_function = nullptr;
   llvm::Constant* m_pop_function = nullptr;
   llvm::Constant* m_push_function = nullptr;
+  llvm::Constant* m_input_buffer_function = nullptr;
+  llvm::Constant* m_output_buffer_function = nullptr;
 };
 
 } // namespace CPUTarget
\ No newline at end of file
@@ -0,0 +1,197 @@
+#include "cputarget/instance_state_builder.h"
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include "common/log.h"
+#include "common/string_helpers.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+Log_SetChannel(CPUTarget::InstanceStateBuilder);
+
+namespace CPUTarget
+{
+// Replaces constant expressions built on the value, such as GEPs into a channel buffer, with instructions at each
+// place they are used. Afterwards, every use of the value from code is directly by an instruction.
+static void ExpandConstantExprUses(llvm::Constant* value)
+{
+  std::vector<llvm::User*> users(value->user_begin(), value->user_end());
+  for (llvm::User* user : users)
+  {
+    llvm::ConstantExpr* expr = llvm::dyn_cast<llvm::ConstantExpr>(user);
+    if (!expr)
+      continue;
+
+    ExpandConstantExprUses(expr);
+
+    std::vector<llvm::User*> expr_users(expr->user_begin(), expr->user_end());
+    for (llvm::User* expr_user : expr_users)
+    {
+      llvm::Instruction* inst = llvm::dyn_cast<llvm::Instruction>(expr_user);
+      if (!inst || std::find(inst->op_begin(), inst->op_end(), expr) == inst->op_end())
+        continue;
+
+      // Values flowing into a phi have to be computed in the incoming block.
+      llvm::PHINode* phi = llvm::dyn_cast<llvm::PHINode>(inst);
+      if (phi)
+      {
+        for (unsigned i = 0; i < phi->getNumIncomingValues(); i++)
+        {
+          if (phi->getIncomingValue(i) != expr)
+            continue;
+
+          llvm::Instruction* expr_inst = expr->getAsInstruction();
+          expr_inst->insertBefore(phi->getIncomingBlock(i)->getTerminator());
+          phi->setIncomingValue(i, expr_inst);
+        }
+
+        continue;
+      }
+
+      llvm::Instruction* expr_inst = expr->getAsInstruction();
+      expr_inst->insertBefore(inst);
+      inst->replaceUsesOfWith(expr, expr_inst);
+    }
+
+    if (expr->use_empty())
+      expr->destroyConstant();
+  }
+}
+
+// Creates a copy of the function with the instance pointer as the first parameter, and moves the body into it.
+static llvm::Function* AddInstanceParameter(llvm::Function* func, llvm::PointerType* instance_ptr_type)
+{
+  llvm::FunctionType* old_type = func->getFunctionType();
+  std::vector<llvm::Type*> params = {instance_ptr_type};
+  params.insert(params.end(), old_type->param_begin(), old_type->param_end());
+  llvm::FunctionType* new_type = llvm::FunctionType::get(old_type->getReturnType(), params, old_type->isVarArg());
+
+  llvm::Function* new_func = llvm::Function::Create(new_type, func->getLinkage(), "", func->getParent());
+  new_func->takeName(func);
+  new_func->setCallingConv(func->getCallingConv());
+  new_func->getBasicBlockList().splice(new_func->begin(), func->getBasicBlockList());
+
+  auto new_args_iter = new_func->arg_begin();
+  (new_args_iter++)->setName("instance");
+  for (llvm::Argument& arg : func->args())
+  {
+    llvm::Argument* new_arg = &(*new_args_iter++);
+    arg.replaceAllUsesWith(new_arg);
+    new_arg->takeName(&arg);
+  }
+
+  return new_func;
+}
+
+llvm::StructType* BuildInstanceState(llvm::Module* mod, const std::string& prefix)
+{
+  llvm::LLVMContext& ctx = mod->getContext();
+
+  // Channels, split/join counters, filter state and flags. Constants such as distribution tables and strings are
+  // shared between instances.
+  std::vector<llvm::GlobalVariable*> vars;
+  std::vector<llvm::Type*> field_types;
+  for (llvm::GlobalVariable& var : mod->globals())
+  {
+    if (var.isConstant() || !var.hasInitializer())
+      continue;
+
+    vars.push_back(&var);
+    field_types.push_back(var.getValueType());
+  }
+
+  std::vector<llvm::Function*> funcs;
+  for (llvm::Function& func : *mod)
+  {
+    if (func.isDeclaration())
+      continue;
+
+    // Functions are only ever called directly, so every caller has an instance to pass along.
+    for (llvm::Use& use : func.uses())
+    {
+      llvm::CallInst* call = llvm::dyn_cast<llvm::CallInst>(use.getUser());
+      if (!call || call->getCalledValue() != &func)
+      {
+        Log_ErrorPrintf("Function %s is referenced indirectly, can't move state to an instance",
+                        func.getName().str().c_str());
+        return nullptr;
+      }
+    }
+
+    funcs.push_back(&func);
+  }
+
+  for (llvm::GlobalVariable* var : vars)
+  {
+    ExpandConstantExprUses(var);
+    for (llvm::User* user : var->users())
+    {
+      if (!llvm::isa<llvm::Instruction>(user))
+      {
+        Log_ErrorPrintf("Global %s is referenced by a constant, can't move state to an instance",
+                        var->getName().str().c_str());
+        return nullptr;
+      }
+    }
+  }
+
+  llvm::StructType* instance_type =
+    llvm::StructType::create(ctx, field_types, StringFromFormat("%s_instance", prefix.c_str()));
+  llvm::PointerType* instance_ptr_type = instance_type->getPointerTo();
+
+  std::unordered_map<llvm::Function*, llvm::Function*> new_funcs;
+  for (llvm::Function* func : funcs)
+    new_funcs.emplace(func, AddInstanceParameter(func, instance_ptr_type));
+
+  // All callers have been moved to the new functions, so their first argument is the instance to pass on.
+  for (llvm::Function* func : funcs)
+  {
+    llvm::Function* new_func = new_funcs[func];
+    while (!func->use_empty())
+    {
+      llvm::CallInst* call = llvm::cast<llvm::CallInst>(func->user_back());
+      std::vector<llvm::Value*> args = {&(*call->getParent()->getParent()->arg_begin())};
+      args.insert(args.end(), call->arg_operands().begin(), call->arg_operands().end());
+
+      llvm::CallInst* new_call = llvm::CallInst::Create(new_func, args, "", call);
+      new_call->takeName(call);
+      new_call->setCallingConv(call->getCallingConv());
+      new_call->setTailCall(call->isTailCall());
+      call->replaceAllUsesWith(new_call);
+      call->eraseFromParent();
+    }
+
+    func->eraseFromParent();
+  }
+
+  // Each function computes the address of the fields it uses once, at the start.
+  for (unsigned i = 0; i < vars.size(); i++)
+  {
+    llvm::GlobalVariable* var = vars[i];
+    std::unordered_map<llvm::Function*, llvm::Value*> field_ptrs;
+    while (!var->use_empty())
+    {
+      llvm::Use& use = *var->use_begin();
+      llvm::Function* func = llvm::cast<llvm::Instruction>(use.getUser())->getParent()->getParent();
+      llvm::Value*& field_ptr = field_ptrs[func];
+      if (!field_ptr)
+      {
+        llvm::BasicBlock& entry_bb = func->getEntryBlock();
+        llvm::IRBuilder<> builder(&entry_bb, entry_bb.getFirstInsertionPt());
+        field_ptr = builder.CreateStructGEP(instance_type, &(*func->arg_begin()), i, var->getName());
+      }
+
+      use.set(field_ptr);
+    }
+
+    var->eraseFromParent();
+  }
+
+  Log_InfoPrintf("Moved %u globals into %s, used by %u functions", unsigned(vars.size()),
+                 instance_type->getName().str().c_str(), unsigned(funcs.size()));
+  return instance_type;
+}
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <string>
+
+namespace llvm
+{
+class Module;
+class StructType;
+}
+
+namespace CPUTarget
+{
+// Moves every mutable global in the module into one struct type, named <prefix>_instance, and adds a pointer to it
+// as the first parameter of every function defined in the module. Calls between them pass the pointer along, so
+// the generated code no longer touches any global state, and several instances can run at once.
+// Returns the struct type, or nullptr if a global or function is referenced from somewhere other than code.
+llvm::StructType* BuildInstanceState(llvm::Module* mod, const std::string& prefix);
+}
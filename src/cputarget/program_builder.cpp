@@ -1,28 +1,47 @@
 #include "cputarget/program_builder.h"
+#include <algorithm>
 #include <cassert>
+#include <cctype>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 #include "common/log.h"
 #include "common/string_helpers.h"
 #include "cputarget/channel_builder.h"
 #include "cputarget/debug_print_builder.h"
 #include "cputarget/filter_builder.h"
+#include "cputarget/instance_state_builder.h"
 #include "frontend/wrapped_llvm_context.h"
+#include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/IR/Argument.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "parser/ast.h"
+#include "streamgraph/buffer_size_analysis.h"
+#include "streamgraph/flat_graph.h"
+#include "streamgraph/schedule.h"
 #include "streamgraph/streamgraph.h"
 Log_SetChannel(CPUTarget::ProgramBuilder);
 
 namespace CPUTarget
 {
-ProgramBuilder::ProgramBuilder(Frontend::WrappedLLVMContext* context, const std::string& module_name)
-  : m_context(context), m_module_name(module_name)
+ProgramBuilder::ProgramBuilder(Frontend::WrappedLLVMContext* context, const std::string& module_name,
+                               const CodeGenOptions& options)
+  : m_context(context), m_module_name(module_name), m_options(options)
 {
 }
 
@@ -41,41 +60,380 @@ std::unique_ptr<llvm::Module> ProgramBuilder::DetachModule()
   return std::move(modptr);
 }
 
+static const char* GetScheduleStrategyName(ScheduleStrategy strategy)
+{
+  switch (strategy)
+  {
+  case ScheduleStrategy::Push:
+    return "push";
+
+  case ScheduleStrategy::Phased:
+    return "phased";
+
+  default:
+    return "single appearance";
+  }
+}
+
 bool ProgramBuilder::GenerateCode(StreamGraph::StreamGraph* streamgraph)
 {
+  if (m_options.static_buffers && m_options.IsThreaded())
+  {
+    Log_ErrorPrintf("Static buffers can not be combined with multiple threads");
+    return false;
+  }
+  if (m_options.static_buffers && m_options.channel_stats)
+  {
+    Log_ErrorPrintf("Static buffers can not be combined with channel stats");
+    return false;
+  }
+  if (m_options.library && m_options.IsThreaded())
+  {
+    Log_ErrorPrintf("Libraries can not be combined with multiple threads");
+    return false;
+  }
+  if (m_options.instance_state && m_options.IsThreaded())
+  {
+    Log_ErrorPrintf("Instance state can not be combined with multiple threads");
+    return false;
+  }
+  if (m_options.profile && (m_options.library || m_options.instance_state))
+  {
+    Log_ErrorPrintf("Profiling can not be combined with libraries or instance state");
+    return false;
+  }
+  if (m_options.channel_stats && (m_options.library || m_options.instance_state))
+  {
+    Log_ErrorPrintf("Channel stats can not be combined with libraries or instance state");
+    return false;
+  }
+  if (m_options.schedule_strategy != ScheduleStrategy::SingleAppearance && m_options.IsThreaded())
+  {
+    Log_ErrorPrintf("The %s schedule can not be combined with multiple threads",
+                    GetScheduleStrategyName(m_options.schedule_strategy));
+    return false;
+  }
+
+  // The module's data layout sizes the working set when scaling.
   CreateModule();
 
+  if (!ScaleSteadyState(streamgraph) || !AnalyzeBufferSizes(streamgraph))
+    return false;
+
   if (!GenerateFilterAndChannelFunctions(streamgraph))
     return false;
 
+  if (m_options.static_buffers &&
+      (!GenerateChannelResetFunction(streamgraph, true) || !GenerateChannelResetFunction(streamgraph, false)))
+  {
+    return false;
+  }
+
   if (!GeneratePrimePumpFunction(streamgraph))
     return false;
 
-  if (!GenerateSteadyStateFunction(streamgraph))
+  if (m_options.IsThreaded())
+  {
+    if (!GenerateThreadedSteadyStateFunction(streamgraph))
+      return false;
+  }
+  else
+  {
+    if (!GenerateSteadyStateFunction(streamgraph))
+      return false;
+  }
+
+  if (m_options.library && !GenerateLibraryProcessFunction(streamgraph))
     return false;
 
-  if (!GenerateMainFunction())
+  // Globals are complete now, so reset can cover all of them.
+  if ((m_options.library || m_options.instance_state) && !GenerateResetFunction())
+    return false;
+
+  if (m_options.instance_state && !GenerateInstanceFunctions())
+    return false;
+
+  if (m_options.library)
+    return (m_options.instance_state || GenerateLibraryInitFunction());
+
+  if (!GenerateMainFunction(streamgraph))
+    return false;
+
+  return true;
+}
+
+bool ProgramBuilder::ScaleSteadyState(StreamGraph::StreamGraph* streamgraph)
+{
+  u32 scale = m_options.steady_state_scale;
+  if (scale == 0)
+  {
+    // Buffers grow linearly with the scale, apart from the peek residue which stays fixed, so
+    // state + scale * buffers bounds the working set from above.
+    static const u32 MAX_SCALE = 1024;
+    if (!AnalyzeBufferSizes(streamgraph))
+      return false;
+
+    u64 state_size = GetFilterStateSize(streamgraph);
+    u64 buffer_size = std::max(GetBufferFootprint(streamgraph), u64(1));
+    u64 fit = (m_options.cache_size > state_size) ? ((m_options.cache_size - state_size) / buffer_size) : 0;
+    scale = u32(std::min({std::max(fit, u64(1)), u64(MAX_SCALE), u64(streamgraph->GetMaxSteadyStateScale())}));
+    Log_InfoPrintf("Working set is %llu bytes of state and %llu bytes of channels, scaling by %u to fit %u bytes",
+                   static_cast<unsigned long long>(state_size), static_cast<unsigned long long>(buffer_size), scale,
+                   m_options.cache_size);
+    if (fit == 0)
+      Log_WarningPrintf("Working set does not fit in %u bytes even without scaling", m_options.cache_size);
+  }
+
+  return (scale <= 1 || streamgraph->ScaleSteadyState(scale));
+}
+
+// Fused filters keep the state of each of their members.
+static u64 GetFilterStateSize(Frontend::WrappedLLVMContext* context, const llvm::DataLayout& data_layout,
+                              const StreamGraph::Filter* filter)
+{
+  u64 size = 0;
+  if (filter->IsFused())
+  {
+    for (const StreamGraph::Filter::FusedMember& member : filter->GetFusedMembers())
+      size += GetFilterStateSize(context, data_layout, member.filter);
+
+    return size;
+  }
+
+  const AST::FilterDeclaration* filter_decl = filter->GetFilterPermutation()->GetFilterDeclaration();
+  if (!filter_decl->HasStateVariables())
+    return size;
+
+  for (const AST::Node* node : *filter_decl->GetStateVariables())
+  {
+    const AST::VariableDeclaration* var_decl = dynamic_cast<const AST::VariableDeclaration*>(node);
+    if (var_decl)
+      size += data_layout.getTypeAllocSize(context->GetLLVMType(var_decl->GetType()));
+  }
+
+  return size;
+}
+
+u64 ProgramBuilder::GetFilterStateSize(StreamGraph::StreamGraph* streamgraph) const
+{
+  u64 size = 0;
+  for (const StreamGraph::Filter* filter : streamgraph->GetFilterInstanceList())
+    size += CPUTarget::GetFilterStateSize(m_context, m_module->getDataLayout(), filter);
+
+  return size;
+}
+
+StreamGraph::Schedule ProgramBuilder::BuildSteadyStateSchedule(StreamGraph::StreamGraph* streamgraph) const
+{
+  const StreamGraph::NodeList& filter_list = streamgraph->GetFlatGraph()->GetFilterList(m_options.IsThreaded());
+
+  switch (m_options.schedule_strategy)
+  {
+  case ScheduleStrategy::Push:
+    return StreamGraph::BuildPushSchedule(streamgraph, filter_list);
+
+  case ScheduleStrategy::Phased:
+    return StreamGraph::BuildPhasedSchedule(streamgraph, filter_list);
+
+  default:
+    return StreamGraph::BuildSteadyStateSchedule(filter_list);
+  }
+}
+
+bool ProgramBuilder::AnalyzeBufferSizes(StreamGraph::StreamGraph* streamgraph)
+{
+  // Size channels from the same schedule that is generated below.
+  const StreamGraph::NodeList& filter_list = streamgraph->GetFlatGraph()->GetFilterList(m_options.IsThreaded());
+
+  m_buffer_sizes = std::make_unique<StreamGraph::BufferSizeAnalysis>(streamgraph);
+  if (m_buffer_sizes->Analyze(StreamGraph::BuildInitSchedule(filter_list), BuildSteadyStateSchedule(streamgraph)))
+  {
+    return true;
+  }
+
+  // Static buffers are compacted every steady state, so an unbounded channel would overrun its buffer.
+  if (m_options.static_buffers)
+  {
+    Log_ErrorPrintf("Static buffers require a rate-matched schedule");
     return false;
+  }
 
+  Log_WarningPrintf("Falling back to default channel buffer sizes");
   return true;
 }
 
+u64 ProgramBuilder::GetBufferFootprint(StreamGraph::StreamGraph* streamgraph) const
+{
+  if (!m_module)
+    return 0;
+
+  const StreamGraph::NodeList& filter_list = streamgraph->GetFlatGraph()->GetFilterList(true);
+
+  u64 bytes = 0;
+  for (const StreamGraph::Node* node : filter_list)
+  {
+    if (!node->GetInputType() || node->GetInputType()->isVoidTy())
+      continue;
+
+    const StreamGraph::Join* join = dynamic_cast<const StreamGraph::Join*>(node);
+    u32 num_inputs = join ? join->GetIncomingStreams() : 1;
+    u64 element_size = m_module->getDataLayout().getTypeAllocSize(node->GetInputType());
+    bytes += u64(ChannelBuilder::GetInputBufferSize(m_options, m_buffer_sizes.get(), node)) * num_inputs * element_size;
+  }
+
+  return bytes;
+}
+
+std::string ProgramBuilder::GetBufferReport(StreamGraph::StreamGraph* streamgraph) const
+{
+  if (!m_module)
+    return {};
+
+  const StreamGraph::NodeList& filter_list = streamgraph->GetFlatGraph()->GetFilterList(true);
+
+  std::string report;
+  if (!m_options.IsThreaded())
+  {
+    report += StringFromFormat("Steady state schedule: %s, %u call sites\n",
+                               GetScheduleStrategyName(m_options.schedule_strategy),
+                               unsigned(BuildSteadyStateSchedule(streamgraph).size()));
+  }
+
+  report +=
+    StringFromFormat("%-40s %8s %12s %12s %12s\n", "Channel", "Inputs", "Default", "Analyzed", "Saved (bytes)");
+  u64 total_default_bytes = 0;
+  u64 total_bytes = 0;
+  for (const StreamGraph::Node* node : filter_list)
+  {
+    if (!node->GetInputType() || node->GetInputType()->isVoidTy())
+      continue;
+
+    const StreamGraph::Join* join = dynamic_cast<const StreamGraph::Join*>(node);
+    u32 num_inputs = join ? join->GetIncomingStreams() : 1;
+    u64 element_size = m_module->getDataLayout().getTypeAllocSize(node->GetInputType());
+    u32 default_size = ChannelBuilder::GetDefaultInputBufferSize(node);
+    u32 size = ChannelBuilder::GetInputBufferSize(m_options, m_buffer_sizes.get(), node);
+    u64 default_bytes = u64(default_size) * num_inputs * element_size;
+    u64 bytes = u64(size) * num_inputs * element_size;
+    report += StringFromFormat("%-40s %8u %12u %12u %12lld\n", node->GetName().c_str(), num_inputs, default_size, size,
+                               static_cast<long long>(default_bytes) - static_cast<long long>(bytes));
+    total_default_bytes += default_bytes;
+    total_bytes += bytes;
+  }
+
+  report += StringFromFormat("Total: %llu bytes, down from %llu bytes with the default sizes\n",
+                             static_cast<unsigned long long>(total_bytes),
+                             static_cast<unsigned long long>(total_default_bytes));
+  return report;
+}
+
 void ProgramBuilder::CreateModule()
 {
   m_module = m_context->CreateModule(m_module_name.c_str());
   Log_InfoPrintf("Module name is '%s'", m_module_name.c_str());
 }
 
-void ProgramBuilder::OptimizeModule()
+bool ProgramBuilder::LinkRuntimeLibrary(const std::string& filename)
 {
-  Log_InfoPrintf("Optimizing LLVM IR...");
+  Log_InfoPrintf("Linking runtime library from %s...", filename.c_str());
+
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(filename);
+  if (!buffer)
+  {
+    Log_ErrorPrintf("Failed to read %s: %s", filename.c_str(), buffer.getError().message().c_str());
+    return false;
+  }
+
+  llvm::Expected<std::unique_ptr<llvm::Module>> runtime_module =
+    llvm::parseBitcodeFile((*buffer)->getMemBufferRef(), m_context->GetLLVMContext());
+  if (!runtime_module)
+  {
+    Log_ErrorPrintf("Failed to parse %s: %s", filename.c_str(), llvm::toString(runtime_module.takeError()).c_str());
+    return false;
+  }
+
+  // Anything defined after linking which wasn't before came from the runtime.
+  std::unordered_set<std::string> program_symbols;
+  for (const llvm::GlobalValue& gv : m_module->global_values())
+  {
+    if (!gv.isDeclaration())
+      program_symbols.insert(gv.getName().str());
+  }
+
+  if (llvm::Linker::linkModules(*m_module, std::move(*runtime_module), llvm::Linker::LinkOnlyNeeded))
+  {
+    Log_ErrorPrintf("Failed to link runtime library into module");
+    return false;
+  }
+
+  // Internal, so the optimizer can inline and drop them, and so they don't clash with the native runtime library
+  // which is still linked in for anything the bitcode doesn't provide.
+  u32 num_linked = 0;
+  for (llvm::GlobalValue& gv : m_module->global_values())
+  {
+    if (gv.isDeclaration() || !gv.hasExternalLinkage() || program_symbols.count(gv.getName().str()) > 0)
+      continue;
+
+    gv.setLinkage(llvm::GlobalValue::InternalLinkage);
+    num_linked++;
+  }
+
+  // The generated functions have no target attributes, and the inliner won't mix functions whose attributes differ.
+  // The CPU is picked when the object file is written, for both.
+  for (llvm::Function& func : *m_module)
+  {
+    func.removeFnAttr("target-cpu");
+    func.removeFnAttr("target-features");
+  }
+
+  Log_InfoPrintf("Linked %u runtime library symbols", num_linked);
+  return true;
+}
+
+// Sets an option of a pass which the pass manager builder doesn't expose, as if it was given on the command line.
+static void SetLLVMOption(const char* name, const std::string& value)
+{
+  llvm::StringMap<llvm::cl::Option*>& options = llvm::cl::getRegisteredOptions();
+  auto iter = options.find(name);
+  if (iter == options.end())
+  {
+    Log_WarningPrintf("LLVM option %s does not exist, ignoring", name);
+    return;
+  }
+
+  iter->second->addOccurrence(0, name, value);
+}
+
+void ProgramBuilder::OptimizeModule(const OptimizationOptions& options, llvm::TargetMachine* target_machine)
+{
+  Log_InfoPrintf("Optimizing LLVM IR (level %u, size level %u)...", options.opt_level, options.size_level);
+
+  // The target's data layout has to be known for the cost models to be any use.
+  if (target_machine)
+  {
+    m_module->setTargetTriple(target_machine->getTargetTriple().str());
+    m_module->setDataLayout(target_machine->createDataLayout());
+  }
 
   llvm::legacy::FunctionPassManager fpm(m_module);
   llvm::legacy::PassManager mpm;
+  if (target_machine)
+  {
+    fpm.add(llvm::createTargetTransformInfoWrapperPass(target_machine->getTargetIRAnalysis()));
+    mpm.add(llvm::createTargetTransformInfoWrapperPass(target_machine->getTargetIRAnalysis()));
+  }
 
-  // Use standard -O2 optimizations.
+  // The builder doesn't inline unless given an inliner, which the runtime library calls depend on.
   llvm::PassManagerBuilder builder;
-  builder.OptLevel = 2;
+  builder.OptLevel = options.opt_level;
+  builder.SizeLevel = options.size_level;
+  if (options.opt_level > 0)
+    builder.Inliner = llvm::createFunctionInliningPass(options.opt_level, options.size_level);
+  builder.LoopVectorize = (options.loop_vectorize && options.opt_level > 1);
+  builder.SLPVectorize = (options.slp_vectorize && options.opt_level > 1);
+  builder.DisableUnrollLoops = (options.unroll_threshold == 0);
+  if (options.unroll_threshold > 0)
+    SetLLVMOption("unroll-threshold", std::to_string(options.unroll_threshold));
 
   builder.populateFunctionPassManager(fpm);
   builder.populateModulePassManager(mpm);
@@ -91,8 +449,10 @@ void ProgramBuilder::OptimizeModule()
 class CodeGeneratorVisitor : public StreamGraph::Visitor
 {
 public:
-  CodeGeneratorVisitor(Frontend::WrappedLLVMContext* context, llvm::Module* module)
-    : m_context(context), m_module(module)
+  CodeGeneratorVisitor(Frontend::WrappedLLVMContext* context, llvm::Module* module, const CodeGenOptions& options,
+                       StreamGraph::StreamGraph* streamgraph, const StreamGraph::BufferSizeAnalysis* buffer_sizes)
+    : m_context(context), m_module(module), m_options(options), m_streamgraph(streamgraph),
+      m_buffer_sizes(buffer_sizes)
   {
   }
 
@@ -105,23 +465,43 @@ public:
 private:
   Frontend::WrappedLLVMContext* m_context;
   llvm::Module* m_module;
+  const CodeGenOptions& m_options;
+  StreamGraph::StreamGraph* m_streamgraph;
+  const StreamGraph::BufferSizeAnalysis* m_buffer_sizes;
 };
 
 bool CodeGeneratorVisitor::Visit(StreamGraph::Filter* node)
 {
-  Log_InfoPrintf("Generating filter function set %s for %s", node->GetName().c_str(),
-                 node->GetFilterPermutation()->GetFilterDeclaration()->GetName().c_str());
+  if (node->IsFused())
+  {
+    Log_InfoPrintf("Generating fused filter function set %s for %u filters", node->GetName().c_str(),
+                   unsigned(node->GetFusedMembers().size()));
+  }
+  else
+  {
+    Log_InfoPrintf("Generating filter function set %s for %s", node->GetName().c_str(),
+                   node->GetFilterPermutation()->GetFilterDeclaration()->GetName().c_str());
+  }
 
   // Generate fifo queue for the input side of this filter
-  ChannelBuilder cb(m_context, m_module);
+  ChannelBuilder cb(m_context, m_module, m_options);
+  cb.SetBufferSizes(m_buffer_sizes);
+  cb.SetInputProducer(m_streamgraph->GetSinglePredecessor(node));
   if (!cb.GenerateCode(node))
     return false;
 
   // Generate functions for filter node
-  FilterBuilder fb(m_context, m_module);
+  FilterBuilder fb(m_context, m_module, m_options);
+  fb.SetBufferSizes(m_buffer_sizes);
   if (!fb.GenerateCode(node))
     return false;
 
+  if (m_options.vectorize && FilterBuilder::CanVectorize(node))
+  {
+    if (!fb.GenerateVectorWorkFunction())
+      return false;
+  }
+
   return true;
 }
 
@@ -155,13 +535,14 @@ bool CodeGeneratorVisitor::Visit(StreamGraph::SplitJoin* node)
 
 bool CodeGeneratorVisitor::Visit(StreamGraph::Split* node)
 {
-  ChannelBuilder cb(m_context, m_module);
+  ChannelBuilder cb(m_context, m_module, m_options);
   return cb.GenerateCode(node);
 }
 
 bool CodeGeneratorVisitor::Visit(StreamGraph::Join* node)
 {
-  ChannelBuilder cb(m_context, m_module);
+  ChannelBuilder cb(m_context, m_module, m_options);
+  cb.SetBufferSizes(m_buffer_sizes);
   return cb.GenerateCode(node);
 }
 
@@ -169,88 +550,70 @@ bool ProgramBuilder::GenerateFilterAndChannelFunctions(StreamGraph::StreamGraph*
 {
   Log_InfoPrintf("Generating filter and channel functions...");
 
-  CodeGeneratorVisitor codegen(m_context, m_module);
+  CodeGeneratorVisitor codegen(m_context, m_module, m_options, streamgraph, m_buffer_sizes.get());
   return streamgraph->GetRootNode()->Accept(&codegen);
 }
 
-class FilterListVisitor : public StreamGraph::Visitor
+// Static buffer mode: where a firing of the filter starts reading its input, or writing its output, counting from the
+// last channel reset. Only the first firing of the init schedule runs prework.
+static u32 GetStaticChannelPosition(const StreamGraph::Filter* filter, u32 firing, bool init, bool input)
 {
-public:
-  using IterationPair = std::pair<u32, StreamGraph::Filter*>;
-  using FilterList = std::vector<IterationPair>;
-
-  FilterListVisitor() = default;
-
-  const FilterList& GetFilterList() const { return m_filter_list; }
+  const StreamGraph::FilterPermutation* perm = filter->GetFilterPermutation();
+  u32 rate = input ? filter->GetPopRate() : filter->GetPushRate();
+  if (!init || firing == 0 || !perm || !perm->HasPrework())
+    return firing * rate;
 
-  virtual bool Visit(StreamGraph::Filter* node) override;
-  virtual bool Visit(StreamGraph::Pipeline* node) override;
-  virtual bool Visit(StreamGraph::SplitJoin* node) override;
-  virtual bool Visit(StreamGraph::Split* node) override;
-  virtual bool Visit(StreamGraph::Join* node) override;
-
-private:
-  FilterList m_filter_list;
-  u32 m_current_iteration = 0;
-};
-
-bool FilterListVisitor::Visit(StreamGraph::Filter* node)
-{
-  m_filter_list.push_back(std::make_pair(m_current_iteration, node));
-  m_current_iteration++;
-  return true;
+  u32 prework_rate = u32(input ? perm->GetPreworkPopRate() : perm->GetPreworkPushRate());
+  return prework_rate + (firing - 1) * rate;
 }
 
-bool FilterListVisitor::Visit(StreamGraph::Pipeline* node)
+bool ProgramBuilder::GenerateChannelResetFunction(StreamGraph::StreamGraph* streamgraph, bool init)
 {
-  for (StreamGraph::Node* child : node->GetChildren())
-  {
-    if (!child->Accept(this))
-      return false;
-  }
+  const StreamGraph::NodeList& filter_list = streamgraph->GetFlatGraph()->GetFilterList(true);
 
-  return true;
-}
+  llvm::Constant* func_cons = GetChannelResetFunction(init);
+  if (!func_cons)
+    return false;
+  llvm::Function* func = llvm::cast<llvm::Function>(func_cons);
+  if (!func)
+    return false;
 
-bool FilterListVisitor::Visit(StreamGraph::SplitJoin* node)
-{
-  u32 last_iteration = m_current_iteration;
+  func->setLinkage(llvm::GlobalValue::PrivateLinkage);
 
-  for (StreamGraph::Node* child : node->GetChildren())
+  // Call <name>_reset for every node with an input buffer. Filters are passed the tokens they consumed in the
+  // schedule, which their static firings don't count in the channel's tail.
+  llvm::BasicBlock* entry_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "entry", func);
+  llvm::IRBuilder<> builder(entry_bb);
+  for (const StreamGraph::Node* node : filter_list)
   {
-    if (!child->Accept(this))
-      return false;
+    llvm::Function* reset_func = m_module->getFunction(StringFromFormat("%s_reset", node->GetName().c_str()));
+    if (!reset_func)
+      continue;
 
-    // All splitjoin children are executed in parallel
-    m_current_iteration = last_iteration;
+    const StreamGraph::Filter* filter = dynamic_cast<const StreamGraph::Filter*>(node);
+    if (filter)
+    {
+      u32 firings = init ? filter->GetInitFirings() : filter->GetMultiplicity();
+      builder.CreateCall(reset_func, {builder.getInt32(GetStaticChannelPosition(filter, firings, init, true))});
+    }
+    else
+    {
+      builder.CreateCall(reset_func);
+    }
   }
 
-  m_current_iteration = last_iteration + 1;
-  return true;
-}
-
-bool FilterListVisitor::Visit(StreamGraph::Split* node)
-{
-  return true;
-}
-
-bool FilterListVisitor::Visit(StreamGraph::Join* node)
-{
+  builder.CreateRetVoid();
   return true;
 }
 
 bool ProgramBuilder::GeneratePrimePumpFunction(StreamGraph::StreamGraph* streamgraph)
 {
-  FilterListVisitor lv;
-  if (!streamgraph->GetRootNode()->Accept(&lv))
-    return false;
+  const StreamGraph::NodeList& filter_list = streamgraph->GetFlatGraph()->GetFilterList(m_options.IsThreaded());
 
-  Log_InfoPrintf("Generating prime pump function for %u filter instances...", unsigned(lv.GetFilterList().size()));
-  for (auto ip : lv.GetFilterList())
-  {
-    Log_InfoPrintf("Iteration %u: %s (%u multiplicity)", ip.first, ip.second->GetName().c_str(),
-                   ip.second->GetMultiplicity());
-  }
+  StreamGraph::Schedule schedule = StreamGraph::BuildInitSchedule(filter_list);
+  Log_InfoPrintf("Generating prime pump function for %u filter instances...", unsigned(schedule.size()));
+  for (const StreamGraph::SchedulePhase& phase : schedule)
+    Log_InfoPrintf("Init: %s (%u firings)", phase.node->GetName().c_str(), phase.firings);
 
   llvm::Constant* func_cons = m_module->getOrInsertFunction(StringFromFormat("%s_prime_pump", m_module_name.c_str()),
                                                             m_context->GetVoidType(), nullptr);
@@ -263,94 +626,147 @@ bool ProgramBuilder::GeneratePrimePumpFunction(StreamGraph::StreamGraph* streamg
   func->setLinkage(llvm::GlobalValue::PrivateLinkage);
 
   llvm::BasicBlock* entry_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "entry", func);
+  llvm::BasicBlock* current_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "", func);
   llvm::IRBuilder<> builder(entry_bb);
-  llvm::AllocaInst* iteration_var = builder.CreateAlloca(m_context->GetIntType(), nullptr, "iteration");
-  builder.CreateStore(builder.getInt32(0), iteration_var);
 
   // Generate calls to filter init functions
-  for (auto ip : lv.GetFilterList())
+  for (const StreamGraph::Node* node : filter_list)
   {
-    std::string function_name = StringFromFormat("%s_init", ip.second->GetName().c_str());
+    std::string function_name = StringFromFormat("%s_init", node->GetName().c_str());
     llvm::Function* init_func = m_module->getFunction(function_name);
     if (!init_func)
       continue;
 
     builder.CreateCall(init_func);
   }
+  builder.CreateBr(current_bb);
 
-  llvm::BasicBlock* start_loop_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "", func);
-  llvm::BasicBlock* main_loop_bb = start_loop_bb;
-  builder.CreateBr(main_loop_bb);
-
-  // Get a list of iterations that have to be tested against.
-  std::vector<u32> iteration_numbers;
-  for (auto ip : lv.GetFilterList())
+  // The init schedule is known at compile time, so each node's firings are a straight-line call or counted loop.
+  // Each node appears once, so its firings start from the first.
+  for (const StreamGraph::SchedulePhase& phase : schedule)
   {
-    if (std::find(iteration_numbers.begin(), iteration_numbers.end(), ip.first) == iteration_numbers.end())
-      iteration_numbers.push_back(ip.first);
+    current_bb = GenerateNodeFirings(func, entry_bb, current_bb, phase.node, phase.firings, 0, true);
+    if (!current_bb)
+      return false;
   }
 
-  for (u32 current_iteration : iteration_numbers)
-  {
-    llvm::BasicBlock* run_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "", func);
-    llvm::BasicBlock* next_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "", func);
+  // reset_channels_init()
+  builder.SetInsertPoint(current_bb);
+  if (m_options.static_buffers)
+    builder.CreateCall(GetChannelResetFunction(true));
+  builder.CreateRetVoid();
+  return true;
+}
 
-    builder.SetInsertPoint(main_loop_bb);
-    llvm::Value* iteration = builder.CreateLoad(iteration_var, "iteration");
-    if (main_loop_bb == start_loop_bb)
-      BuildDebugPrintf(m_context, builder, "prime iteration %d", {iteration});
+bool ProgramBuilder::GenerateSteadyStateFunction(StreamGraph::StreamGraph* streamgraph)
+{
+  const StreamGraph::NodeList& filter_list = streamgraph->GetFlatGraph()->GetFilterList(false);
 
-    // if (iteration > #iteration#)
-    llvm::Value* comp_res = builder.CreateICmpUGE(iteration, builder.getInt32(current_iteration));
-    builder.CreateCondBr(comp_res, run_bb, next_bb);
+  Log_InfoPrintf("Generating steady state function for %u filter instances...", unsigned(filter_list.size()));
 
-    // Generate calls to work functions for all filters with a matching iteration
-    for (auto ip2 : lv.GetFilterList())
-    {
-      if (ip2.first != current_iteration)
-        continue;
+  llvm::Constant* func_cons = m_module->getOrInsertFunction(StringFromFormat("%s_steady_state", m_module_name.c_str()),
+                                                            m_context->GetVoidType(), nullptr);
+  if (!func_cons)
+    return false;
+  llvm::Function* func = llvm::cast<llvm::Function>(func_cons);
+  if (!func)
+    return false;
 
-      llvm::Constant* work_func = m_module->getOrInsertFunction(
-        StringFromFormat("%s_work", ip2.second->GetName().c_str()), m_context->GetVoidType(), nullptr);
-      if (!work_func)
-        return false;
+  func->setLinkage(llvm::GlobalValue::PrivateLinkage);
 
-      run_bb = GenerateFunctionCalls(func, entry_bb, run_bb, work_func, ip2.second->GetMultiplicity());
-    }
+  StreamGraph::Schedule schedule = BuildSteadyStateSchedule(streamgraph);
+  for (const StreamGraph::SchedulePhase& phase : schedule)
+    Log_DevPrintf("Steady state: %s (%u firings)", phase.node->GetName().c_str(), phase.firings);
 
-    builder.SetInsertPoint(run_bb);
-    builder.CreateBr(next_bb);
-    main_loop_bb = next_bb;
-  }
+  if (!GenerateSteadyStateLoop(func, schedule))
+    return false;
 
-  // if (iteration == #lastiteration#)
-  //    return
-  builder.SetInsertPoint(main_loop_bb);
-  llvm::Value* iteration = builder.CreateLoad(iteration_var, "iteration");
-  llvm::Value* comp_res =
-    builder.CreateICmpEQ(iteration, builder.getInt32(lv.GetFilterList().back().first), "comp_res");
-  llvm::BasicBlock* increment_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "", func);
-  llvm::BasicBlock* exit_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "", func);
-  builder.CreateCondBr(comp_res, exit_bb, increment_bb);
-  builder.SetInsertPoint(exit_bb);
-  builder.CreateRetVoid();
+  size_t num_instructions = 0;
+  for (const llvm::BasicBlock& bb : *func)
+    num_instructions += bb.size();
 
-  // iteration = iteration + 1
-  builder.SetInsertPoint(increment_bb);
-  iteration = builder.CreateLoad(iteration_var, "iteration");
-  iteration = builder.CreateAdd(iteration, builder.getInt32(1), "iteration");
-  builder.CreateStore(iteration, iteration_var);
-  builder.CreateBr(start_loop_bb);
+  Log_InfoPrintf("Steady state schedule is %s: %u call sites, %u instructions, %llu bytes of channel buffers",
+                 GetScheduleStrategyName(m_options.schedule_strategy), unsigned(schedule.size()),
+                 unsigned(num_instructions), static_cast<unsigned long long>(GetBufferFootprint(streamgraph)));
   return true;
 }
 
-bool ProgramBuilder::GenerateSteadyStateFunction(StreamGraph::StreamGraph* streamgraph)
+bool ProgramBuilder::GenerateThreadedSteadyStateFunction(StreamGraph::StreamGraph* streamgraph)
 {
-  FilterListVisitor lv;
-  if (!streamgraph->GetRootNode()->Accept(&lv))
-    return false;
+  const StreamGraph::NodeList& filter_list = streamgraph->GetFlatGraph()->GetFilterList(true);
+
+  // Estimate the cost of each node by the number of tokens it moves per steady state, and split the list into
+  // contiguous ranges of roughly equal cost. The list is in topological order, so each thread only feeds threads
+  // after it, and the threads can't deadlock on each other.
+  std::vector<u64> costs;
+  u64 total_cost = 0;
+  for (const StreamGraph::Node* node : filter_list)
+  {
+    u64 cost = u64(node->GetMultiplicity()) *
+               (1 + u64(std::max(node->GetPeekRate(), node->GetPopRate())) + u64(node->GetPushRate()));
+    costs.push_back(cost);
+    total_cost += cost;
+  }
 
-  Log_InfoPrintf("Generating steady state function for %u filter instances...", unsigned(lv.GetFilterList().size()));
+  const u64 num_threads = m_options.num_threads;
+  std::vector<std::vector<StreamGraph::Node*>> partitions(num_threads);
+  u64 running_cost = 0;
+  for (size_t i = 0; i < costs.size(); i++)
+  {
+    // Assign based on the midpoint of the node, so a heavy node doesn't drag its neighbours along with it.
+    u64 midpoint = running_cost + costs[i] / 2;
+    u64 partition = std::min(midpoint * num_threads / std::max(total_cost, u64(1)), num_threads - 1);
+    partitions[partition].push_back(filter_list[i]);
+    running_cost += costs[i];
+  }
+  partitions.erase(std::remove_if(partitions.begin(), partitions.end(),
+                                  [](const std::vector<StreamGraph::Node*>& p) { return p.empty(); }),
+                   partitions.end());
+
+  Log_InfoPrintf("Generating steady state function for %u filter instances across %u threads...",
+                 unsigned(filter_list.size()), unsigned(partitions.size()));
+
+  // Generate one steady state loop per thread.
+  llvm::FunctionType* thread_func_ty =
+    llvm::FunctionType::get(m_context->GetVoidType(), {m_context->GetPointerType()}, false);
+  std::vector<llvm::Constant*> thread_funcs;
+  for (size_t i = 0; i < partitions.size(); i++)
+  {
+    for (StreamGraph::Node* node : partitions[i])
+      Log_InfoPrintf("Thread %u: %s (%u multiplicity)", unsigned(i), node->GetName().c_str(), node->GetMultiplicity());
+
+    llvm::Constant* func_cons = m_module->getOrInsertFunction(
+      StringFromFormat("%s_steady_state_thread%u", m_module_name.c_str(), unsigned(i)), thread_func_ty);
+    if (!func_cons)
+      return false;
+    llvm::Function* func = llvm::cast<llvm::Function>(func_cons);
+    if (!func)
+      return false;
+
+    func->setLinkage(llvm::GlobalValue::PrivateLinkage);
+
+    StreamGraph::Schedule schedule;
+    for (StreamGraph::Node* node : partitions[i])
+      schedule.push_back({node, node->GetMultiplicity()});
+    if (!GenerateSteadyStateLoop(func, schedule))
+      return false;
+
+    thread_funcs.push_back(func);
+  }
+
+  // Table of thread entry points, handed off to the runtime.
+  llvm::PointerType* thread_func_ptr_ty = thread_func_ty->getPointerTo();
+  llvm::ArrayType* thread_func_array_ty = llvm::ArrayType::get(thread_func_ptr_ty, thread_funcs.size());
+  llvm::GlobalVariable* thread_func_array_var =
+    new llvm::GlobalVariable(*m_module, thread_func_array_ty, true, llvm::GlobalValue::PrivateLinkage,
+                             llvm::ConstantArray::get(thread_func_array_ty, thread_funcs),
+                             StringFromFormat("%s_steady_state_threads", m_module_name.c_str()));
+
+  llvm::Constant* run_threads_func =
+    m_module->getOrInsertFunction("streamit_run_threads", m_context->GetVoidType(), thread_func_ptr_ty->getPointerTo(),
+                                  m_context->GetPointerType(), m_context->GetIntType(), nullptr);
+  if (!run_threads_func)
+    return false;
 
   llvm::Constant* func_cons = m_module->getOrInsertFunction(StringFromFormat("%s_steady_state", m_module_name.c_str()),
                                                             m_context->GetVoidType(), nullptr);
@@ -362,65 +778,556 @@ bool ProgramBuilder::GenerateSteadyStateFunction(StreamGraph::StreamGraph* strea
 
   func->setLinkage(llvm::GlobalValue::PrivateLinkage);
 
+  // streamit_run_threads(threads, nullptr, num_threads)
+  // This returns once the last thread has finished its final steady state.
+  llvm::BasicBlock* entry_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "entry", func);
+  llvm::IRBuilder<> builder(entry_bb);
+  llvm::Value* thread_funcs_ptr =
+    builder.CreateInBoundsGEP(thread_func_array_var, {builder.getInt32(0), builder.getInt32(0)}, "thread_funcs_ptr");
+  llvm::Value* param = llvm::ConstantPointerNull::get(llvm::cast<llvm::PointerType>(m_context->GetPointerType()));
+  builder.CreateCall(run_threads_func, {thread_funcs_ptr, param, builder.getInt32(u32(thread_funcs.size()))});
+  builder.CreateRetVoid();
+  return true;
+}
+
+static bool IsBuiltinFilter(const StreamGraph::Node* node, const char* name)
+{
+  const StreamGraph::Filter* filter = dynamic_cast<const StreamGraph::Filter*>(node);
+  const StreamGraph::FilterPermutation* perm = filter ? filter->GetFilterPermutation() : nullptr;
+  return (perm && perm->IsBuiltin() &&
+          perm->GetFilterDeclaration()->GetName().compare(0, std::strlen(name), name) == 0);
+}
+
+// The InputReader is the only filter which can run out of input.
+static bool IsInputReader(const StreamGraph::Node* node)
+{
+  return IsBuiltinFilter(node, "InputReader");
+}
+
+bool ProgramBuilder::GenerateSteadyStateLoop(llvm::Function* func, const StreamGraph::Schedule& schedule)
+{
+  llvm::Type* iteration_type = llvm::Type::getInt64Ty(m_context->GetLLVMContext());
+  llvm::Constant* end_steady_state_func = m_module->getOrInsertFunction(
+    "streamit_end_steady_state", m_context->GetIntType(), iteration_type, m_context->GetIntType(), nullptr);
+  if (!end_steady_state_func)
+    return false;
+
+  // u64 iteration = 0
   llvm::BasicBlock* entry_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "entry", func);
   llvm::BasicBlock* start_loop_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "", func);
   llvm::IRBuilder<> builder(entry_bb);
+  llvm::AllocaInst* iteration_var = builder.CreateAlloca(iteration_type, nullptr, "iteration");
+  builder.CreateStore(builder.getInt64(0), iteration_var);
   builder.CreateBr(start_loop_bb);
 
+  // Nodes can appear in several phases, which continue from the firings of the phases before.
   llvm::BasicBlock* main_loop_bb = start_loop_bb;
-  for (auto ip : lv.GetFilterList())
+  std::unordered_map<const StreamGraph::Node*, u32> node_firings;
+  for (const StreamGraph::SchedulePhase& phase : schedule)
   {
-    // Call each filter multiplicity times.
-    llvm::Constant* work_func = m_module->getOrInsertFunction(StringFromFormat("%s_work", ip.second->GetName().c_str()),
-                                                              m_context->GetVoidType(), nullptr);
-    if (!work_func)
+    u32& first_firing = node_firings[phase.node];
+    main_loop_bb = GenerateNodeFirings(func, entry_bb, main_loop_bb, phase.node, phase.firings, first_firing, false);
+    if (!main_loop_bb)
       return false;
-    main_loop_bb = GenerateFunctionCalls(func, entry_bb, main_loop_bb, work_func, ip.second->GetMultiplicity());
+
+    first_firing += phase.firings;
   }
 
-  // Loop back to start infinitely.
+  // Reset static buffers at the steady state boundary, then loop back to start until the runtime says to stop,
+  // either at the iteration limit, or after the steady state which read the end of the input.
+  // iteration = iteration + 1
+  // if (streamit_end_steady_state(iteration, reads_input))
+  //   return
   builder.SetInsertPoint(main_loop_bb);
-  builder.CreateBr(start_loop_bb);
+  if (m_options.static_buffers)
+    builder.CreateCall(GetChannelResetFunction(false));
+  llvm::Value* iteration = builder.CreateAdd(builder.CreateLoad(iteration_var), builder.getInt64(1), "iteration");
+  builder.CreateStore(iteration, iteration_var);
+  bool reads_input = std::any_of(schedule.begin(), schedule.end(),
+                                 [](const StreamGraph::SchedulePhase& phase) { return IsInputReader(phase.node); });
+  llvm::Value* stop = builder.CreateCall(end_steady_state_func, {iteration, builder.getInt32(reads_input ? 1 : 0)});
+  llvm::BasicBlock* exit_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "", func);
+  builder.CreateCondBr(builder.CreateICmpNE(stop, builder.getInt32(0)), exit_bb, start_loop_bb);
+  builder.SetInsertPoint(exit_bb);
+  builder.CreateRetVoid();
   return true;
 }
 
-bool ProgramBuilder::GenerateMainFunction()
+llvm::Constant* ProgramBuilder::GetChannelResetFunction(bool init)
+{
+  return m_module->getOrInsertFunction(
+    StringFromFormat(init ? "%s_reset_channels_init" : "%s_reset_channels", m_module_name.c_str()),
+    m_context->GetVoidType(), nullptr);
+}
+
+bool ProgramBuilder::GenerateMainFunction(StreamGraph::StreamGraph* streamgraph)
 {
   Log_InfoPrintf("Generating main function...");
 
-  llvm::Constant* prime_pump_func = m_module->getOrInsertFunction(
-    StringFromFormat("%s_prime_pump", m_module_name.c_str()), m_context->GetVoidType(), nullptr);
-  llvm::Constant* steady_state_func = m_module->getOrInsertFunction(
-    StringFromFormat("%s_steady_state", m_module_name.c_str()), m_context->GetVoidType(), nullptr);
+  // These take the instance as a parameter when it has been moved out of the globals.
+  llvm::Function* prime_pump_func = m_module->getFunction(StringFromFormat("%s_prime_pump", m_module_name.c_str()));
+  llvm::Function* steady_state_func =
+    m_module->getFunction(StringFromFormat("%s_steady_state", m_module_name.c_str()));
   if (!prime_pump_func || !steady_state_func)
     return false;
 
-  llvm::Constant* func_cons = m_module->getOrInsertFunction("main", m_context->GetIntType(), nullptr);
+  llvm::Type* argv_type = m_context->GetPointerType()->getPointerTo();
+  llvm::Constant* parse_args_func = m_module->getOrInsertFunction("streamit_parse_args", m_context->GetVoidType(),
+                                                                  m_context->GetIntType(), argv_type, nullptr);
+  llvm::Constant* close_files_func =
+    m_module->getOrInsertFunction("streamit_close_files", m_context->GetVoidType(), nullptr);
+  if (!parse_args_func || !close_files_func)
+    return false;
+
+  llvm::Constant* func_cons = m_module->getOrInsertFunction("main", m_context->GetIntType(), m_context->GetIntType(),
+                                                            argv_type, nullptr);
   if (!func_cons)
     return false;
   llvm::Function* func = llvm::cast<llvm::Function>(func_cons);
   if (!func)
     return false;
 
+  auto func_args_iter = func->arg_begin();
+  llvm::Value* argc = &(*func_args_iter++);
+  llvm::Value* argv = &(*func_args_iter++);
+  argc->setName("argc");
+  argv->setName("argv");
+
+  // streamit_parse_args(argc, argv)
+  // prime_pump()
+  // steady_state()
+  // streamit_close_files()
+  // return 0
   llvm::BasicBlock* entry_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "entry", func);
   llvm::IRBuilder<> builder(entry_bb);
   BuildDebugPrint(m_context, builder, "Entering main");
+  builder.CreateCall(parse_args_func, {argc, argv});
+  if (!m_instance_type)
+  {
+    builder.CreateCall(prime_pump_func);
+    builder.CreateCall(steady_state_func);
+    if (m_options.profile && !GenerateProfileReport(builder.GetInsertBlock()))
+      return false;
+    if (m_options.channel_stats && !GenerateChannelStatsReport(builder.GetInsertBlock(), streamgraph))
+      return false;
+    builder.CreateCall(close_files_func);
+    builder.CreateRet(builder.getInt32(0));
+    return true;
+  }
+
+  // With instance state, the program runs a single instance.
+  // instance = create()
+  // if (!instance)
+  //   return 1
+  // prime_pump(instance)
+  // steady_state(instance)
+  // destroy(instance)
+  // streamit_close_files()
+  // return 0
+  llvm::Function* create_func = m_module->getFunction(StringFromFormat("%s_create", m_module_name.c_str()));
+  llvm::Function* destroy_func = m_module->getFunction(StringFromFormat("%s_destroy", m_module_name.c_str()));
+  if (!create_func || !destroy_func)
+    return false;
+
+  llvm::BasicBlock* run_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "run", func);
+  llvm::BasicBlock* fail_bb = llvm::BasicBlock::Create(m_context->GetLLVMContext(), "fail", func);
+  llvm::Value* instance = builder.CreateCall(create_func, {}, "instance");
+  builder.CreateCondBr(builder.CreateIsNotNull(instance), run_bb, fail_bb);
+  builder.SetInsertPoint(fail_bb);
+  builder.CreateRet(builder.getInt32(1));
+  builder.SetInsertPoint(run_bb);
+  builder.CreateCall(prime_pump_func, {instance});
+  builder.CreateCall(steady_state_func, {instance});
+  builder.CreateCall(destroy_func, {instance});
+  builder.CreateCall(close_files_func);
+  builder.CreateRet(builder.getInt32(0));
+  return true;
+}
+
+// Bytes the builtins pass to the runtime per token.
+static u32 GetIOItemSize(llvm::Type* type)
+{
+  return (type->getPrimitiveSizeInBits() + 7) / 8;
+}
+
+bool ProgramBuilder::GetLibraryIOSizes(StreamGraph::StreamGraph* streamgraph, LibraryIOSizes* sizes) const
+{
+  const StreamGraph::NodeList& filter_list = streamgraph->GetFlatGraph()->GetFilterList(false);
+
+  auto add_schedule = [sizes](const StreamGraph::Schedule& schedule, u64* input, u64* output) {
+    for (const StreamGraph::SchedulePhase& phase : schedule)
+    {
+      if (IsInputReader(phase.node))
+      {
+        sizes->input_item = GetIOItemSize(phase.node->GetOutputType());
+        *input += u64(phase.firings) * phase.node->GetPushRate() * sizes->input_item;
+      }
+      else if (IsBuiltinFilter(phase.node, "OutputWriter"))
+      {
+        sizes->output_item = GetIOItemSize(phase.node->GetInputType());
+        *output += u64(phase.firings) * phase.node->GetPopRate() * sizes->output_item;
+      }
+    }
+  };
+
+  *sizes = {};
+  add_schedule(StreamGraph::BuildInitSchedule(filter_list), &sizes->prime_pump_input,
+               &sizes->prime_pump_output);
+  add_schedule(StreamGraph::BuildSteadyStateSchedule(filter_list), &sizes->steady_state_input,
+               &sizes->steady_state_output);
+  return true;
+}
+
+bool ProgramBuilder::GenerateLibraryProcessFunction(StreamGraph::StreamGraph* streamgraph)
+{
+  Log_InfoPrintf("Generating library functions...");
+
+  LibraryIOSizes sizes;
+  if (!GetLibraryIOSizes(streamgraph, &sizes))
+    return false;
+
+  // Without either, nothing would bound the number of steady states run by process.
+  if (sizes.steady_state_input == 0 && sizes.steady_state_output == 0)
+  {
+    Log_ErrorPrintf("Libraries need an InputReader or OutputWriter which moves tokens every steady state");
+    return false;
+  }
+
+  llvm::LLVMContext& ctx = m_context->GetLLVMContext();
+  llvm::Type* size_type = m_module->getDataLayout().getIntPtrType(ctx);
+  llvm::Type* ptr_type = m_context->GetPointerType();
+  llvm::Constant* prime_pump_func = m_module->getOrInsertFunction(
+    StringFromFormat("%s_prime_pump", m_module_name.c_str()), m_context->GetVoidType(), nullptr);
+  llvm::Constant* steady_state_func = m_module->getOrInsertFunction(
+    StringFromFormat("%s_steady_state", m_module_name.c_str()), m_context->GetVoidType(), nullptr);
+  llvm::Constant* begin_func =
+    m_module->getOrInsertFunction("streamit_begin_buffer_io", m_context->GetVoidType(), ptr_type, size_type, ptr_type,
+                                  size_type, size_type, size_type, nullptr);
+  llvm::Constant* fits_func = m_module->getOrInsertFunction("streamit_buffer_io_fits", m_context->GetIntType(),
+                                                            size_type, size_type, nullptr);
+  llvm::Constant* end_func = m_module->getOrInsertFunction("streamit_end_buffer_io", size_type,
+                                                           size_type->getPointerTo(), nullptr);
+  llvm::Function* func = llvm::cast<llvm::Function>(
+    m_module->getOrInsertFunction(StringFromFormat("%s_process", m_module_name.c_str()), size_type, ptr_type,
+                                  size_type, ptr_type, size_type->getPointerTo(), nullptr));
+  if (!prime_pump_func || !steady_state_func || !begin_func || !fits_func || !end_func || !func)
+    return false;
+
+  // The prime pump runs on the first call with enough input, and again after a reset.
+  llvm::GlobalVariable* primed_var =
+    new llvm::GlobalVariable(*m_module, llvm::Type::getInt1Ty(ctx), false, llvm::GlobalValue::PrivateLinkage,
+                             llvm::ConstantInt::getFalse(ctx), StringFromFormat("%s_primed", m_module_name.c_str()));
+
+  auto func_args_iter = func->arg_begin();
+  llvm::Value* in = &(*func_args_iter++);
+  llvm::Value* n_in = &(*func_args_iter++);
+  llvm::Value* out = &(*func_args_iter++);
+  llvm::Value* n_out = &(*func_args_iter++);
+  in->setName("in");
+  n_in->setName("n_in");
+  out->setName("out");
+  n_out->setName("n_out");
+
+  // streamit_begin_buffer_io(in, n_in, out, *n_out, #steady_state_input#, #steady_state_output#)
+  // if (!primed)
+  // {
+  //   if (!streamit_buffer_io_fits(#prime_pump_input#, #prime_pump_output#))
+  //     goto done;
+  //   prime_pump()
+  //   primed = true
+  // }
+  // if (streamit_buffer_io_fits(#steady_state_input#, #steady_state_output#))
+  //   steady_state()
+  // done:
+  // return streamit_end_buffer_io(n_out)
+  llvm::BasicBlock* entry_bb = llvm::BasicBlock::Create(ctx, "entry", func);
+  llvm::BasicBlock* check_prime_bb = llvm::BasicBlock::Create(ctx, "check_prime", func);
+  llvm::BasicBlock* prime_bb = llvm::BasicBlock::Create(ctx, "prime", func);
+  llvm::BasicBlock* check_steady_bb = llvm::BasicBlock::Create(ctx, "check_steady", func);
+  llvm::BasicBlock* steady_bb = llvm::BasicBlock::Create(ctx, "steady", func);
+  llvm::BasicBlock* done_bb = llvm::BasicBlock::Create(ctx, "done", func);
+  llvm::IRBuilder<> builder(entry_bb);
+  auto size_constant = [size_type](u64 value) { return llvm::ConstantInt::get(size_type, value); };
+  builder.CreateCall(begin_func, {in, n_in, out, builder.CreateLoad(n_out), size_constant(sizes.steady_state_input),
+                                  size_constant(sizes.steady_state_output)});
+  builder.CreateCondBr(builder.CreateLoad(primed_var), check_steady_bb, check_prime_bb);
+
+  builder.SetInsertPoint(check_prime_bb);
+  llvm::Value* prime_fits = builder.CreateCall(
+    fits_func, {size_constant(sizes.prime_pump_input), size_constant(sizes.prime_pump_output)});
+  builder.CreateCondBr(builder.CreateICmpNE(prime_fits, builder.getInt32(0)), prime_bb, done_bb);
+  builder.SetInsertPoint(prime_bb);
   builder.CreateCall(prime_pump_func);
+  builder.CreateStore(builder.getTrue(), primed_var);
+  builder.CreateBr(check_steady_bb);
+
+  builder.SetInsertPoint(check_steady_bb);
+  llvm::Value* steady_fits = builder.CreateCall(
+    fits_func, {size_constant(sizes.steady_state_input), size_constant(sizes.steady_state_output)});
+  builder.CreateCondBr(builder.CreateICmpNE(steady_fits, builder.getInt32(0)), steady_bb, done_bb);
+  builder.SetInsertPoint(steady_bb);
   builder.CreateCall(steady_state_func);
-  builder.CreateRet(builder.getInt32(0));
+  builder.CreateBr(done_bb);
+
+  builder.SetInsertPoint(done_bb);
+  builder.CreateRet(builder.CreateCall(end_func, {n_out}));
   return true;
 }
 
+bool ProgramBuilder::GenerateLibraryInitFunction()
+{
+  // init()
+  // {
+  //   reset()
+  // }
+  llvm::Function* func = llvm::cast<llvm::Function>(m_module->getOrInsertFunction(
+    StringFromFormat("%s_init", m_module_name.c_str()), m_context->GetVoidType(), nullptr));
+  llvm::Function* reset_func = m_module->getFunction(StringFromFormat("%s_reset", m_module_name.c_str()));
+  if (!func || !reset_func)
+    return false;
+
+  llvm::IRBuilder<> builder(llvm::BasicBlock::Create(m_context->GetLLVMContext(), "entry", func));
+  builder.CreateCall(reset_func);
+  builder.CreateRetVoid();
+  return true;
+}
+
+bool ProgramBuilder::GenerateResetFunction()
+{
+  llvm::Function* func = llvm::cast<llvm::Function>(m_module->getOrInsertFunction(
+    StringFromFormat("%s_reset", m_module_name.c_str()), m_context->GetVoidType(), nullptr));
+  if (!func)
+    return false;
+
+  // Only part of the API when building a library, otherwise it is used to initialize new instances.
+  if (!m_options.library)
+    func->setLinkage(llvm::GlobalValue::PrivateLinkage);
+
+  // Channel buffers are zero-initialized and can be large, so they are cleared with a memset. The size is left as a
+  // constant expression, since the target's data layout is only set when the object file is written.
+  llvm::IRBuilder<> builder(llvm::BasicBlock::Create(m_context->GetLLVMContext(), "entry", func));
+  for (llvm::GlobalVariable& var : m_module->globals())
+  {
+    if (var.isConstant() || !var.hasInitializer())
+      continue;
+
+    llvm::Constant* initializer = var.getInitializer();
+    if (initializer->isNullValue() && !initializer->getType()->isSingleValueType())
+    {
+      builder.CreateMemSet(&var, builder.getInt8(0), llvm::ConstantExpr::getSizeOf(var.getValueType()), 1);
+    }
+    else
+    {
+      builder.CreateStore(initializer, &var);
+    }
+  }
+
+  builder.CreateRetVoid();
+  return true;
+}
+
+bool ProgramBuilder::GenerateInstanceFunctions()
+{
+  Log_InfoPrintf("Moving state to instances...");
+
+  m_instance_type = BuildInstanceState(m_module, m_module_name);
+  if (!m_instance_type)
+    return false;
+
+  llvm::LLVMContext& ctx = m_context->GetLLVMContext();
+  llvm::Type* size_type = m_module->getDataLayout().getIntPtrType(ctx);
+  llvm::Type* instance_ptr_type = m_instance_type->getPointerTo();
+  llvm::Constant* alloc_func = m_module->getOrInsertFunction("streamit_alloc_instance", m_context->GetPointerType(),
+                                                             size_type, size_type, nullptr);
+  llvm::Constant* free_func = m_module->getOrInsertFunction("streamit_free_instance", m_context->GetVoidType(),
+                                                            m_context->GetPointerType(), nullptr);
+  llvm::Function* reset_func = m_module->getFunction(StringFromFormat("%s_reset", m_module_name.c_str()));
+  llvm::Function* create_func = llvm::cast<llvm::Function>(m_module->getOrInsertFunction(
+    StringFromFormat("%s_create", m_module_name.c_str()), instance_ptr_type, nullptr));
+  llvm::Function* destroy_func = llvm::cast<llvm::Function>(m_module->getOrInsertFunction(
+    StringFromFormat("%s_destroy", m_module_name.c_str()), m_context->GetVoidType(), instance_ptr_type, nullptr));
+  if (!alloc_func || !free_func || !reset_func || !create_func || !destroy_func)
+    return false;
+
+  if (!m_options.library)
+  {
+    create_func->setLinkage(llvm::GlobalValue::PrivateLinkage);
+    destroy_func->setLinkage(llvm::GlobalValue::PrivateLinkage);
+  }
+
+  // The size and alignment are left as constant expressions, since the target's data layout is only set when the
+  // object file is written.
+  // instance = streamit_alloc_instance(sizeof(instance), alignof(instance))
+  // if (instance)
+  //   reset(instance)
+  // return instance
+  llvm::BasicBlock* entry_bb = llvm::BasicBlock::Create(ctx, "entry", create_func);
+  llvm::BasicBlock* reset_bb = llvm::BasicBlock::Create(ctx, "reset", create_func);
+  llvm::BasicBlock* exit_bb = llvm::BasicBlock::Create(ctx, "exit", create_func);
+  llvm::IRBuilder<> builder(entry_bb);
+  llvm::Constant* size = llvm::ConstantExpr::getSizeOf(m_instance_type);
+  llvm::Constant* alignment = llvm::ConstantExpr::getAlignOf(m_instance_type);
+  llvm::Value* raw_ptr =
+    builder.CreateCall(alloc_func, {llvm::ConstantExpr::getIntegerCast(size, size_type, false),
+                                    llvm::ConstantExpr::getIntegerCast(alignment, size_type, false)});
+  llvm::Value* instance = builder.CreateBitCast(raw_ptr, instance_ptr_type, "instance");
+  builder.CreateCondBr(builder.CreateIsNotNull(instance), reset_bb, exit_bb);
+  builder.SetInsertPoint(reset_bb);
+  builder.CreateCall(reset_func, {instance});
+  builder.CreateBr(exit_bb);
+  builder.SetInsertPoint(exit_bb);
+  builder.CreateRet(instance);
+
+  // streamit_free_instance(instance)
+  llvm::Value* destroy_instance = &(*destroy_func->arg_begin());
+  destroy_instance->setName("instance");
+  builder.SetInsertPoint(llvm::BasicBlock::Create(ctx, "entry", destroy_func));
+  builder.CreateCall(free_func, {builder.CreateBitCast(destroy_instance, m_context->GetPointerType())});
+  builder.CreateRetVoid();
+  return true;
+}
+
+std::string ProgramBuilder::GetLibraryHeader(StreamGraph::StreamGraph* streamgraph) const
+{
+  LibraryIOSizes sizes;
+  if (!m_options.library || !GetLibraryIOSizes(streamgraph, &sizes))
+    return {};
+
+  std::string prefix = m_module_name;
+  std::string macro_prefix;
+  for (char ch : m_module_name)
+    macro_prefix += char(std::toupper(static_cast<unsigned char>(ch)));
+
+  const char* name = prefix.c_str();
+  const char* macro = macro_prefix.c_str();
+  std::string header;
+  header += StringFromFormat("/* Generated from the StreamIt program %s. */\n", name);
+  header += "#pragma once\n#include <stddef.h>\n\n";
+  header += "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n";
+  header += "/* Size of one input and output token, in bytes. */\n";
+  header += StringFromFormat("#define %s_INPUT_ITEM_SIZE %u\n", macro, sizes.input_item);
+  header += StringFromFormat("#define %s_OUTPUT_ITEM_SIZE %u\n\n", macro, sizes.output_item);
+  header += "/* Bytes of input consumed and output produced by the prime pump, which runs on the first call to\n";
+  header += "   process after starting or a reset, and by each steady state after it. */\n";
+  header += StringFromFormat("#define %s_PRIME_PUMP_INPUT_SIZE %llu\n", macro,
+                             static_cast<unsigned long long>(sizes.prime_pump_input));
+  header += StringFromFormat("#define %s_PRIME_PUMP_OUTPUT_SIZE %llu\n", macro,
+                             static_cast<unsigned long long>(sizes.prime_pump_output));
+  header += StringFromFormat("#define %s_STEADY_STATE_INPUT_SIZE %llu\n", macro,
+                             static_cast<unsigned long long>(sizes.steady_state_input));
+  header += StringFromFormat("#define %s_STEADY_STATE_OUTPUT_SIZE %llu\n\n", macro,
+                             static_cast<unsigned long long>(sizes.steady_state_output));
+
+  // With instance state, every function takes the instance to run, and init is replaced by create and destroy.
+  std::string instance_param = m_options.instance_state ? StringFromFormat("%s_instance* instance", name) : "void";
+  std::string process_params = "const void* in, size_t n_in, void* out, size_t* n_out";
+  if (m_options.instance_state)
+  {
+    process_params = instance_param + ", " + process_params;
+    header += StringFromFormat("typedef struct %s_instance %s_instance;\n\n", name, name);
+    header += "/* Allocates an instance, ready for its first call to process. Instances are independent, so\n";
+    header += "   different instances can be used on different threads at once. Returns NULL when out of memory. */\n";
+    header += StringFromFormat("%s_instance* %s_create(void);\n\n", name, name);
+    header += "/* Frees an instance returned by create. */\n";
+    header += StringFromFormat("void %s_destroy(%s);\n\n", name, instance_param.c_str());
+  }
+  else
+  {
+    header += "/* Prepares the program. Must be called before the first call to process. */\n";
+    header += StringFromFormat("void %s_init(void);\n\n", name);
+  }
+
+  header += "/* Runs as many steady states as fit in the buffers, reading from and writing to them in place.\n";
+  header += "   n_in is the bytes available at in. *n_out is the capacity of out on entry, and the bytes written on\n";
+  header += "   return. Returns the bytes of input consumed, the rest must be passed again on the next call. */\n";
+  header += StringFromFormat("size_t %s_process(%s);\n\n", name, process_params.c_str());
+  header += "/* Returns the program to its initial state, discarding any tokens still in its channels. */\n";
+  header += StringFromFormat("void %s_reset(%s);\n\n", name, instance_param.c_str());
+  header += "#ifdef __cplusplus\n}\n#endif\n";
+  return header;
+}
+
+llvm::BasicBlock* ProgramBuilder::GenerateNodeFirings(llvm::Function* func, llvm::BasicBlock* entry_bb,
+                                                      llvm::BasicBlock* current_bb, StreamGraph::Node* node,
+                                                      u32 firings, u32 first_firing, bool init)
+{
+  // Vectorized filters, and the I/O builtins, run a whole steady state's firings in one call.
+  // Otherwise, or when the schedule splits them up, call the work function once per firing.
+  llvm::Constant* call_func = nullptr;
+  size_t count = 1;
+  if (firings == node->GetMultiplicity())
+  {
+    call_func = m_module->getFunction(StringFromFormat("%s_work_vector", node->GetName().c_str()));
+    if (!call_func)
+      call_func = m_module->getFunction(StringFromFormat("%s_work_bulk", node->GetName().c_str()));
+  }
+
+  // Filters with static channels are passed where each firing starts in their input and output channels.
+  const StreamGraph::Filter* filter = dynamic_cast<const StreamGraph::Filter*>(node);
+  if (!call_func && filter && ChannelBuilder::HasStaticChannels(m_options, filter))
+  {
+    call_func = m_module->getOrInsertFunction(StringFromFormat("%s_work", node->GetName().c_str()),
+                                              m_context->GetVoidType(), m_context->GetIntType(),
+                                              m_context->GetIntType(), nullptr);
+    if (!call_func)
+      return nullptr;
+
+    // Output goes after the tokens the init schedule left in the next filter's channel.
+    const StreamGraph::Filter* output_filter = ChannelBuilder::GetStaticOutputFilter(m_options, filter);
+    u32 output_base = (output_filter && !init) ? m_buffer_sizes->GetInitResidue(output_filter) : 0;
+    auto get_args = [&](u32 firing) -> std::vector<CallArg> {
+      return {{GetStaticChannelPosition(filter, firing, init, true), filter->GetPopRate()},
+              {output_base + GetStaticChannelPosition(filter, firing, init, false), filter->GetPushRate()}};
+    };
+
+    // Prework has its own rates, so the firings after it are a separate loop.
+    const StreamGraph::FilterPermutation* perm = filter->GetFilterPermutation();
+    if (init && first_firing == 0 && firings > 1 && perm->HasPrework())
+    {
+      current_bb = m_options.profile ?
+                     GenerateProfiledFunctionCalls(func, entry_bb, current_bb, node, call_func, 1, 1, get_args(0)) :
+                     GenerateFunctionCalls(func, entry_bb, current_bb, call_func, 1, get_args(0));
+      first_firing++;
+      firings--;
+    }
+
+    if (m_options.profile)
+    {
+      return GenerateProfiledFunctionCalls(func, entry_bb, current_bb, node, call_func, firings, firings,
+                                           get_args(first_firing));
+    }
+
+    return GenerateFunctionCalls(func, entry_bb, current_bb, call_func, firings, get_args(first_firing));
+  }
+
+  if (!call_func)
+  {
+    call_func = m_module->getOrInsertFunction(StringFromFormat("%s_work", node->GetName().c_str()),
+                                              m_context->GetVoidType(), nullptr);
+    count = firings;
+    if (!call_func)
+      return nullptr;
+  }
+
+  if (m_options.profile)
+    return GenerateProfiledFunctionCalls(func, entry_bb, current_bb, node, call_func, count, firings);
+
+  return GenerateFunctionCalls(func, entry_bb, current_bb, call_func, count);
+}
+
 llvm::BasicBlock* ProgramBuilder::GenerateFunctionCalls(llvm::Function* func, llvm::BasicBlock* entry_bb,
                                                         llvm::BasicBlock* current_bb, llvm::Constant* call_func,
-                                                        size_t count)
+                                                        size_t count, const std::vector<CallArg>& args)
 {
   llvm::IRBuilder<> builder(current_bb);
 
   // Don't generate a loop when there is only a single multiplicity filter.
   if (count == 1)
   {
-    builder.CreateCall(call_func);
+    std::vector<llvm::Value*> arg_values;
+    for (const CallArg& arg : args)
+      arg_values.push_back(builder.getInt32(arg.start));
+    builder.CreateCall(call_func, arg_values);
     return current_bb;
   }
 
@@ -442,9 +1349,16 @@ llvm::BasicBlock* ProgramBuilder::GenerateFunctionCalls(llvm::Function* func, ll
   llvm::Value* comp_res = builder.CreateICmpULT(i, builder.getInt32(count), "i_comp");
   builder.CreateCondBr(comp_res, body_bb, exit_bb);
 
-  // func()
+  // func(#start# + i * #stride#, ...)
   builder.SetInsertPoint(body_bb);
-  builder.CreateCall(call_func);
+  i = builder.CreateLoad(i_var, "i");
+  std::vector<llvm::Value*> arg_values;
+  for (const CallArg& arg : args)
+  {
+    llvm::Value* offset = builder.CreateMul(i, builder.getInt32(arg.stride));
+    arg_values.push_back(builder.CreateAdd(builder.getInt32(arg.start), offset, "arg"));
+  }
+  builder.CreateCall(call_func, arg_values);
 
   // i = i + 1
   i = builder.CreateLoad(i_var, "i");
@@ -458,4 +1372,120 @@ llvm::BasicBlock* ProgramBuilder::GenerateFunctionCalls(llvm::Function* func, ll
   return exit_bb;
 }
 
+llvm::BasicBlock* ProgramBuilder::GenerateProfiledFunctionCalls(llvm::Function* func, llvm::BasicBlock* entry_bb,
+                                                                llvm::BasicBlock* current_bb, StreamGraph::Node* node,
+                                                                llvm::Constant* call_func, size_t count,
+                                                                u32 firings, const std::vector<CallArg>& args)
+{
+  llvm::GlobalVariable* counters_var = GetProfileCounters(node);
+  llvm::Type* counters_type = counters_var->getValueType();
+  llvm::Function* cycle_counter_func = llvm::Intrinsic::getDeclaration(m_module, llvm::Intrinsic::readcyclecounter);
+
+  // The firings are timed together, so reading the counter doesn't dominate the cost of small work functions.
+  // start = readcyclecounter()
+  // <firings>
+  // counters[0] += readcyclecounter() - start
+  // counters[1] += #firings#
+  llvm::IRBuilder<> builder(current_bb);
+  llvm::Value* start = builder.CreateCall(cycle_counter_func, {}, "start_cycles");
+  llvm::BasicBlock* exit_bb = GenerateFunctionCalls(func, entry_bb, current_bb, call_func, count, args);
+  builder.SetInsertPoint(exit_bb);
+  llvm::Value* cycles = builder.CreateSub(builder.CreateCall(cycle_counter_func, {}), start, "cycles");
+  llvm::Value* cycles_ptr = builder.CreateConstInBoundsGEP2_32(counters_type, counters_var, 0, 0);
+  builder.CreateStore(builder.CreateAdd(builder.CreateLoad(cycles_ptr), cycles), cycles_ptr);
+
+  // The schedule's firings, not count, since vector and bulk functions run every firing in one call.
+  llvm::Value* firings_ptr = builder.CreateConstInBoundsGEP2_32(counters_type, counters_var, 0, 1);
+  builder.CreateStore(builder.CreateAdd(builder.CreateLoad(firings_ptr), builder.getInt64(firings)), firings_ptr);
+  return exit_bb;
+}
+
+llvm::GlobalVariable* ProgramBuilder::GetProfileCounters(const StreamGraph::Node* node)
+{
+  for (const auto& it : m_profile_counters)
+  {
+    if (it.first == node->GetName())
+      return it.second;
+  }
+
+  // u64 counters[2] = {cycles, firings}
+  // Each node gets its own cache line, since filters on different threads update theirs at the same time.
+  llvm::ArrayType* counters_type = llvm::ArrayType::get(llvm::Type::getInt64Ty(m_context->GetLLVMContext()), 2);
+  llvm::GlobalVariable* counters_var = new llvm::GlobalVariable(
+    *m_module, counters_type, false, llvm::GlobalValue::PrivateLinkage, llvm::ConstantAggregateZero::get(counters_type),
+    StringFromFormat("%s_profile", node->GetName().c_str()));
+  counters_var->setAlignment(64);
+  m_profile_counters.emplace_back(node->GetName(), counters_var);
+  return counters_var;
+}
+
+bool ProgramBuilder::GenerateProfileReport(llvm::BasicBlock* bb)
+{
+  return GenerateCounterReport(bb, m_profile_counters, "profile_entries", "streamit_write_profile");
+}
+
+bool ProgramBuilder::GenerateChannelStatsReport(llvm::BasicBlock* bb, StreamGraph::StreamGraph* streamgraph)
+{
+  const StreamGraph::NodeList& filter_list = streamgraph->GetFlatGraph()->GetFilterList(true);
+
+  // Filters have <name>_stats for their input channel, and joins <name>_<input>_stats for each input.
+  std::vector<std::pair<std::string, llvm::GlobalVariable*>> channels;
+  for (const StreamGraph::Node* node : filter_list)
+  {
+    const StreamGraph::Join* join = dynamic_cast<const StreamGraph::Join*>(node);
+    if (!join)
+    {
+      llvm::GlobalVariable* stats_var = m_module->getNamedGlobal(StringFromFormat("%s_stats", node->GetName().c_str()));
+      if (stats_var)
+        channels.emplace_back(node->GetName(), stats_var);
+      continue;
+    }
+
+    for (u32 input_index = 1; input_index <= join->GetIncomingStreams(); input_index++)
+    {
+      std::string input_name = StringFromFormat("%s_%u", node->GetName().c_str(), input_index);
+      llvm::GlobalVariable* stats_var = m_module->getNamedGlobal(StringFromFormat("%s_stats", input_name.c_str()));
+      if (stats_var)
+        channels.emplace_back(input_name, stats_var);
+    }
+  }
+
+  return GenerateCounterReport(bb, channels, "channel_stats_entries", "streamit_write_channel_stats");
+}
+
+bool ProgramBuilder::GenerateCounterReport(llvm::BasicBlock* bb,
+                                           const std::vector<std::pair<std::string, llvm::GlobalVariable*>>& counters,
+                                           const char* table_suffix, const char* func_name)
+{
+  // struct { const char* name; u64* counters; } entries[] = { ... }
+  llvm::IRBuilder<> builder(bb);
+  llvm::PointerType* counters_ptr_type = llvm::Type::getInt64PtrTy(m_context->GetLLVMContext());
+  llvm::StructType* entry_type =
+    llvm::StructType::get(m_context->GetLLVMContext(), {m_context->GetStringType(), counters_ptr_type});
+  std::vector<llvm::Constant*> entries;
+  for (const auto& it : counters)
+  {
+    llvm::Constant* name = llvm::cast<llvm::Constant>(builder.CreateGlobalStringPtr(it.first));
+    llvm::Constant* counters = llvm::ConstantExpr::getInBoundsGetElementPtr(
+      it.second->getValueType(), it.second, llvm::ArrayRef<llvm::Constant*>{builder.getInt32(0), builder.getInt32(0)});
+    entries.push_back(llvm::ConstantStruct::get(entry_type, {name, counters}));
+  }
+
+  llvm::ArrayType* entries_type = llvm::ArrayType::get(entry_type, entries.size());
+  llvm::GlobalVariable* entries_var =
+    new llvm::GlobalVariable(*m_module, entries_type, true, llvm::GlobalValue::PrivateLinkage,
+                             llvm::ConstantArray::get(entries_type, entries),
+                             StringFromFormat("%s_%s", m_module_name.c_str(), table_suffix));
+
+  llvm::Constant* write_func = m_module->getOrInsertFunction(
+    func_name, m_context->GetVoidType(), entry_type->getPointerTo(), m_context->GetIntType(), nullptr);
+  if (!write_func)
+    return false;
+
+  // func_name(entries, #num_entries#)
+  llvm::Value* entries_ptr = builder.CreateConstInBoundsGEP2_32(entries_type, entries_var, 0, 0, table_suffix);
+  builder.CreateCall(write_func, {entries_ptr, builder.getInt32(u32(entries.size()))});
+  return true;
+}
+
 } // namespace CPUTarget
@@ -1,13 +1,19 @@
 #pragma once
 #include <cstddef>
 #include <memory>
+#include <string>
+#include <vector>
+#include "cputarget/codegen_options.h"
 
 namespace llvm
 {
 class BasicBlock;
 class Constant;
 class Function;
+class GlobalVariable;
 class Module;
+class StructType;
+class TargetMachine;
 }
 
 namespace Frontend
@@ -17,7 +23,11 @@ class WrappedLLVMContext;
 
 namespace StreamGraph
 {
+class BufferSizeAnalysis;
+class Node;
 class StreamGraph;
+struct SchedulePhase;
+using Schedule = std::vector<SchedulePhase>;
 }
 
 namespace CPUTarget
@@ -26,11 +36,13 @@ namespace CPUTarget
 class ProgramBuilder
 {
 public:
-  ProgramBuilder(Frontend::WrappedLLVMContext* context, const std::string& module_name);
+  ProgramBuilder(Frontend::WrappedLLVMContext* context, const std::string& module_name,
+                 const CodeGenOptions& options = {});
   ~ProgramBuilder();
 
   Frontend::WrappedLLVMContext* GetContext() const { return m_context; }
   const std::string& GetModuleName() const { return m_module_name; }
+  const CodeGenOptions& GetOptions() const { return m_options; }
   llvm::Module* GetModule() const { return m_module; }
 
   // Transfers ownership to caller. Module will not be cleaned up.
@@ -39,23 +51,113 @@ public:
   // Generates the whole program, entry point is main().
   bool GenerateCode(StreamGraph::StreamGraph* streamgraph);
 
-  // Optimizes LLVM IR.
-  void OptimizeModule();
+  // Links the runtime library's bitcode into the module, so its calls can be inlined by OptimizeModule().
+  // Only the functions the program uses are linked, and they are made internal to the module.
+  bool LinkRuntimeLibrary(const std::string& filename);
+
+  // Optimizes LLVM IR. The target machine provides the cost models, and sets the module's data layout.
+  void OptimizeModule(const OptimizationOptions& options = {}, llvm::TargetMachine* target_machine = nullptr);
+
+  // Table of channel buffer sizes compared to the default sizing. Only valid after GenerateCode().
+  std::string GetBufferReport(StreamGraph::StreamGraph* streamgraph) const;
+
+  // C header declaring the library API, when building a library.
+  std::string GetLibraryHeader(StreamGraph::StreamGraph* streamgraph) const;
 
 private:
+  // Bytes read and written by the InputReader and OutputWriter in the prime pump, and in each steady state.
+  struct LibraryIOSizes
+  {
+    u64 prime_pump_input = 0;
+    u64 prime_pump_output = 0;
+    u64 steady_state_input = 0;
+    u64 steady_state_output = 0;
+    u32 input_item = 0;
+    u32 output_item = 0;
+  };
+
   void CreateModule();
+
+  // Applies the steady state scale option, choosing the factor from the cache size when it is zero.
+  bool ScaleSteadyState(StreamGraph::StreamGraph* streamgraph);
+
+  // Bytes of filter state variables across all filter instances.
+  u64 GetFilterStateSize(StreamGraph::StreamGraph* streamgraph) const;
+
+  // Single-threaded steady state, in the order given by the schedule strategy option.
+  StreamGraph::Schedule BuildSteadyStateSchedule(StreamGraph::StreamGraph* streamgraph) const;
+
+  bool AnalyzeBufferSizes(StreamGraph::StreamGraph* streamgraph);
+
+  // Bytes allocated to channel buffers, as sized by the analysis.
+  u64 GetBufferFootprint(StreamGraph::StreamGraph* streamgraph) const;
   bool GenerateFilterAndChannelFunctions(StreamGraph::StreamGraph* streamgraph);
+
+  // Static buffer mode: resets every channel at the end of the init schedule, or of a steady state.
+  bool GenerateChannelResetFunction(StreamGraph::StreamGraph* streamgraph, bool init);
+  llvm::Constant* GetChannelResetFunction(bool init);
   bool GeneratePrimePumpFunction(StreamGraph::StreamGraph* streamgraph);
   bool GenerateSteadyStateFunction(StreamGraph::StreamGraph* streamgraph);
-  bool GenerateMainFunction();
+  bool GenerateThreadedSteadyStateFunction(StreamGraph::StreamGraph* streamgraph);
+  bool GenerateMainFunction(StreamGraph::StreamGraph* streamgraph);
+  bool GetLibraryIOSizes(StreamGraph::StreamGraph* streamgraph, LibraryIOSizes* sizes) const;
+  bool GenerateLibraryProcessFunction(StreamGraph::StreamGraph* streamgraph);
+  bool GenerateLibraryInitFunction();
+
+  // Restores every mutable global in the module to its initializer.
+  bool GenerateResetFunction();
+
+  // Moves the mutable globals into an instance struct, and generates the functions creating and destroying one.
+  bool GenerateInstanceFunctions();
+
+  // Generates a loop running the phases of the schedule, until the runtime ends it.
+  bool GenerateSteadyStateLoop(llvm::Function* func, const StreamGraph::Schedule& schedule);
+
+  // Argument of the calls made by GenerateFunctionCalls(), start + i * stride for the i'th call.
+  struct CallArg
+  {
+    u32 start;
+    u32 stride;
+  };
+
+  // Calls the node's work function firings times, starting from the node's first_firing'th firing of the init
+  // schedule or steady state. Returns the basic block to continue in.
+  llvm::BasicBlock* GenerateNodeFirings(llvm::Function* func, llvm::BasicBlock* entry_bb, llvm::BasicBlock* current_bb,
+                                        StreamGraph::Node* node, u32 firings, u32 first_firing, bool init);
 
   // Returns the basic block after the loop exits
   llvm::BasicBlock* GenerateFunctionCalls(llvm::Function* func, llvm::BasicBlock* entry_bb,
-                                          llvm::BasicBlock* current_bb, llvm::Constant* call_func, size_t count);
+                                          llvm::BasicBlock* current_bb, llvm::Constant* call_func, size_t count,
+                                          const std::vector<CallArg>& args = {});
+
+  // As GenerateFunctionCalls(), adding the cycles taken and the node's firings to its profile counters. A single
+  // call to a vector or bulk function runs several firings, so they are passed separately from count.
+  llvm::BasicBlock* GenerateProfiledFunctionCalls(llvm::Function* func, llvm::BasicBlock* entry_bb,
+                                                  llvm::BasicBlock* current_bb, StreamGraph::Node* node,
+                                                  llvm::Constant* call_func, size_t count, u32 firings,
+                                                  const std::vector<CallArg>& args = {});
+
+  // Cycles and firings of the node, created on first use.
+  llvm::GlobalVariable* GetProfileCounters(const StreamGraph::Node* node);
+
+  // Passes the counters of every profiled node to the runtime, which prints the report.
+  bool GenerateProfileReport(llvm::BasicBlock* bb);
+
+  // Passes the stats of every channel to the runtime, which prints the report.
+  bool GenerateChannelStatsReport(llvm::BasicBlock* bb, StreamGraph::StreamGraph* streamgraph);
+
+  // Calls func_name(entries, count), with a constant table of {name, counters} entries.
+  bool GenerateCounterReport(llvm::BasicBlock* bb,
+                             const std::vector<std::pair<std::string, llvm::GlobalVariable*>>& counters,
+                             const char* table_suffix, const char* func_name);
 
   Frontend::WrappedLLVMContext* m_context;
   std::string m_module_name;
+  CodeGenOptions m_options;
   llvm::Module* m_module = nullptr;
+  std::unique_ptr<StreamGraph::BufferSizeAnalysis> m_buffer_sizes;
+  llvm::StructType* m_instance_type = nullptr;
+  std::vector<std::pair<std::string, llvm::GlobalVariable*>> m_profile_counters;
 };
 
 } // namespace CPUTarget
\ No newline at end of file
@@ -0,0 +1,36 @@
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include "export.h"
+
+// Counters of one channel in programs compiled with --channel-stats. Matches ChannelStatsField in the channel builder.
+// Stalls are only counted in threaded programs, where a full or empty channel makes a thread wait.
+enum : int
+{
+  STATS_FIELD_MAX_SIZE = 0,
+  STATS_FIELD_CAPACITY = 1,
+  STATS_FIELD_FULL_STALLS = 2,
+  STATS_FIELD_EMPTY_STALLS = 8
+};
+
+struct ChannelStatsEntry
+{
+  const char* name;
+  const uint64_t* stats;
+};
+
+// Called by main once the program has finished. Prints one line per channel, in stream graph order.
+extern "C" EXPORT void streamit_write_channel_stats(const ChannelStatsEntry* entries, int num_entries)
+{
+  std::fprintf(stderr, "%-40s %10s %10s %7s %14s %14s\n", "channel", "capacity", "max", "used", "full stalls",
+               "empty stalls");
+  for (int i = 0; i < num_entries; i++)
+  {
+    const uint64_t* stats = entries[i].stats;
+    uint64_t capacity = stats[STATS_FIELD_CAPACITY];
+    uint64_t max_size = stats[STATS_FIELD_MAX_SIZE];
+    double percent_used = (capacity > 0) ? (double(max_size) * 100.0 / double(capacity)) : 0.0;
+    std::fprintf(stderr, "%-40s %10" PRIu64 " %10" PRIu64 " %6.1f%% %14" PRIu64 " %14" PRIu64 "\n", entries[i].name,
+                 capacity, max_size, percent_used, stats[STATS_FIELD_FULL_STALLS], stats[STATS_FIELD_EMPTY_STALLS]);
+  }
+}
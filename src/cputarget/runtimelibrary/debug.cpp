@@ -1,12 +1,6 @@
 #include <cstdarg>
 #include <cstdio>
-
-// TODO: Move this elsewhere
-#if defined(_WIN32) || defined(__CYGWIN__)
-#define EXPORT __declspec(dllexport)
-#else
-#define EXPORT __attribute__((visibility("default")))
-#endif
+#include "export.h"
 
 extern "C" void streamit_debug_print(const char* msg)
 {
@@ -0,0 +1,8 @@
+#pragma once
+
+// Marks functions which generated programs and library users call into the runtime.
+#if defined(_WIN32) || defined(__CYGWIN__)
+#define EXPORT __declspec(dllexport)
+#else
+#define EXPORT __attribute__((visibility("default")))
+#endif
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <cstdarg>
@@ -6,14 +8,21 @@
 #include <cstdlib>
 #include <cstring>
 #include <string>
+#include <thread>
+#include <vector>
+#include "export.h"
 
-// TODO: Move this elsewhere
-#if defined(_WIN32) || defined(__CYGWIN__)
-#define EXPORT __declspec(dllexport)
-#else
-#define EXPORT __attribute__((visibility("default")))
+#if !defined(_WIN32) && !defined(__CYGWIN__)
+#define HAS_MMAP_IO 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
+// Filters read and write a steady state of tokens per call, so give stdio room for several of them.
+static constexpr size_t FILE_BUFFER_SIZE = 1024 * 1024;
+
 static std::string s_input_file_name;
 static std::string s_output_file_name;
 static bool s_benchmark_mode = false;
@@ -24,6 +33,100 @@ static FILE* s_input_file = nullptr;
 static FILE* s_output_file = nullptr;
 static uint64_t s_benchmark_input_counter = 0;
 
+extern "C" void streamit_stop_at_input_end();
+
+// Set once the last byte of the input has been read. The program finishes the steady state it is in, and stops.
+static bool s_input_ended = false;
+
+// The stop has to be in place before the InputReader pushes any of the tokens it just read, so threads downstream
+// can't finish the steady state and start another before they see it.
+static void SetInputEnded(bool ended = true)
+{
+  if (!ended || s_input_ended)
+    return;
+
+  s_input_ended = true;
+  streamit_stop_at_input_end();
+}
+
+// Files are accessed through stdio by default. STREAMIT_IO_MODE=mmap, or streamit_set_io_mode("mmap"), maps them
+// instead, so bulk reads and writes hand out pointers into the file's pages rather than copying through a buffer.
+// STREAMIT_IO_MODE=async keeps stdio, but moves it to a thread which reads ahead of and writes behind the program.
+enum class IOMode
+{
+  Stdio,
+  Mmap,
+  Async
+};
+static IOMode s_io_mode = IOMode::Stdio;
+static bool s_io_mode_set = false;
+
+// The output file is grown and mapped this much at a time. It is truncated to the bytes written on exit.
+static constexpr size_t OUTPUT_MAP_WINDOW_SIZE = 64 * 1024 * 1024;
+
+struct MappedFile
+{
+  int fd = -1;
+  char* data = nullptr;
+  size_t map_offset = 0;
+  size_t map_size = 0;
+  size_t position = 0;
+  size_t file_size = 0;
+};
+static MappedFile s_input_map;
+static MappedFile s_output_map;
+
+// In async mode, blocks are exchanged with the I/O thread through single-producer/single-consumer rings, one per
+// direction. The producer owns the head index and the consumer the tail, so neither side takes a lock.
+static constexpr size_t ASYNC_BLOCK_SIZE = 1024 * 1024;
+static constexpr uint32_t ASYNC_NUM_BLOCKS = 4;
+
+struct AsyncBlock
+{
+  std::vector<char> data;
+  size_t size = 0;
+};
+
+struct AsyncRing
+{
+  AsyncBlock blocks[ASYNC_NUM_BLOCKS];
+  std::atomic<uint32_t> head{0};
+  std::atomic<uint32_t> tail{0};
+  std::atomic<bool> active{false};
+
+  // Set by the I/O thread once the last input block has been published.
+  std::atomic<bool> end_of_file{false};
+
+  // Offset of the program in its current block, i.e. the one at tail for input, or head for output.
+  size_t position = 0;
+};
+static AsyncRing s_async_input;
+static AsyncRing s_async_output;
+static std::thread s_async_thread;
+static std::atomic<bool> s_async_stop{false};
+
+// Programs built as a library use buffer mode, where the caller passes its own buffers to each call to process.
+// This is per thread, so instances of a program built with per-instance state can be run on several threads at once.
+struct BufferIO
+{
+  bool active = false;
+  const char* input = nullptr;
+  size_t input_size = 0;
+  size_t input_position = 0;
+  char* output = nullptr;
+  size_t output_size = 0;
+  size_t output_position = 0;
+  size_t steady_state_input_size = 0;
+  size_t steady_state_output_size = 0;
+  std::vector<char> input_staging;
+  std::vector<char> output_staging;
+};
+static thread_local BufferIO s_buffer_io;
+
+// Tokens returned by the acquire functions when they can't point into a mapping or an async block.
+static std::vector<char> s_input_staging;
+static std::vector<char> s_output_staging;
+
 static bool InBenchmarkMode()
 {
   if (s_benchmark_mode)
@@ -36,6 +139,469 @@ static bool InBenchmarkMode()
   return s_benchmark_mode;
 }
 
+static IOMode GetIOMode()
+{
+  if (s_io_mode_set)
+    return s_io_mode;
+
+  const char* io_mode_str = std::getenv("STREAMIT_IO_MODE");
+  if (io_mode_str && std::strcmp(io_mode_str, "mmap") == 0)
+    s_io_mode = IOMode::Mmap;
+  else if (io_mode_str && std::strcmp(io_mode_str, "async") == 0)
+    s_io_mode = IOMode::Async;
+
+  s_io_mode_set = true;
+  return s_io_mode;
+}
+
+static char* GetStagingBuffer(std::vector<char>& buffer, size_t num_bytes)
+{
+  if (buffer.size() < num_bytes)
+    buffer.resize(num_bytes);
+
+  return buffer.data();
+}
+
+#ifdef HAS_MMAP_IO
+static bool OpenMappedInput(const char* filename)
+{
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+
+  // Empty files can't be mapped, but there is nothing to read from them either.
+  s_input_map.file_size = size_t(st.st_size);
+  if (s_input_map.file_size > 0)
+  {
+    void* data = mmap(nullptr, s_input_map.file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+      close(fd);
+      return false;
+    }
+
+    posix_madvise(data, s_input_map.file_size, POSIX_MADV_SEQUENTIAL);
+    s_input_map.data = static_cast<char*>(data);
+    s_input_map.map_size = s_input_map.file_size;
+  }
+
+  s_input_map.fd = fd;
+  return true;
+}
+
+static const char* AcquireMappedInput(size_t num_bytes)
+{
+  MappedFile& map = s_input_map;
+  if (map.position + num_bytes <= map.file_size)
+  {
+    const char* ptr = map.data + map.position;
+    map.position += num_bytes;
+    SetInputEnded(map.position == map.file_size);
+    return ptr;
+  }
+
+  // Reads past the end of the file are zero-filled.
+  char* staging = GetStagingBuffer(s_input_staging, num_bytes);
+  size_t available = (map.position < map.file_size) ? (map.file_size - map.position) : 0;
+  if (available > 0)
+    std::memcpy(staging, map.data + map.position, available);
+  std::memset(staging + available, 0, num_bytes - available);
+  map.position += available;
+  SetInputEnded();
+  return staging;
+}
+
+static void CloseMappedInput()
+{
+  MappedFile& map = s_input_map;
+  if (map.fd < 0)
+    return;
+
+  if (map.data)
+    munmap(map.data, map.map_size);
+
+  close(map.fd);
+  map = MappedFile();
+}
+
+static void CloseMappedOutput()
+{
+  MappedFile& map = s_output_map;
+  if (map.fd < 0)
+    return;
+
+  // Drop the preallocated space past what was written.
+  if (map.data)
+    munmap(map.data, map.map_size);
+  if (ftruncate(map.fd, off_t(map.position)) != 0)
+    fprintf(stderr, "Failed to truncate mapped output file\n");
+
+  close(map.fd);
+  map = MappedFile();
+}
+
+static bool OpenMappedOutput(const char* filename)
+{
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return false;
+
+  s_output_map.fd = fd;
+  std::atexit(CloseMappedOutput);
+  std::at_quick_exit(CloseMappedOutput);
+  return true;
+}
+
+static void RemapOutput(size_t num_bytes)
+{
+  MappedFile& map = s_output_map;
+  if (map.data)
+    munmap(map.data, map.map_size);
+
+  // Mappings start on a page boundary, and cover whole windows so the file grows in large steps.
+  const size_t page_size = size_t(sysconf(_SC_PAGESIZE));
+  map.map_offset = map.position & ~(page_size - 1);
+  size_t needed = map.position - map.map_offset + num_bytes;
+  map.map_size = (needed + OUTPUT_MAP_WINDOW_SIZE - 1) / OUTPUT_MAP_WINDOW_SIZE * OUTPUT_MAP_WINDOW_SIZE;
+  map.file_size = map.map_offset + map.map_size;
+
+  void* data = MAP_FAILED;
+  if (ftruncate(map.fd, off_t(map.file_size)) == 0)
+    data = mmap(nullptr, map.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, map.fd, off_t(map.map_offset));
+  if (data == MAP_FAILED)
+  {
+    fprintf(stderr, "Failed to map %zu bytes of output file\n", map.map_size);
+    std::quick_exit(-1);
+  }
+
+  map.data = static_cast<char*>(data);
+}
+
+static char* AcquireMappedOutput(size_t num_bytes)
+{
+  MappedFile& map = s_output_map;
+  if (!map.data || map.position + num_bytes > map.map_offset + map.map_size)
+    RemapOutput(num_bytes);
+
+  char* ptr = map.data + (map.position - map.map_offset);
+  map.position += num_bytes;
+  return ptr;
+}
+#else
+static bool OpenMappedInput(const char* filename)
+{
+  return false;
+}
+
+static bool OpenMappedOutput(const char* filename)
+{
+  return false;
+}
+
+static const char* AcquireMappedInput(size_t num_bytes)
+{
+  return nullptr;
+}
+
+static void CloseMappedInput()
+{
+}
+
+static void CloseMappedOutput()
+{
+}
+
+static char* AcquireMappedOutput(size_t num_bytes)
+{
+  return nullptr;
+}
+#endif
+
+static bool FillAsyncInput()
+{
+  AsyncRing& ring = s_async_input;
+  if (!ring.active.load(std::memory_order_acquire) || ring.end_of_file.load(std::memory_order_relaxed))
+    return false;
+
+  uint32_t head = ring.head.load(std::memory_order_relaxed);
+  if ((head - ring.tail.load(std::memory_order_acquire)) == ASYNC_NUM_BLOCKS)
+    return false;
+
+  // A short block is the last one. The flag is set after publishing it, so the program sees the block first.
+  AsyncBlock& block = ring.blocks[head % ASYNC_NUM_BLOCKS];
+  block.size = std::fread(block.data.data(), 1, ASYNC_BLOCK_SIZE, s_input_file);
+  ring.head.store(head + 1, std::memory_order_release);
+  if (block.size < ASYNC_BLOCK_SIZE)
+    ring.end_of_file.store(true, std::memory_order_release);
+
+  return true;
+}
+
+static bool DrainAsyncOutput()
+{
+  AsyncRing& ring = s_async_output;
+  if (!ring.active.load(std::memory_order_acquire))
+    return false;
+
+  uint32_t tail = ring.tail.load(std::memory_order_relaxed);
+  if (tail == ring.head.load(std::memory_order_acquire))
+    return false;
+
+  const AsyncBlock& block = ring.blocks[tail % ASYNC_NUM_BLOCKS];
+  std::fwrite(block.data.data(), 1, block.size, s_output_file);
+  ring.tail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+static void AsyncIOThreadMain()
+{
+  for (;;)
+  {
+    bool did_work = FillAsyncInput();
+    did_work |= DrainAsyncOutput();
+    if (did_work)
+      continue;
+
+    // The program publishes its last output block before asking the thread to stop.
+    if (s_async_stop.load(std::memory_order_acquire))
+    {
+      while (DrainAsyncOutput())
+        ;
+      break;
+    }
+
+    std::this_thread::yield();
+  }
+
+  if (s_output_file)
+    std::fflush(s_output_file);
+}
+
+static void PublishAsyncOutput()
+{
+  AsyncRing& ring = s_async_output;
+  uint32_t head = ring.head.load(std::memory_order_relaxed);
+  ring.blocks[head % ASYNC_NUM_BLOCKS].size = ring.position;
+  ring.position = 0;
+  ring.head.store(head + 1, std::memory_order_release);
+}
+
+static void StopAsyncIO()
+{
+  if (!s_async_thread.joinable())
+    return;
+
+  if (s_async_output.position > 0)
+    PublishAsyncOutput();
+
+  s_async_stop.store(true, std::memory_order_release);
+  s_async_thread.join();
+  s_async_input.active.store(false, std::memory_order_relaxed);
+  s_async_output.active.store(false, std::memory_order_relaxed);
+}
+
+static void StartAsyncIO(AsyncRing& ring)
+{
+  for (AsyncBlock& block : ring.blocks)
+    block.data.resize(ASYNC_BLOCK_SIZE);
+  ring.active.store(true, std::memory_order_release);
+
+  // One thread serves both directions, whichever file is opened first starts it.
+  if (!s_async_thread.joinable())
+  {
+    s_async_thread = std::thread(AsyncIOThreadMain);
+    std::atexit(StopAsyncIO);
+    std::at_quick_exit(StopAsyncIO);
+  }
+}
+
+static bool IsAsync(const AsyncRing& ring)
+{
+  return ring.active.load(std::memory_order_relaxed);
+}
+
+// Returns the input block being read, handing exhausted blocks back to the I/O thread. Null at the end of the file.
+static const AsyncBlock* WaitAsyncInputBlock()
+{
+  AsyncRing& ring = s_async_input;
+  for (;;)
+  {
+    uint32_t tail = ring.tail.load(std::memory_order_relaxed);
+    if (tail != ring.head.load(std::memory_order_acquire))
+    {
+      const AsyncBlock& block = ring.blocks[tail % ASYNC_NUM_BLOCKS];
+      if (ring.position < block.size)
+        return &block;
+
+      ring.position = 0;
+      ring.tail.store(tail + 1, std::memory_order_release);
+      continue;
+    }
+
+    if (ring.end_of_file.load(std::memory_order_acquire) && tail == ring.head.load(std::memory_order_acquire))
+      return nullptr;
+
+    std::this_thread::yield();
+  }
+}
+
+// True when the program has read everything the I/O thread will ever publish.
+static bool IsAsyncInputExhausted()
+{
+  AsyncRing& ring = s_async_input;
+  if (!ring.end_of_file.load(std::memory_order_acquire))
+    return false;
+
+  uint32_t tail = ring.tail.load(std::memory_order_relaxed);
+  uint32_t head = ring.head.load(std::memory_order_acquire);
+  return (head == tail || ((head - tail) == 1 && ring.position >= ring.blocks[tail % ASYNC_NUM_BLOCKS].size));
+}
+
+static const char* AcquireAsyncInput(size_t num_bytes)
+{
+  AsyncRing& ring = s_async_input;
+  const AsyncBlock* block = WaitAsyncInputBlock();
+  if (block && ring.position + num_bytes <= block->size)
+  {
+    const char* ptr = block->data.data() + ring.position;
+    ring.position += num_bytes;
+    SetInputEnded(IsAsyncInputExhausted());
+    return ptr;
+  }
+
+  // Requests which span blocks are gathered into the staging buffer. Reads past the end of the file are zero-filled.
+  char* staging = GetStagingBuffer(s_input_staging, num_bytes);
+  size_t copied = 0;
+  while (copied < num_bytes)
+  {
+    block = WaitAsyncInputBlock();
+    if (!block)
+    {
+      std::memset(staging + copied, 0, num_bytes - copied);
+      break;
+    }
+
+    size_t count = std::min(num_bytes - copied, block->size - ring.position);
+    std::memcpy(staging + copied, block->data.data() + ring.position, count);
+    ring.position += count;
+    copied += count;
+  }
+
+  SetInputEnded(IsAsyncInputExhausted());
+  return staging;
+}
+
+// Returns the output block being written, waiting for the I/O thread if every block is in flight.
+static AsyncBlock* WaitAsyncOutputBlock()
+{
+  AsyncRing& ring = s_async_output;
+  uint32_t head = ring.head.load(std::memory_order_relaxed);
+  while ((head - ring.tail.load(std::memory_order_acquire)) == ASYNC_NUM_BLOCKS)
+    std::this_thread::yield();
+
+  return &ring.blocks[head % ASYNC_NUM_BLOCKS];
+}
+
+static void WriteAsyncOutput(const void* ptr, size_t num_bytes)
+{
+  AsyncRing& ring = s_async_output;
+  const char* src = static_cast<const char*>(ptr);
+  while (num_bytes > 0)
+  {
+    AsyncBlock* block = WaitAsyncOutputBlock();
+    size_t count = std::min(num_bytes, ASYNC_BLOCK_SIZE - ring.position);
+    std::memcpy(block->data.data() + ring.position, src, count);
+    ring.position += count;
+    src += count;
+    num_bytes -= count;
+    if (ring.position == ASYNC_BLOCK_SIZE)
+      PublishAsyncOutput();
+  }
+}
+
+static char* AcquireAsyncOutput(size_t num_bytes)
+{
+  // Requests larger than a block are staged, and copied in by the commit.
+  AsyncRing& ring = s_async_output;
+  if (num_bytes > ASYNC_BLOCK_SIZE)
+    return GetStagingBuffer(s_output_staging, num_bytes);
+
+  if (ring.position > 0 && num_bytes > (ASYNC_BLOCK_SIZE - ring.position))
+    PublishAsyncOutput();
+
+  return WaitAsyncOutputBlock()->data.data() + ring.position;
+}
+
+static void CommitAsyncOutput(const void* ptr, size_t num_bytes)
+{
+  AsyncRing& ring = s_async_output;
+  if (ptr == s_output_staging.data())
+  {
+    WriteAsyncOutput(ptr, num_bytes);
+    return;
+  }
+
+  ring.position += num_bytes;
+  if (ring.position == ASYNC_BLOCK_SIZE)
+    PublishAsyncOutput();
+}
+
+static bool IsBufferIO()
+{
+  return s_buffer_io.active;
+}
+
+// The library's process function only runs a steady state when its input and output fit in the remaining buffers,
+// so these only fall back to staging if the program's rates are inconsistent. Missing input is zero-filled, and
+// output which doesn't fit is dropped.
+static const char* AcquireBufferInput(size_t num_bytes)
+{
+  BufferIO& io = s_buffer_io;
+  if (io.input_position + num_bytes <= io.input_size)
+  {
+    const char* ptr = io.input + io.input_position;
+    io.input_position += num_bytes;
+    return ptr;
+  }
+
+  char* staging = GetStagingBuffer(io.input_staging, num_bytes);
+  size_t available = io.input_size - io.input_position;
+  std::memcpy(staging, io.input + io.input_position, available);
+  std::memset(staging + available, 0, num_bytes - available);
+  io.input_position = io.input_size;
+  return staging;
+}
+
+static char* AcquireBufferOutput(size_t num_bytes)
+{
+  BufferIO& io = s_buffer_io;
+  if (io.output_position + num_bytes <= io.output_size)
+  {
+    char* ptr = io.output + io.output_position;
+    io.output_position += num_bytes;
+    return ptr;
+  }
+
+  return GetStagingBuffer(io.output_staging, num_bytes);
+}
+
+extern "C" EXPORT void streamit_set_io_mode(const char* mode)
+{
+  if (std::strcmp(mode, "mmap") == 0)
+    s_io_mode = IOMode::Mmap;
+  else if (std::strcmp(mode, "async") == 0)
+    s_io_mode = IOMode::Async;
+  else
+    s_io_mode = IOMode::Stdio;
+
+  s_io_mode_set = true;
+}
+
 extern "C" EXPORT void streamit_set_input_file_name(const char* name)
 {
   s_input_file_name = name;
@@ -53,7 +619,7 @@ extern "C" EXPORT void streamit_set_benchmark_mode()
 
 extern "C" EXPORT void streamit_open_input_file(const char* filename)
 {
-  if (InBenchmarkMode())
+  if (IsBufferIO() || InBenchmarkMode())
     return;
 
   // prioritize user-specified input file
@@ -65,6 +631,15 @@ extern "C" EXPORT void streamit_open_input_file(const char* filename)
   else
     actual_filename = "input.stream";
 
+  if (GetIOMode() == IOMode::Mmap)
+  {
+    assert(s_input_map.fd < 0);
+    if (OpenMappedInput(actual_filename.c_str()))
+      return;
+
+    fprintf(stderr, "Failed to map input file '%s', falling back to stdio\n", actual_filename.c_str());
+  }
+
   assert(!s_input_file);
   s_input_file = std::fopen(actual_filename.c_str(), "rb");
   if (!s_input_file)
@@ -72,10 +647,16 @@ extern "C" EXPORT void streamit_open_input_file(const char* filename)
     fprintf(stderr, "Failed to open input file '%s'\n", actual_filename.c_str());
     std::quick_exit(-1);
   }
+  std::setvbuf(s_input_file, nullptr, _IOFBF, FILE_BUFFER_SIZE);
+  if (GetIOMode() == IOMode::Async)
+    StartAsyncIO(s_async_input);
 }
 
 extern "C" EXPORT void streamit_open_output_file(const char* filename)
 {
+  if (IsBufferIO())
+    return;
+
   if (InBenchmarkMode())
   {
     s_last_benchmark_time = std::chrono::steady_clock::now();
@@ -91,6 +672,15 @@ extern "C" EXPORT void streamit_open_output_file(const char* filename)
   else
     actual_filename = "output.stream";
 
+  if (GetIOMode() == IOMode::Mmap)
+  {
+    assert(s_output_map.fd < 0);
+    if (OpenMappedOutput(actual_filename.c_str()))
+      return;
+
+    fprintf(stderr, "Failed to map output file '%s', falling back to stdio\n", actual_filename.c_str());
+  }
+
   assert(!s_output_file);
   s_output_file = std::fopen(actual_filename.c_str(), "wb");
   if (!s_output_file)
@@ -98,6 +688,9 @@ extern "C" EXPORT void streamit_open_output_file(const char* filename)
     fprintf(stderr, "Failed to open output file '%s'\n", actual_filename.c_str());
     std::quick_exit(-1);
   }
+  std::setvbuf(s_output_file, nullptr, _IOFBF, FILE_BUFFER_SIZE);
+  if (GetIOMode() == IOMode::Async)
+    StartAsyncIO(s_async_output);
 }
 
 static void UpdateBenchmarkStats()
@@ -117,6 +710,41 @@ static void UpdateBenchmarkStats()
           output_speed / (1024.0 * 1024.0));
 }
 
+static void ReadInputFile(void* ptr, size_t num_bytes)
+{
+  if (IsBufferIO())
+  {
+    std::memcpy(ptr, AcquireBufferInput(num_bytes), num_bytes);
+    return;
+  }
+  if (s_input_map.fd >= 0)
+  {
+    std::memcpy(ptr, AcquireMappedInput(num_bytes), num_bytes);
+    return;
+  }
+  if (IsAsync(s_async_input))
+  {
+    std::memcpy(ptr, AcquireAsyncInput(num_bytes), num_bytes);
+    return;
+  }
+
+  // Zero-fill a short read. The end of the file is detected as soon as the last byte is read, so the steady state
+  // which consumes it is the last one.
+  size_t bytes_read = std::fread(ptr, 1, num_bytes, s_input_file);
+  if (bytes_read < num_bytes)
+  {
+    std::memset(static_cast<char*>(ptr) + bytes_read, 0, num_bytes - bytes_read);
+    SetInputEnded();
+    return;
+  }
+
+  int next = std::fgetc(s_input_file);
+  if (next == EOF)
+    SetInputEnded();
+  else
+    std::ungetc(next, s_input_file);
+}
+
 extern "C" EXPORT void streamit_read_input_file_int(void* ptr, unsigned num_bytes, unsigned count)
 {
   if (s_benchmark_mode)
@@ -129,18 +757,20 @@ extern "C" EXPORT void streamit_read_input_file_int(void* ptr, unsigned num_byte
       switch (num_bytes)
       {
       case 1:
-        std::memcpy(ptr, &s_benchmark_input_counter, 1);
+        std::memcpy(out_ptr, &s_benchmark_input_counter, 1);
         break;
       case 4:
-        std::memcpy(ptr, &s_benchmark_input_counter, 4);
+        std::memcpy(out_ptr, &s_benchmark_input_counter, 4);
         break;
       case 8:
-        std::memcpy(ptr, &s_benchmark_input_counter, 8);
+        std::memcpy(out_ptr, &s_benchmark_input_counter, 8);
         break;
       default:
-        std::memcpy(ptr, &s_benchmark_input_counter, num_bytes);
+        std::memcpy(out_ptr, &s_benchmark_input_counter, num_bytes);
         break;
       }
+
+      out_ptr += num_bytes;
     }
 
     s_benchmark_bytes_read += size_t(num_bytes) * size_t(count);
@@ -148,7 +778,7 @@ extern "C" EXPORT void streamit_read_input_file_int(void* ptr, unsigned num_byte
     return;
   }
 
-  std::fread(ptr, num_bytes, count, s_input_file);
+  ReadInputFile(ptr, size_t(num_bytes) * size_t(count));
 }
 
 extern "C" EXPORT void streamit_read_input_file_float(void* ptr, unsigned num_bytes, unsigned count)
@@ -163,15 +793,20 @@ extern "C" EXPORT void streamit_read_input_file_float(void* ptr, unsigned num_by
       switch (num_bytes)
       {
       case 4:
-        std::memcpy(ptr, &val, 4);
+        std::memcpy(out_ptr, &val, 4);
         break;
       case 8:
-        std::memcpy(ptr, &val, 8);
-        break;
+      {
+        double double_val = double(val);
+        std::memcpy(out_ptr, &double_val, 8);
+      }
+      break;
       default:
-        std::memcpy(ptr, &val, num_bytes);
+        std::memcpy(out_ptr, &val, std::min(num_bytes, unsigned(sizeof(val))));
         break;
       }
+
+      out_ptr += num_bytes;
     }
 
     s_benchmark_bytes_read += size_t(num_bytes) * size_t(count);
@@ -179,11 +814,17 @@ extern "C" EXPORT void streamit_read_input_file_float(void* ptr, unsigned num_by
     return;
   }
 
-  std::fread(ptr, num_bytes, count, s_input_file);
+  ReadInputFile(ptr, size_t(num_bytes) * size_t(count));
 }
 
 static void streamit_write_output_file(const void* ptr, unsigned num_bytes, unsigned count)
 {
+  if (IsBufferIO())
+  {
+    std::memcpy(AcquireBufferOutput(size_t(num_bytes) * size_t(count)), ptr, size_t(num_bytes) * size_t(count));
+    return;
+  }
+
   if (s_benchmark_mode)
   {
     s_benchmark_bytes_written += size_t(num_bytes) * size_t(count);
@@ -191,6 +832,17 @@ static void streamit_write_output_file(const void* ptr, unsigned num_bytes, unsi
     return;
   }
 
+  if (s_output_map.fd >= 0)
+  {
+    std::memcpy(AcquireMappedOutput(size_t(num_bytes) * size_t(count)), ptr, size_t(num_bytes) * size_t(count));
+    return;
+  }
+  if (IsAsync(s_async_output))
+  {
+    WriteAsyncOutput(ptr, size_t(num_bytes) * size_t(count));
+    return;
+  }
+
   std::fwrite(ptr, num_bytes, count, s_output_file);
 }
 
@@ -203,3 +855,123 @@ extern "C" EXPORT void streamit_write_output_file_float(const void* ptr, unsigne
 {
   streamit_write_output_file(ptr, num_bytes, count);
 }
+
+// Bulk I/O hands out a pointer to count tokens, which is only valid until the next call. When the file is mapped the
+// pointer is into the file itself, otherwise the tokens are staged in a buffer owned by the runtime.
+extern "C" EXPORT const void* streamit_acquire_input_file_int(unsigned num_bytes, unsigned count)
+{
+  if (IsBufferIO())
+    return AcquireBufferInput(size_t(num_bytes) * size_t(count));
+  if (!s_benchmark_mode && s_input_map.fd >= 0)
+    return AcquireMappedInput(size_t(num_bytes) * size_t(count));
+  if (!s_benchmark_mode && IsAsync(s_async_input))
+    return AcquireAsyncInput(size_t(num_bytes) * size_t(count));
+
+  char* staging = GetStagingBuffer(s_input_staging, size_t(num_bytes) * size_t(count));
+  streamit_read_input_file_int(staging, num_bytes, count);
+  return staging;
+}
+
+extern "C" EXPORT const void* streamit_acquire_input_file_float(unsigned num_bytes, unsigned count)
+{
+  if (IsBufferIO())
+    return AcquireBufferInput(size_t(num_bytes) * size_t(count));
+  if (!s_benchmark_mode && s_input_map.fd >= 0)
+    return AcquireMappedInput(size_t(num_bytes) * size_t(count));
+  if (!s_benchmark_mode && IsAsync(s_async_input))
+    return AcquireAsyncInput(size_t(num_bytes) * size_t(count));
+
+  char* staging = GetStagingBuffer(s_input_staging, size_t(num_bytes) * size_t(count));
+  streamit_read_input_file_float(staging, num_bytes, count);
+  return staging;
+}
+
+// Output tokens are written to the acquired pointer, then handed back with streamit_commit_output_file.
+extern "C" EXPORT void* streamit_acquire_output_file(unsigned num_bytes, unsigned count)
+{
+  if (IsBufferIO())
+    return AcquireBufferOutput(size_t(num_bytes) * size_t(count));
+  if (!s_benchmark_mode && s_output_map.fd >= 0)
+    return AcquireMappedOutput(size_t(num_bytes) * size_t(count));
+  if (!s_benchmark_mode && IsAsync(s_async_output))
+    return AcquireAsyncOutput(size_t(num_bytes) * size_t(count));
+
+  return GetStagingBuffer(s_output_staging, size_t(num_bytes) * size_t(count));
+}
+
+extern "C" EXPORT void streamit_commit_output_file(const void* ptr, unsigned num_bytes, unsigned count)
+{
+  // Mapped and caller-owned output is already in place.
+  if (IsBufferIO() || (!s_benchmark_mode && s_output_map.fd >= 0))
+    return;
+  if (!s_benchmark_mode && IsAsync(s_async_output))
+  {
+    CommitAsyncOutput(ptr, size_t(num_bytes) * size_t(count));
+    return;
+  }
+
+  streamit_write_output_file(ptr, num_bytes, count);
+}
+
+extern "C" EXPORT int streamit_input_ended()
+{
+  return s_input_ended ? 1 : 0;
+}
+
+// Writes out everything buffered and closes the files, so the program can return from main.
+extern "C" EXPORT void streamit_close_files()
+{
+  StopAsyncIO();
+  CloseMappedInput();
+  CloseMappedOutput();
+
+  if (s_input_file)
+  {
+    std::fclose(s_input_file);
+    s_input_file = nullptr;
+  }
+  if (s_output_file)
+  {
+    std::fclose(s_output_file);
+    s_output_file = nullptr;
+  }
+}
+
+// Hands the caller's buffers to the program for one call to the library's process function. Switches to buffer mode.
+extern "C" EXPORT void streamit_begin_buffer_io(const void* input, size_t input_size, void* output, size_t output_size,
+                                                size_t steady_state_input_size, size_t steady_state_output_size)
+{
+  s_buffer_io.active = true;
+  s_buffer_io.input = static_cast<const char*>(input);
+  s_buffer_io.input_size = input ? input_size : 0;
+  s_buffer_io.input_position = 0;
+  s_buffer_io.output = static_cast<char*>(output);
+  s_buffer_io.output_size = output ? output_size : 0;
+  s_buffer_io.output_position = 0;
+  s_buffer_io.steady_state_input_size = steady_state_input_size;
+  s_buffer_io.steady_state_output_size = steady_state_output_size;
+}
+
+extern "C" EXPORT int streamit_buffer_io_fits(size_t input_size, size_t output_size)
+{
+  const BufferIO& io = s_buffer_io;
+  return (io.input_position + input_size <= io.input_size && io.output_position + output_size <= io.output_size);
+}
+
+// Used by the steady state loop to stop once another steady state would not fit.
+extern "C" EXPORT int streamit_buffer_io_active()
+{
+  return IsBufferIO() ? 1 : 0;
+}
+
+extern "C" EXPORT int streamit_buffer_io_fits_steady_state()
+{
+  return streamit_buffer_io_fits(s_buffer_io.steady_state_input_size, s_buffer_io.steady_state_output_size);
+}
+
+// Returns the bytes of input consumed, and the bytes of output written.
+extern "C" EXPORT size_t streamit_end_buffer_io(size_t* output_written)
+{
+  *output_written = s_buffer_io.output_position;
+  return s_buffer_io.input_position;
+}
@@ -0,0 +1,83 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "export.h"
+
+// Counters of one filter in programs compiled with profiling. Cycles are from the CPU's cycle counter, and include
+// everything the work function does, such as channel accesses and I/O.
+struct ProfileEntry
+{
+  const char* name;
+  const uint64_t* counters; // cycles, firings
+};
+
+// Where the JSON report is written. STREAMIT_PROFILE_OUTPUT is used when --profile-output is not given.
+static std::string s_profile_output_file_name;
+
+extern "C" EXPORT void streamit_set_profile_output(const char* filename)
+{
+  s_profile_output_file_name = filename;
+}
+
+// Called by main once the program has finished. Prints the filters by cycles spent, most first, and writes the same
+// to a JSON file for tooling.
+extern "C" EXPORT void streamit_write_profile(const ProfileEntry* entries, int num_entries)
+{
+  std::vector<const ProfileEntry*> sorted;
+  uint64_t total_cycles = 0;
+  for (int i = 0; i < num_entries; i++)
+  {
+    sorted.push_back(&entries[i]);
+    total_cycles += entries[i].counters[0];
+  }
+  std::stable_sort(sorted.begin(), sorted.end(), [](const ProfileEntry* lhs, const ProfileEntry* rhs) {
+    return lhs->counters[0] > rhs->counters[0];
+  });
+
+  auto percent = [total_cycles](uint64_t cycles) {
+    return (total_cycles > 0) ? (double(cycles) * 100.0 / double(total_cycles)) : 0.0;
+  };
+  auto cycles_per_firing = [](const ProfileEntry* entry) {
+    return (entry->counters[1] > 0) ? (double(entry->counters[0]) / double(entry->counters[1])) : 0.0;
+  };
+
+  std::fprintf(stderr, "%-40s %16s %14s %14s %7s\n", "filter", "cycles", "firings", "cycles/firing", "%");
+  for (const ProfileEntry* entry : sorted)
+  {
+    std::fprintf(stderr, "%-40s %16" PRIu64 " %14" PRIu64 " %14.1f %6.2f%%\n", entry->name, entry->counters[0],
+                 entry->counters[1], cycles_per_firing(entry), percent(entry->counters[0]));
+  }
+  std::fprintf(stderr, "%-40s %16" PRIu64 "\n", "total", total_cycles);
+
+  if (s_profile_output_file_name.empty())
+  {
+    const char* filename = std::getenv("STREAMIT_PROFILE_OUTPUT");
+    s_profile_output_file_name = filename ? filename : "streamit_profile.json";
+  }
+
+  FILE* fp = std::fopen(s_profile_output_file_name.c_str(), "w");
+  if (!fp)
+  {
+    std::fprintf(stderr, "Failed to open profile output file %s\n", s_profile_output_file_name.c_str());
+    return;
+  }
+
+  // Filter names are identifiers, so they don't need escaping.
+  std::fprintf(fp, "{\n  \"total_cycles\": %" PRIu64 ",\n  \"filters\": [", total_cycles);
+  for (size_t i = 0; i < sorted.size(); i++)
+  {
+    const ProfileEntry* entry = sorted[i];
+    std::fprintf(fp,
+                 "%s\n    {\"name\": \"%s\", \"cycles\": %" PRIu64 ", \"firings\": %" PRIu64
+                 ", \"cycles_per_firing\": %.1f, \"percent\": %.2f}",
+                 (i > 0) ? "," : "", entry->name, entry->counters[0], entry->counters[1], cycles_per_firing(entry),
+                 percent(entry->counters[0]));
+  }
+  std::fprintf(fp, "\n  ]\n}\n");
+  std::fclose(fp);
+  std::fprintf(stderr, "Profile written to %s\n", s_profile_output_file_name.c_str());
+}
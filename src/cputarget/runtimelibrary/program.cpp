@@ -0,0 +1,94 @@
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+#include "export.h"
+
+extern "C" int streamit_buffer_io_active();
+extern "C" int streamit_buffer_io_fits_steady_state();
+extern "C" void streamit_set_profile_output(const char* filename);
+extern "C" int streamit_threads_stopping();
+
+// Number of steady states after which the program stops. Lowered to the steady state which read the last of the
+// input, if that comes first. Threads each count their own steady states, and stop at the same one.
+static std::atomic<uint64_t> s_stop_iteration{UINT64_MAX};
+
+// Steady states completed by the loop running the InputReader.
+static std::atomic<uint64_t> s_input_iteration{0};
+
+extern "C" EXPORT void streamit_set_iteration_limit(uint64_t iterations)
+{
+  s_stop_iteration.store((iterations > 0) ? iterations : UINT64_MAX);
+}
+
+// Handles the runtime's options, which are passed through the generated main. Anything else is ignored.
+// STREAMIT_ITERATIONS is used when --iterations is not given.
+extern "C" EXPORT void streamit_parse_args(int argc, char** argv)
+{
+  const char* iterations_str = std::getenv("STREAMIT_ITERATIONS");
+  for (int i = 1; i < argc; i++)
+  {
+    if (std::strcmp(argv[i], "--iterations") == 0 && (i + 1) < argc)
+      iterations_str = argv[++i];
+    else if (std::strncmp(argv[i], "--iterations=", 13) == 0)
+      iterations_str = argv[i] + 13;
+    else if (std::strcmp(argv[i], "--profile-output") == 0 && (i + 1) < argc)
+      streamit_set_profile_output(argv[++i]);
+    else if (std::strncmp(argv[i], "--profile-output=", 17) == 0)
+      streamit_set_profile_output(argv[i] + 17);
+  }
+
+  if (iterations_str)
+    streamit_set_iteration_limit(std::strtoull(iterations_str, nullptr, 10));
+}
+
+// Called by the I/O code when a read reaches the end of the input. That read is part of the InputReader's current
+// steady state, so the program stops after it. The InputReader hasn't pushed the tokens it read yet, so in threaded
+// programs every other thread sees the new stop before it can finish that steady state.
+extern "C" void streamit_stop_at_input_end()
+{
+  uint64_t iteration = s_input_iteration.load() + 1;
+  uint64_t stop_iteration = s_stop_iteration.load();
+  while (iteration < stop_iteration && !s_stop_iteration.compare_exchange_weak(stop_iteration, iteration))
+    ;
+}
+
+// Called at the end of every steady state, with the number completed so far. Returns non-zero when the loop should
+// exit. Only the loop running the InputReader passes reads_input, so the end of the input is placed in its steady
+// state, which the other threads can be behind or ahead of. Threads which were stopped while ahead exit here too.
+extern "C" EXPORT int streamit_end_steady_state(uint64_t iteration, int reads_input)
+{
+  // Built as a library, the program runs as many steady states as the caller's buffers allow.
+  if (streamit_buffer_io_active())
+    return streamit_buffer_io_fits_steady_state() ? 0 : 1;
+
+  if (reads_input)
+    s_input_iteration.store(iteration);
+
+  return (iteration >= s_stop_iteration.load() || streamit_threads_stopping()) ? 1 : 0;
+}
+
+// Instance state of programs built with per-instance state. The struct can hold vectors, so it is allocated with the
+// alignment the program asks for, rather than whatever malloc guarantees.
+extern "C" EXPORT void* streamit_alloc_instance(size_t size, size_t alignment)
+{
+  alignment = (alignment < sizeof(void*)) ? sizeof(void*) : alignment;
+#if defined(_WIN32)
+  return _aligned_malloc(size, alignment);
+#else
+  void* ptr;
+  return (posix_memalign(&ptr, alignment, size) == 0) ? ptr : nullptr;
+#endif
+}
+
+extern "C" EXPORT void streamit_free_instance(void* ptr)
+{
+#if defined(_WIN32)
+  _aligned_free(ptr);
+#else
+  std::free(ptr);
+#endif
+}
@@ -0,0 +1,45 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "export.h"
+
+using ThreadFunction = void (*)(void*);
+
+// Set once the last partition has returned. Earlier partitions can be ahead of it, blocked on a channel which will
+// never drain, so the channel waits give up when they see it.
+static std::atomic<int> s_threads_stopping{0};
+
+extern "C" EXPORT void streamit_run_threads(ThreadFunction* funcs, void* param, unsigned count)
+{
+  if (count == 0)
+    return;
+
+  // Run the last partition on the calling thread, no sense in leaving it idle. It holds the end of the graph, so
+  // once it returns every output of the final steady state has been written, and the others can be stopped.
+  s_threads_stopping.store(0);
+  std::vector<std::thread> threads;
+  threads.reserve(count - 1);
+  for (unsigned i = 0; i < (count - 1); i++)
+    threads.emplace_back(funcs[i], param);
+
+  funcs[count - 1](param);
+
+  s_threads_stopping.store(1, std::memory_order_release);
+  for (std::thread& thread : threads)
+    thread.join();
+}
+
+// Called by channel waits between polls. Returns non-zero when the threads are stopping, and the wait should give up.
+extern "C" EXPORT int streamit_thread_yield()
+{
+  if (s_threads_stopping.load(std::memory_order_acquire))
+    return 1;
+
+  std::this_thread::yield();
+  return 0;
+}
+
+extern "C" EXPORT int streamit_threads_stopping()
+{
+  return s_threads_stopping.load(std::memory_order_acquire);
+}
@@ -9,6 +9,9 @@
 #include "llvm/IR/Type.h"
 #include "llvm/Support/raw_ostream.h"
 #include "parser/ast.h"
+#include "streamgraph/buffer_size_analysis.h"
+#include "streamgraph/flat_graph.h"
+#include "streamgraph/schedule.h"
 Log_SetChannel(HLSTarget::ComponentGenerator);
 
 namespace HLSTarget
@@ -34,6 +37,17 @@ bool ComponentGenerator::GenerateComponent()
 
   WriteGlobalSignals();
 
+  // Size FIFOs by the occupancy of the sequential schedule. Any valid schedule can execute with these depths, so the
+  // self-timed hardware can't deadlock on them.
+  const StreamGraph::NodeList& filter_list = m_streamgraph->GetFlatGraph()->GetFilterList(false);
+
+  m_buffer_sizes = std::make_unique<StreamGraph::BufferSizeAnalysis>(m_streamgraph);
+  if (!m_buffer_sizes->Analyze(StreamGraph::BuildInitSchedule(filter_list),
+                               StreamGraph::BuildSteadyStateSchedule(filter_list)))
+  {
+    Log_WarningPrintf("Falling back to default FIFO depths");
+  }
+
   if (!m_streamgraph->GetRootNode()->Accept(this))
   {
     Log_ErrorPrintf("Stream graph walk failed");
@@ -160,6 +174,28 @@ void ComponentGenerator::WriteFilterPermutation(const StreamGraph::FilterPermuta
   m_os << "\n";
 }
 
+u32 ComponentGenerator::GetFIFODepth(const StreamGraph::Node* node, u32 input_index, u32 width,
+                                     u32 default_depth) const
+{
+  if (!m_buffer_sizes || !m_buffer_sizes->IsValid())
+    return default_depth;
+
+  u32 size = m_buffer_sizes->GetBufferSize(node, input_index);
+  u32 depth = std::max((size + width - 1) / width, u32(1));
+  Log_DevPrintf("FIFO depth for %s input %u is %u (default %u)", node->GetName().c_str(), input_index, depth,
+                default_depth);
+  return depth;
+}
+
+u32 ComponentGenerator::GetSplitFIFODepth(const StreamGraph::Split* node) const
+{
+  // Splits forward each token as soon as every output has space, so one round of the distribution is enough.
+  if (!m_buffer_sizes || !m_buffer_sizes->IsValid())
+    return node->GetNetPop() * VHDLHelpers::FIFO_SIZE_MULTIPLIER;
+
+  return node->GetMode() == StreamGraph::Split::Mode::Duplicate ? 1 : node->GetDistributionSum();
+}
+
 void ComponentGenerator::WriteFIFO(const std::string& name, u32 data_width, u32 depth)
 {
   m_signals << "signal " << name << "_read : std_logic;\n";
@@ -176,7 +212,8 @@ void ComponentGenerator::WriteFIFO(const std::string& name, u32 data_width, u32
     m_body << name << " : entity work."
            << (srl32 ? VHDLHelpers::FIFO_SRL32_COMPONENT_NAME : VHDLHelpers::FIFO_SRL16_COMPONENT_NAME) << "(behav)\n";
     m_body << "  generic map (\n";
-    m_body << "    DATA_WIDTH => " << data_width << "\n";
+    m_body << "    DATA_WIDTH => " << data_width << ",\n";
+    m_body << "    NAME => \"" << name << "\"\n";
     m_body << "  )\n";
     m_body << "  port map (\n";
     m_body << "    clk => clk,\n";
@@ -197,7 +234,8 @@ void ComponentGenerator::WriteFIFO(const std::string& name, u32 data_width, u32
     m_body << name << " : entity work." << VHDLHelpers::FIFO_COMPONENT_NAME << "(behav)\n";
     m_body << "  generic map (\n";
     m_body << "    DATA_WIDTH => " << data_width << ",\n";
-    m_body << "    SIZE => " << depth << "\n";
+    m_body << "    SIZE => " << depth << ",\n";
+    m_body << "    NAME => \"" << name << "\"\n";
     m_body << "  )\n";
     m_body << "  port map (\n";
     m_body << "    clk => clk,\n";
@@ -236,7 +274,9 @@ bool ComponentGenerator::Visit(StreamGraph::Filter* node)
     if (!combinational)
     {
       // Input FIFO queue
-      u32 fifo_depth = std::max(node->GetNetPeek(), node->GetNetPop()) * VHDLHelpers::FIFO_SIZE_MULTIPLIER;
+      u32 fifo_depth =
+        GetFIFODepth(node, 0, node->GetInputChannelWidth(),
+                     std::max(node->GetNetPeek(), node->GetNetPop()) * VHDLHelpers::FIFO_SIZE_MULTIPLIER);
       for (u32 i = 0; i < node->GetInputChannelWidth(); i++)
       {
         WriteFIFO(StringFromFormat("%s_fifo_%u", name.c_str(), i),
@@ -381,8 +421,7 @@ void ComponentGenerator::WriteSplitDuplicate(const StreamGraph::Split* node)
   const std::string& name = node->GetName();
   std::string fifo_name = StringFromFormat("%s_fifo_0", name.c_str());
   u32 data_width = VHDLHelpers::GetBitWidthForType(node->GetInputType());
-  u32 fifo_depth = node->GetNetPop() * VHDLHelpers::FIFO_SIZE_MULTIPLIER;
-  WriteFIFO(fifo_name, data_width, fifo_depth);
+  WriteFIFO(fifo_name, data_width, GetSplitFIFODepth(node));
 
   // Split process
   m_body << "-- split duplicate node " << name << " with " << node->GetOutputChannelNames().size()
@@ -411,8 +450,7 @@ void ComponentGenerator::WriteSplitRoundrobin(const StreamGraph::Split* node)
   const std::string& name = node->GetName();
   std::string fifo_name = StringFromFormat("%s_fifo_0", name.c_str());
   u32 data_width = VHDLHelpers::GetBitWidthForType(node->GetInputType());
-  u32 fifo_depth = node->GetNetPop() * VHDLHelpers::FIFO_SIZE_MULTIPLIER;
-  WriteFIFO(fifo_name, data_width, fifo_depth);
+  WriteFIFO(fifo_name, data_width, GetSplitFIFODepth(node));
 
   // Splitjoin state type
   std::string state_signal = StringFromFormat("%s_state", name.c_str());
@@ -560,7 +598,8 @@ void ComponentGenerator::WriteProgramOutput(const StreamGraph::Filter* node)
   for (u32 i = 0; i < node->GetInputChannelWidth(); i++)
   {
     std::string fifo_name = StringFromFormat("%s_fifo_%u", name.c_str(), i);
-    WriteFIFO(fifo_name, VHDLHelpers::GetBitWidthForType(node->GetInputType()), VHDLHelpers::FIFO_SIZE_MULTIPLIER);
+    WriteFIFO(fifo_name, VHDLHelpers::GetBitWidthForType(node->GetInputType()),
+              GetFIFODepth(node, 0, node->GetInputChannelWidth(), VHDLHelpers::FIFO_SIZE_MULTIPLIER));
   }
 
   // Wire each data input to a subsection of the output.
@@ -608,7 +647,7 @@ void ComponentGenerator::WriteJoinStateMachine(const StreamGraph::Join* node)
   {
     std::string fifo_name = StringFromFormat("%s_%u_fifo_0", name.c_str(), idx);
     u32 data_width = VHDLHelpers::GetBitWidthForType(node->GetInputType());
-    u32 fifo_depth = node->GetNetPop() * VHDLHelpers::FIFO_SIZE_MULTIPLIER;
+    u32 fifo_depth = GetFIFODepth(node, idx - 1, 1, node->GetNetPop() * VHDLHelpers::FIFO_SIZE_MULTIPLIER);
     WriteFIFO(fifo_name, data_width, fifo_depth);
   }
 
@@ -1,5 +1,6 @@
 #pragma once
 #include <cstddef>
+#include <memory>
 #include <sstream>
 #include "streamgraph/streamgraph.h"
 
@@ -22,6 +23,11 @@ namespace Frontend
 class WrappedLLVMContext;
 }
 
+namespace StreamGraph
+{
+class BufferSizeAnalysis;
+}
+
 namespace HLSTarget
 {
 
@@ -45,6 +51,11 @@ private:
   void WriteFIFOComponentDeclaration();
   void WriteFilterPermutation(const StreamGraph::FilterPermutation* filter);
   void WriteFIFO(const std::string& name, u32 data_width, u32 depth);
+
+  // Depth of each lane of a FIFO from the buffer size analysis, or the default depth if the schedule couldn't be
+  // analyzed. Widened channels split the tokens evenly across lanes.
+  u32 GetFIFODepth(const StreamGraph::Node* node, u32 input_index, u32 width, u32 default_depth) const;
+  u32 GetSplitFIFODepth(const StreamGraph::Split* node) const;
   void WriteSplitDuplicate(const StreamGraph::Split* node);
   void WriteSplitRoundrobin(const StreamGraph::Split* node);
   void WriteJoinStateMachine(const StreamGraph::Join* node);
@@ -65,6 +76,7 @@ private:
   llvm::raw_fd_ostream& m_os;
   std::stringstream m_signals;
   std::stringstream m_body;
+  std::unique_ptr<StreamGraph::BufferSizeAnalysis> m_buffer_sizes;
   bool m_use_srl_fifos = true;
 };
 
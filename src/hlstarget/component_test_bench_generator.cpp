@@ -52,6 +52,7 @@ void ComponentTestBenchGenerator::WriteHeader()
   m_os << "library IEEE;\n";
   m_os << "use IEEE.STD_LOGIC_1164.ALL;\n";
   m_os << "use IEEE.NUMERIC_STD.ALL;\n";
+  m_os << "use work.streamit_sim.all;\n";
   m_os << "\n";
 
   m_os << "entity " << m_module_name << "_tb is\n";
@@ -185,7 +186,8 @@ void ComponentTestBenchGenerator::WriteOutputConsumer()
   m_body << "  generic map (\n";
   m_body << "    DATA_WIDTH => " << (VHDLHelpers::GetBitWidthForType(program_output_type) * program_output_width)
          << ",\n";
-  m_body << "    SIZE => 16\n";
+  m_body << "    SIZE => 16,\n";
+  m_body << "    NAME => \"output_fifo\"\n";
   m_body << "  )\n";
   m_body << "  port map (\n";
   m_body << "    clk => clk,\n";
@@ -259,6 +261,8 @@ void ComponentTestBenchGenerator::WriteResetProcess()
   m_body << "  rst_n <= '1';\n";
   m_body << "  wait for 500ns;\n";
   m_body << "\n";
+  m_body << "  -- FIFOs report their high-water marks and stalls.\n";
+  m_body << "  sim_done <= true;\n";
   m_body << "  runsim <= '0';\n";
   m_body << "  wait;\n";
   m_body << "end process;\n";
@@ -507,6 +507,7 @@ bool ProjectGenerator::WriteVivadoScript()
   os << "\n";
 
   // Add wrapper component.
+  os << "add_files \"./_autogen_vhdl/streamit_sim.vhd\"\n";
   os << "add_files \"./_autogen_vhdl/fifo.vhd\"\n";
   os << "add_files \"./_autogen_vhdl/fifo_srl16.vhd\"\n";
   os << "add_files \"./_autogen_vhdl/fifo_srl32.vhd\"\n";
@@ -536,11 +537,13 @@ bool ProjectGenerator::WriteFIFOComponent()
   static const char fifo_vhdl[] = R"(library IEEE;
 use IEEE.STD_LOGIC_1164.ALL;
 use IEEE.NUMERIC_STD.ALL;
+use work.streamit_sim.all;
 
 entity fifo is
   generic (
     constant DATA_WIDTH : positive := 8;
-    constant SIZE : positive := 16
+    constant SIZE : positive := 16;
+    constant NAME : string := "fifo"
   );
   port (
     clk : in std_logic;
@@ -555,6 +558,9 @@ entity fifo is
 end fifo;
 
 architecture behav of fifo is
+  -- pragma translate_off
+  signal fifo_count : natural range 0 to SIZE := 0;
+  -- pragma translate_on
 begin
 
 main_proc : process(clk)
@@ -573,6 +579,9 @@ begin
       looped := false;
       full_n <= '1';
       empty_n <= '0';
+      -- pragma translate_off
+      fifo_count <= 0;
+      -- pragma translate_on
     else
       if (read = '1') then
         if ((looped = true) or (head_ptr /= tail_ptr)) then
@@ -598,6 +607,14 @@ begin
       end if;
       
       dout <= Memory(tail_ptr);
+
+      -- pragma translate_off
+      if (looped) then
+        fifo_count <= SIZE - tail_ptr + head_ptr;
+      else
+        fifo_count <= head_ptr - tail_ptr;
+      end if;
+      -- pragma translate_on
       
       if (head_ptr = tail_ptr) then
         if (looped) then
@@ -612,7 +629,32 @@ begin
     end if;
   end if;
 end process;
-   
+
+-- pragma translate_off
+-- Simulation only: the most elements held, and the cycles spent full (producer blocked) and empty after the first
+-- write (consumer starved). Reported when the test bench sets sim_done.
+monitor_proc : process(clk, sim_done)
+  variable max_count : natural := 0;
+  variable full_cycles : natural := 0;
+  variable empty_cycles : natural := 0;
+begin
+  if (sim_done'event and sim_done) then
+    report NAME & ": high-water mark " & integer'image(max_count) & " of " & integer'image(SIZE) &
+           ", full cycles " & integer'image(full_cycles) & ", empty cycles " & integer'image(empty_cycles);
+    assert max_count < SIZE report NAME & " filled up, its producer may have stalled" severity note;
+  elsif (rising_edge(clk) and rst_n = '1') then
+    if (fifo_count > max_count) then
+      max_count := fifo_count;
+    end if;
+    if (fifo_count = SIZE) then
+      full_cycles := full_cycles + 1;
+    elsif (fifo_count = 0 and max_count > 0) then
+      empty_cycles := empty_cycles + 1;
+    end if;
+  end if;
+end process;
+-- pragma translate_on
+
 end behav;
 )";
 
@@ -620,11 +662,13 @@ end behav;
 library IEEE;
 use IEEE.STD_LOGIC_1164.ALL;
 use IEEE.NUMERIC_STD.ALL;
+use work.streamit_sim.all;
 
 entity fifo_srl16 is
   generic (
     constant DATA_WIDTH : positive := 8;
-    constant DEPTH : integer := 16
+    constant DEPTH : integer := 16;
+    constant NAME : string := "fifo_srl16"
   );
   port (
     clk : in std_logic;
@@ -646,6 +690,9 @@ architecture behav of fifo_srl16 is
   signal fifo_full       : boolean;
   signal fifo_in_enable  : boolean;
   signal fifo_out_enable : boolean;
+  -- pragma translate_off
+  signal fifo_count      : natural range 0 to DEPTH;
+  -- pragma translate_on
   
 begin
   fifo_full       <= (fifo_index_i = DEPTH-1);  
@@ -656,6 +703,9 @@ begin
   
   fifo_in_enable  <= (write = '1') and (not fifo_full);
   fifo_out_enable <= (read = '1') and (not fifo_empty);
+  -- pragma translate_off
+  fifo_count      <= to_integer(fifo_index_i) + 1;
+  -- pragma translate_on
   
   dout            <= fifo_storage(to_integer(unsigned(fifo_index_i(3 downto 0))));  
 
@@ -677,6 +727,30 @@ begin
       end if;
     end if;
   end process;
+  -- pragma translate_off
+  -- Simulation only: the most elements held, and the cycles spent full (producer blocked) and empty after the first
+  -- write (consumer starved). Reported when the test bench sets sim_done.
+  monitor_proc : process(clk, sim_done)
+    variable max_count : natural := 0;
+    variable full_cycles : natural := 0;
+    variable empty_cycles : natural := 0;
+  begin
+    if (sim_done'event and sim_done) then
+      report NAME & ": high-water mark " & integer'image(max_count) & " of " & integer'image(DEPTH) &
+             ", full cycles " & integer'image(full_cycles) & ", empty cycles " & integer'image(empty_cycles);
+      assert max_count < DEPTH report NAME & " filled up, its producer may have stalled" severity note;
+    elsif (rising_edge(clk) and rst_n = '1') then
+      if (fifo_count > max_count) then
+        max_count := fifo_count;
+      end if;
+      if (fifo_count = DEPTH) then
+        full_cycles := full_cycles + 1;
+      elsif (fifo_count = 0 and max_count > 0) then
+        empty_cycles := empty_cycles + 1;
+      end if;
+    end if;
+  end process;
+  -- pragma translate_on
 end behav;
 )";
 
@@ -684,11 +758,13 @@ end behav;
 library IEEE;
 use IEEE.STD_LOGIC_1164.ALL;
 use IEEE.NUMERIC_STD.ALL;
+use work.streamit_sim.all;
 
 entity fifo_srl32 is
   generic (
     constant DATA_WIDTH : positive := 8;
-    constant DEPTH : integer := 32
+    constant DEPTH : integer := 32;
+    constant NAME : string := "fifo_srl32"
   );
   port (
     clk : in std_logic;
@@ -710,6 +786,9 @@ architecture behav of fifo_srl32 is
   signal fifo_full       : boolean;
   signal fifo_in_enable  : boolean;
   signal fifo_out_enable : boolean;
+  -- pragma translate_off
+  signal fifo_count      : natural range 0 to DEPTH;
+  -- pragma translate_on
   
 begin
   fifo_full       <= (fifo_index_i = DEPTH-1);  
@@ -720,6 +799,9 @@ begin
   
   fifo_in_enable  <= (write = '1') and (not fifo_full);
   fifo_out_enable <= (read = '1') and (not fifo_empty);
+  -- pragma translate_off
+  fifo_count      <= to_integer(fifo_index_i) + 1;
+  -- pragma translate_on
   
   dout            <= fifo_storage(to_integer(unsigned(fifo_index_i(4 downto 0))));  
 
@@ -741,7 +823,43 @@ begin
       end if;
     end if;
   end process;
+  -- pragma translate_off
+  -- Simulation only: the most elements held, and the cycles spent full (producer blocked) and empty after the first
+  -- write (consumer starved). Reported when the test bench sets sim_done.
+  monitor_proc : process(clk, sim_done)
+    variable max_count : natural := 0;
+    variable full_cycles : natural := 0;
+    variable empty_cycles : natural := 0;
+  begin
+    if (sim_done'event and sim_done) then
+      report NAME & ": high-water mark " & integer'image(max_count) & " of " & integer'image(DEPTH) &
+             ", full cycles " & integer'image(full_cycles) & ", empty cycles " & integer'image(empty_cycles);
+      assert max_count < DEPTH report NAME & " filled up, its producer may have stalled" severity note;
+    elsif (rising_edge(clk) and rst_n = '1') then
+      if (fifo_count > max_count) then
+        max_count := fifo_count;
+      end if;
+      if (fifo_count = DEPTH) then
+        full_cycles := full_cycles + 1;
+      elsif (fifo_count = 0 and max_count > 0) then
+        empty_cycles := empty_cycles + 1;
+      end if;
+    end if;
+  end process;
+  -- pragma translate_on
 end behav;
+)";
+
+  static const char streamit_sim_vhdl[] = R"(library IEEE;
+use IEEE.STD_LOGIC_1164.ALL;
+
+-- Simulation support shared by the generated components and the test bench.
+package streamit_sim is
+  -- pragma translate_off
+  -- Set by the test bench when the simulation ends, so components can report their statistics.
+  signal sim_done : boolean := false;
+  -- pragma translate_on
+end streamit_sim;
 )";
 
   auto WriteFile = [this](const char* name, const char* data, size_t len) {
@@ -758,7 +876,8 @@ end behav;
     return true;
   };
 
-  return (WriteFile("fifo", fifo_vhdl, sizeof(fifo_vhdl) - 1) &&
+  return (WriteFile("streamit_sim", streamit_sim_vhdl, sizeof(streamit_sim_vhdl) - 1) &&
+          WriteFile("fifo", fifo_vhdl, sizeof(fifo_vhdl) - 1) &&
           WriteFile("fifo_srl16", fifo_srl16_vhdl, sizeof(fifo_srl16_vhdl) - 1) &&
           WriteFile("fifo_srl32", fifo_srl32_vhdl, sizeof(fifo_srl32_vhdl) - 1));
 }
@@ -0,0 +1,347 @@
+#include "streamgraph/buffer_size_analysis.h"
+#include <algorithm>
+#include <cassert>
+#include "common/log.h"
+#include "common/string_helpers.h"
+#include "streamgraph/flat_graph.h"
+#include "llvm/IR/Type.h"
+Log_SetChannel(StreamGraph::BufferSizeAnalysis);
+
+namespace StreamGraph
+{
+// A rate-matched schedule returns every channel to the same state after one steady state, but allow a few extra
+// for rotations of splits and joins which span more than one.
+static const u32 MAX_STEADY_STATES = 8;
+
+BufferSizeAnalysis::BufferSizeAnalysis(StreamGraph* streamgraph) : m_streamgraph(streamgraph)
+{
+  BuildGraphInfo();
+}
+
+BufferSizeAnalysis::~BufferSizeAnalysis()
+{
+}
+
+void BufferSizeAnalysis::BuildGraphInfo()
+{
+  // All state is created up front, so the maps keep a stable iteration order while simulating.
+  const FlatGraph* graph = m_streamgraph->GetFlatGraph();
+  for (FlatGraph::NodeID id = 0; id < graph->GetNodeCount(); id++)
+  {
+    Node* node = graph->GetNode(id);
+    if (dynamic_cast<Filter*>(node))
+    {
+      if (!node->GetInputType()->isVoidTy())
+        m_channels[node].resize(1);
+
+      m_firings[node] = 0;
+    }
+    else if (dynamic_cast<Split*>(node))
+    {
+      m_roundrobin_states[node] = {};
+    }
+    else if (dynamic_cast<Join*>(node))
+    {
+      // Each branch feeds the join input matching its position. An empty splitjoin connects the split directly.
+      m_channels[node].resize(static_cast<Join*>(node)->GetIncomingStreams());
+      m_roundrobin_states[node] = {};
+      for (const FlatGraph::Edge& edge : graph->GetInputEdges(id))
+        m_join_input_index[graph->GetNode(edge.src)] = edge.input_index;
+    }
+  }
+}
+
+bool BufferSizeAnalysis::Analyze(const Schedule& init, const Schedule& steady_state)
+{
+  auto is_join = [](const SchedulePhase& phase) { return dynamic_cast<Join*>(phase.node) != nullptr; };
+  RunInit(init, std::any_of(steady_state.begin(), steady_state.end(), is_join));
+
+  std::vector<i64> last_state;
+  for (u32 i = 0; i < MAX_STEADY_STATES && !m_valid; i++)
+  {
+    last_state = GetState();
+    RunSchedule(steady_state);
+    EndPeriod();
+    m_valid = (GetState() == last_state);
+  }
+
+  if (m_underflows > 0)
+    Log_WarningPrintf("%u firings consumed more tokens than were available in the schedule", m_underflows);
+
+  if (!m_valid)
+  {
+    // Channel tokens come first in the state, in the same order.
+    size_t state_index = 0;
+    for (const auto& it : m_channels)
+    {
+      for (size_t i = 0; i < it.second.size(); i++, state_index++)
+      {
+        if (it.second[i].tokens > last_state[state_index])
+        {
+          Log_WarningPrintf("Channel into %s (input %u) grows by %lld tokens per steady state",
+                            it.first->GetName().c_str(), unsigned(i),
+                            static_cast<long long>(it.second[i].tokens - last_state[state_index]));
+        }
+      }
+    }
+
+    Log_WarningPrintf("Channel occupancy did not converge after %u steady states, the schedule is not rate-matched",
+                      MAX_STEADY_STATES);
+  }
+
+  return m_valid;
+}
+
+void BufferSizeAnalysis::RunInit(const Schedule& init, bool pull_joins)
+{
+  m_pull_joins = pull_joins;
+  RunSchedule(init);
+  EndPeriod();
+
+  for (auto& it : m_channels)
+  {
+    for (Channel& channel : it.second)
+      channel.init_tokens = channel.tokens;
+  }
+}
+
+bool BufferSizeAnalysis::CanFire(const Node* node) const
+{
+  const Join* join = dynamic_cast<const Join*>(node);
+  if (join)
+  {
+    const std::vector<int>& distribution = join->GetDistribution();
+    for (u32 i = 0; i < join->GetIncomingStreams(); i++)
+    {
+      const Channel* channel = FindChannel(join, i);
+      if (channel && channel->tokens < i64(distribution[i]))
+        return false;
+    }
+
+    return true;
+  }
+
+  const Filter* filter = dynamic_cast<const Filter*>(node);
+  const Channel* channel = FindChannel(node, 0);
+  if (!filter || !channel)
+    return true;
+
+  // Matches FireFilter, the first firing needs the prework window.
+  const FilterPermutation* perm = filter->GetFilterPermutation();
+  auto iter = m_firings.find(filter);
+  bool prework = ((iter == m_firings.end() || iter->second == 0) && perm && perm->HasPrework());
+  u32 peek = prework ? u32(perm->GetPreworkPeekRate()) : filter->GetPeekRate();
+  u32 pop = prework ? u32(perm->GetPreworkPopRate()) : filter->GetPopRate();
+  return (channel->tokens >= i64(std::max(peek, pop)));
+}
+
+void BufferSizeAnalysis::Fire(Node* node)
+{
+  RunSchedule({{node, 1}});
+}
+
+u32 BufferSizeAnalysis::GetBufferSize(const Node* node, u32 input_index) const
+{
+  const Channel* channel = FindChannel(node, input_index);
+  return channel ? static_cast<u32>(std::max(channel->max_tokens, i64(1))) : 0;
+}
+
+u32 BufferSizeAnalysis::GetMaxBufferSize(const Node* node) const
+{
+  auto iter = m_channels.find(node);
+  if (iter == m_channels.end())
+    return 0;
+
+  u32 size = 0;
+  for (u32 i = 0; i < u32(iter->second.size()); i++)
+    size = std::max(size, GetBufferSize(node, i));
+
+  return size;
+}
+
+u32 BufferSizeAnalysis::GetLinearBufferSize(const Node* node, u32 input_index) const
+{
+  const Channel* channel = FindChannel(node, input_index);
+  return channel ? static_cast<u32>(std::max(channel->max_extent, i64(1))) : 0;
+}
+
+u32 BufferSizeAnalysis::GetInitResidue(const Node* node, u32 input_index) const
+{
+  const Channel* channel = FindChannel(node, input_index);
+  return channel ? static_cast<u32>(std::max(channel->init_tokens, i64(0))) : 0;
+}
+
+void BufferSizeAnalysis::RunSchedule(const Schedule& schedule)
+{
+  for (const SchedulePhase& phase : schedule)
+  {
+    Filter* filter = dynamic_cast<Filter*>(phase.node);
+    Join* join = dynamic_cast<Join*>(phase.node);
+    for (u32 i = 0; i < phase.firings; i++)
+    {
+      if (filter)
+        FireFilter(filter);
+      else if (join)
+        FireJoin(join);
+    }
+  }
+}
+
+void BufferSizeAnalysis::EndPeriod()
+{
+  for (auto& it : m_channels)
+  {
+    for (Channel& channel : it.second)
+      channel.extent = channel.tokens;
+  }
+}
+
+std::vector<i64> BufferSizeAnalysis::GetState() const
+{
+  std::vector<i64> state;
+  for (const auto& it : m_channels)
+  {
+    for (const Channel& channel : it.second)
+      state.push_back(channel.tokens);
+  }
+  for (const auto& it : m_roundrobin_states)
+  {
+    state.push_back(it.second.index);
+    state.push_back(it.second.count);
+  }
+
+  return state;
+}
+
+void BufferSizeAnalysis::FireFilter(Filter* filter)
+{
+  // The first firing runs prework instead of work.
+  const FilterPermutation* perm = filter->GetFilterPermutation();
+  u32& firings = m_firings[filter];
+  bool prework = (firings == 0 && perm && perm->HasPrework());
+  u32 peek = prework ? u32(perm->GetPreworkPeekRate()) : filter->GetPeekRate();
+  u32 pop = prework ? u32(perm->GetPreworkPopRate()) : filter->GetPopRate();
+  u32 push = prework ? u32(perm->GetPreworkPushRate()) : filter->GetPushRate();
+  firings++;
+
+  if (!filter->GetInputType()->isVoidTy())
+    Consume(GetChannel(filter, 0), peek, pop);
+
+  if (!filter->HasOutputConnection())
+    return;
+
+  for (u32 i = 0; i < push; i++)
+    Deliver(filter->GetOutputConnection(), filter);
+}
+
+void BufferSizeAnalysis::FireJoin(Join* join)
+{
+  const std::vector<int>& distribution = join->GetDistribution();
+  for (u32 i = 0; i < join->GetIncomingStreams(); i++)
+    Consume(GetChannel(join, i), u32(distribution[i]), u32(distribution[i]));
+
+  if (!join->HasOutputConnection())
+    return;
+
+  for (u32 i = 0; i < join->GetIncomingStreams(); i++)
+  {
+    for (int j = 0; j < distribution[i]; j++)
+      Deliver(join->GetOutputConnection(), join);
+  }
+}
+
+void BufferSizeAnalysis::Consume(Channel& channel, u32 peek, u32 pop)
+{
+  // The whole peek window has to be resident, even though only pop tokens are removed.
+  i64 window = i64(std::max(peek, pop));
+  if (channel.tokens < window)
+    m_underflows++;
+
+  channel.max_tokens = std::max(channel.max_tokens, window);
+  channel.max_extent = std::max(channel.max_extent, channel.extent - channel.tokens + window);
+  channel.tokens -= i64(pop);
+}
+
+void BufferSizeAnalysis::Deliver(Node* dst, Node* src)
+{
+  Split* split = dynamic_cast<Split*>(dst);
+  if (split)
+  {
+    const NodeList& outputs = split->GetOutputs();
+    if (split->GetMode() == Split::Mode::Duplicate)
+    {
+      for (Node* output : outputs)
+        Deliver(output, split);
+
+      return;
+    }
+
+    RoundrobinState& rr = m_roundrobin_states[split];
+    Deliver(outputs[rr.index], split);
+    if (++rr.count >= u32(split->GetDistribution()[rr.index]))
+    {
+      rr.count = 0;
+      rr.index = (rr.index + 1) % u32(outputs.size());
+    }
+
+    return;
+  }
+
+  Join* join = dynamic_cast<Join*>(dst);
+  u32 input_index = 0;
+  if (join)
+  {
+    auto iter = m_join_input_index.find(src);
+    assert(iter != m_join_input_index.end());
+    input_index = iter->second;
+  }
+
+  Channel& channel = GetChannel(dst, input_index);
+  channel.tokens++;
+  channel.extent++;
+  channel.max_tokens = std::max(channel.max_tokens, channel.tokens);
+  channel.max_extent = std::max(channel.max_extent, channel.extent);
+
+  if (join && !m_pull_joins)
+    DrainJoin(join);
+}
+
+void BufferSizeAnalysis::DrainJoin(Join* join)
+{
+  // Push-driven joins forward tokens in roundrobin order as soon as the current input has one.
+  RoundrobinState& rr = m_roundrobin_states[join];
+  for (;;)
+  {
+    Channel& channel = GetChannel(join, rr.index);
+    if (channel.tokens <= 0)
+      break;
+
+    channel.tokens--;
+    if (++rr.count >= u32(join->GetDistribution()[rr.index]))
+    {
+      rr.count = 0;
+      rr.index = (rr.index + 1) % join->GetIncomingStreams();
+    }
+
+    if (join->HasOutputConnection())
+      Deliver(join->GetOutputConnection(), join);
+  }
+}
+
+BufferSizeAnalysis::Channel& BufferSizeAnalysis::GetChannel(const Node* node, u32 input_index)
+{
+  auto iter = m_channels.find(node);
+  assert(iter != m_channels.end() && input_index < iter->second.size());
+  return iter->second[input_index];
+}
+
+const BufferSizeAnalysis::Channel* BufferSizeAnalysis::FindChannel(const Node* node, u32 input_index) const
+{
+  auto iter = m_channels.find(node);
+  if (iter == m_channels.end() || input_index >= iter->second.size())
+    return nullptr;
+
+  return &iter->second[input_index];
+}
+
+} // namespace StreamGraph
@@ -0,0 +1,92 @@
+#pragma once
+#include <unordered_map>
+#include <vector>
+#include "common/types.h"
+#include "streamgraph/schedule.h"
+
+namespace StreamGraph
+{
+// Computes the exact maximum occupancy of every channel under a schedule, by simulating it token by token.
+// Channels are keyed by their consumer: the input of a filter, or one input of a join. Splits forward tokens to
+// their outputs immediately. Joins forward tokens as they arrive, unless the schedule fires them explicitly.
+class BufferSizeAnalysis
+{
+public:
+  BufferSizeAnalysis(StreamGraph* streamgraph);
+  ~BufferSizeAnalysis();
+
+  // Runs the init schedule, followed by steady states until the channel state repeats.
+  // Returns false if a channel grows without bound, which happens when the schedule is not rate-matched.
+  bool Analyze(const Schedule& init, const Schedule& steady_state);
+
+  // Single stepping, for building schedules from the channel state. After RunInit, each Fire runs one firing of a
+  // filter, or of a join when pull_joins is set. Not combined with Analyze on the same instance.
+  void RunInit(const Schedule& init, bool pull_joins);
+  bool CanFire(const Node* node) const;
+  void Fire(Node* node);
+
+  bool IsValid() const { return m_valid; }
+
+  // Maximum number of tokens held by the channel at once, including the consumer's peek window.
+  // Zero if the node has no such input channel.
+  u32 GetBufferSize(const Node* node, u32 input_index = 0) const;
+
+  // Maximum over all inputs, for channels which share one allocation per input.
+  u32 GetMaxBufferSize(const Node* node) const;
+
+  // Size needed when the channel is compacted to the front at the end of the init schedule and every steady state,
+  // i.e. the furthest position written or peeked since the last compaction.
+  u32 GetLinearBufferSize(const Node* node, u32 input_index = 0) const;
+
+  // Tokens left in the channel at the end of the init schedule. Channels between two filters carry as many tokens
+  // into every steady state, since the producer pushes exactly what the consumer pops in between.
+  u32 GetInitResidue(const Node* node, u32 input_index = 0) const;
+
+private:
+  struct Channel
+  {
+    i64 tokens = 0;
+    i64 max_tokens = 0;
+
+    // Tokens pushed since the last compaction, plus those which were left over at the time.
+    i64 extent = 0;
+    i64 max_extent = 0;
+
+    i64 init_tokens = 0;
+  };
+
+  // Rotation state of roundrobin splits and joins.
+  struct RoundrobinState
+  {
+    u32 index = 0;
+    u32 count = 0;
+  };
+
+  void BuildGraphInfo();
+  void RunSchedule(const Schedule& schedule);
+  void EndPeriod();
+  std::vector<i64> GetState() const;
+
+  void FireFilter(Filter* filter);
+  void FireJoin(Join* join);
+  void Consume(Channel& channel, u32 peek, u32 pop);
+  void Deliver(Node* dst, Node* src);
+  void DrainJoin(Join* join);
+
+  Channel& GetChannel(const Node* node, u32 input_index);
+  const Channel* FindChannel(const Node* node, u32 input_index) const;
+
+  StreamGraph* m_streamgraph;
+  std::unordered_map<const Node*, std::vector<Channel>> m_channels;
+  std::unordered_map<const Node*, RoundrobinState> m_roundrobin_states;
+  std::unordered_map<const Node*, u32> m_firings;
+
+  // Index of the join input each node feeds, for nodes which are the last in a splitjoin branch.
+  std::unordered_map<const Node*, u32> m_join_input_index;
+
+  bool m_pull_joins = false;
+  bool m_valid = false;
+  u32 m_underflows = 0;
+};
+
+} // namespace StreamGraph
@@ -0,0 +1,151 @@
+#include "streamgraph/flat_graph.h"
+#include <cassert>
+
+namespace StreamGraph
+{
+namespace
+{
+struct NodeEdge
+{
+  Node* src;
+  Node* dst;
+  u32 push;
+  u32 pop;
+  u32 input_index;
+};
+
+// Flattens the hierarchy into leaf nodes and the channels between them. Each visit leaves the first and last leaf
+// of the stream in first/last, which is where its parent connects.
+struct FlattenVisitor : Visitor
+{
+  NodeList nodes;
+  std::vector<NodeEdge> edges;
+  Node* first = nullptr;
+  Node* last = nullptr;
+
+  bool Visit(Filter* node) override
+  {
+    nodes.push_back(node);
+    first = node;
+    last = node;
+    return true;
+  }
+
+  bool Visit(Pipeline* node) override
+  {
+    Node* pipeline_first = nullptr;
+    Node* pipeline_last = nullptr;
+    for (Node* child : node->GetChildren())
+    {
+      child->Accept(this);
+      if (pipeline_last)
+        edges.push_back({pipeline_last, first, pipeline_last->GetPushRate(), first->GetPopRate(), 0});
+      else
+        pipeline_first = first;
+      pipeline_last = last;
+    }
+
+    first = pipeline_first;
+    last = pipeline_last;
+    return true;
+  }
+
+  bool Visit(SplitJoin* node) override
+  {
+    // Roundrobin splits and joins move distribution[i] tokens per firing on branch i. Duplicate splits have a
+    // distribution of all ones.
+    Split* split = node->GetSplitNode();
+    Join* join = node->GetJoinNode();
+    nodes.push_back(split);
+
+    const NodeList& children = node->GetChildren();
+    for (size_t i = 0; i < children.size(); i++)
+    {
+      children[i]->Accept(this);
+      edges.push_back({split, first, u32(split->GetDistribution().at(i)), first->GetPopRate(), 0});
+      edges.push_back({last, join, last->GetPushRate(), u32(join->GetDistribution().at(i)), u32(i)});
+    }
+
+    // An empty splitjoin passes its input straight through.
+    if (children.empty())
+      edges.push_back({split, join, 1, 1, 0});
+
+    nodes.push_back(join);
+    first = split;
+    last = join;
+    return true;
+  }
+};
+}
+
+const FlatGraph::NodeID FlatGraph::INVALID_NODE_ID;
+
+// Counting sort of the edges by one endpoint, which keeps the order edges were found in within each node.
+static void BuildCSR(const std::vector<FlatGraph::Edge>& edges, u32 num_nodes, bool by_src,
+                     std::vector<FlatGraph::Edge>* sorted_edges, std::vector<u32>* offsets)
+{
+  offsets->assign(num_nodes + 1, 0);
+  for (const FlatGraph::Edge& edge : edges)
+    (*offsets)[(by_src ? edge.src : edge.dst) + 1]++;
+  for (u32 i = 0; i < num_nodes; i++)
+    (*offsets)[i + 1] += (*offsets)[i];
+
+  std::vector<u32> positions(offsets->begin(), offsets->end() - 1);
+  sorted_edges->resize(edges.size());
+  for (const FlatGraph::Edge& edge : edges)
+    (*sorted_edges)[positions[by_src ? edge.src : edge.dst]++] = edge;
+}
+
+FlatGraph::FlatGraph(Node* root)
+{
+  FlattenVisitor flatten;
+  root->Accept(&flatten);
+
+  m_nodes = std::move(flatten.nodes);
+  m_node_ids.reserve(m_nodes.size());
+  for (NodeID id = 0; id < GetNodeCount(); id++)
+  {
+    Node* node = m_nodes[id];
+    m_node_ids.emplace(node, id);
+
+    Filter* filter = dynamic_cast<Filter*>(node);
+    if (filter)
+    {
+      m_filters.push_back(filter);
+      m_filter_nodes.push_back(node);
+      m_filters_and_joins.push_back(node);
+    }
+    else if (dynamic_cast<Join*>(node))
+    {
+      m_filters_and_joins.push_back(node);
+    }
+  }
+
+  std::vector<Edge> edges;
+  edges.reserve(flatten.edges.size());
+  for (const NodeEdge& edge : flatten.edges)
+    edges.push_back({GetNodeID(edge.src), GetNodeID(edge.dst), edge.push, edge.pop, edge.input_index});
+
+  BuildCSR(edges, GetNodeCount(), true, &m_output_edges, &m_output_offsets);
+  BuildCSR(edges, GetNodeCount(), false, &m_input_edges, &m_input_offsets);
+}
+
+FlatGraph::NodeID FlatGraph::GetNodeID(const Node* node) const
+{
+  auto iter = m_node_ids.find(node);
+  return (iter != m_node_ids.end()) ? iter->second : INVALID_NODE_ID;
+}
+
+FlatGraph::EdgeRange FlatGraph::GetInputEdges(NodeID id) const
+{
+  assert(id < GetNodeCount());
+  return EdgeRange(m_input_edges.data() + m_input_offsets[id], m_input_edges.data() + m_input_offsets[id + 1]);
+}
+
+FlatGraph::EdgeRange FlatGraph::GetOutputEdges(NodeID id) const
+{
+  assert(id < GetNodeCount());
+  return EdgeRange(m_output_edges.data() + m_output_offsets[id], m_output_edges.data() + m_output_offsets[id + 1]);
+}
+
+} // namespace StreamGraph
@@ -0,0 +1,84 @@
+#pragma once
+#include <unordered_map>
+#include <vector>
+#include "common/types.h"
+#include "streamgraph/streamgraph.h"
+
+namespace StreamGraph
+{
+// Index-based view of the leaf nodes (filters, splits and joins) of a stream graph and the channels between them.
+// Nodes are numbered in stream order: a split comes before its branches, and a join after them, so every node is
+// numbered after the nodes which feed it. Channels are stored twice, grouped by producer and by consumer, so both
+// the outputs and inputs of a node are one contiguous range.
+// Built from the node tree, so it has to be rebuilt whenever the structure or rates of the tree change.
+class FlatGraph
+{
+public:
+  using NodeID = u32;
+  static const NodeID INVALID_NODE_ID = 0xFFFFFFFFu;
+
+  struct Edge
+  {
+    NodeID src;
+    NodeID dst;
+    u32 push;
+    u32 pop;
+
+    // Input of dst the channel feeds, the branch index for joins, otherwise zero.
+    u32 input_index;
+  };
+
+  class EdgeRange
+  {
+  public:
+    EdgeRange(const Edge* begin, const Edge* end) : m_begin(begin), m_end(end) {}
+
+    const Edge* begin() const { return m_begin; }
+    const Edge* end() const { return m_end; }
+    u32 size() const { return u32(m_end - m_begin); }
+    bool empty() const { return (m_begin == m_end); }
+
+  private:
+    const Edge* m_begin;
+    const Edge* m_end;
+  };
+
+  FlatGraph(Node* root);
+  ~FlatGraph() = default;
+
+  u32 GetNodeCount() const { return u32(m_nodes.size()); }
+  Node* GetNode(NodeID id) const { return m_nodes[id]; }
+  const NodeList& GetNodes() const { return m_nodes; }
+
+  // INVALID_NODE_ID if the node is not a leaf of this graph, e.g. a pipeline or a fused member.
+  NodeID GetNodeID(const Node* node) const;
+
+  u32 GetEdgeCount() const { return u32(m_output_edges.size()); }
+  EdgeRange GetInputEdges(NodeID id) const;
+  EdgeRange GetOutputEdges(NodeID id) const;
+
+  // Filters in stream order.
+  const std::vector<Filter*>& GetFilters() const { return m_filters; }
+
+  // Nodes which are fired by a schedule in stream order: filters, and joins too when they are pull-driven.
+  const NodeList& GetFilterList(bool include_joins) const
+  {
+    return include_joins ? m_filters_and_joins : m_filter_nodes;
+  }
+
+private:
+  NodeList m_nodes;
+  std::unordered_map<const Node*, NodeID> m_node_ids;
+
+  // Edges grouped by src and by dst. The edges of node i are [offsets[i], offsets[i + 1]).
+  std::vector<Edge> m_output_edges;
+  std::vector<Edge> m_input_edges;
+  std::vector<u32> m_output_offsets;
+  std::vector<u32> m_input_offsets;
+
+  std::vector<Filter*> m_filters;
+  NodeList m_filter_nodes;
+  NodeList m_filters_and_joins;
+};
+
+} // namespace StreamGraph
@@ -0,0 +1,135 @@
+#include "streamgraph/schedule.h"
+#include <algorithm>
+#include "common/log.h"
+#include "streamgraph/buffer_size_analysis.h"
+Log_SetChannel(StreamGraph::Schedule);
+
+namespace StreamGraph
+{
+Schedule BuildInitSchedule(const NodeList& filter_list)
+{
+  Schedule schedule;
+  for (Node* node : filter_list)
+  {
+    if (node->GetInitFirings() > 0)
+      schedule.push_back({node, node->GetInitFirings()});
+  }
+
+  return schedule;
+}
+
+Schedule BuildSteadyStateSchedule(const NodeList& filter_list)
+{
+  Schedule schedule;
+  for (Node* node : filter_list)
+    schedule.push_back({node, node->GetMultiplicity()});
+
+  return schedule;
+}
+
+// Joins are only in the list when they are pull-driven.
+static bool HasJoins(const NodeList& filter_list)
+{
+  return std::any_of(filter_list.begin(), filter_list.end(),
+                     [](const Node* node) { return dynamic_cast<const Join*>(node) != nullptr; });
+}
+
+// Each phase is a separate call site, so back to back firings of the same node share one.
+static void AddFirings(Schedule& schedule, Node* node, u32 firings)
+{
+  if (firings == 0)
+    return;
+
+  if (!schedule.empty() && schedule.back().node == node)
+    schedule.back().firings += firings;
+  else
+    schedule.push_back({node, firings});
+}
+
+// One phase per firing of the busiest node gives the lowest latency, but every phase is a call site per node, so
+// limit the count. Push schedules are held to the same number of call sites.
+static const u32 MAX_PHASES = 64;
+
+Schedule BuildPushSchedule(StreamGraph* streamgraph, const NodeList& filter_list)
+{
+  BufferSizeAnalysis simulation(streamgraph);
+  simulation.RunInit(BuildInitSchedule(filter_list), HasJoins(filter_list));
+
+  std::vector<u32> remaining;
+  for (Node* node : filter_list)
+    remaining.push_back(node->GetMultiplicity());
+
+  // The list is in stream order, so nothing later in it feeds anything earlier.
+  Schedule schedule;
+  for (;;)
+  {
+    size_t index = filter_list.size();
+    while (index > 0 && (remaining[index - 1] == 0 || !simulation.CanFire(filter_list[index - 1])))
+      index--;
+
+    if (index == 0)
+      break;
+
+    Node* node = filter_list[index - 1];
+    simulation.Fire(node);
+    remaining[index - 1]--;
+    AddFirings(schedule, node, 1);
+
+    // Nodes which take turns get a call site per firing, which grows with the multiplicities.
+    if (schedule.size() > filter_list.size() * MAX_PHASES)
+    {
+      Log_WarningPrintf("Push schedule exceeds %u call sites, using the phased schedule",
+                        unsigned(filter_list.size() * MAX_PHASES));
+      return BuildPhasedSchedule(streamgraph, filter_list);
+    }
+  }
+
+  if (std::any_of(remaining.begin(), remaining.end(), [](u32 count) { return count > 0; }))
+  {
+    Log_WarningPrintf("Push schedule stalled with firings left, using the single appearance schedule");
+    return BuildSteadyStateSchedule(filter_list);
+  }
+
+  return schedule;
+}
+
+Schedule BuildPhasedSchedule(StreamGraph* streamgraph, const NodeList& filter_list)
+{
+  u32 num_phases = 1;
+  for (Node* node : filter_list)
+    num_phases = std::max(num_phases, node->GetMultiplicity());
+  num_phases = std::min(num_phases, MAX_PHASES);
+
+  BufferSizeAnalysis simulation(streamgraph);
+  simulation.RunInit(BuildInitSchedule(filter_list), HasJoins(filter_list));
+
+  std::vector<u32> fired(filter_list.size(), 0);
+  Schedule schedule;
+  for (u32 phase = 0; phase < num_phases; phase++)
+  {
+    bool last_phase = (phase == num_phases - 1);
+    for (size_t i = 0; i < filter_list.size(); i++)
+    {
+      // Firings due by the end of this phase, rounded up so every node with work fires in the first.
+      Node* node = filter_list[i];
+      u64 multiplicity = node->GetMultiplicity();
+      u32 target = u32((multiplicity * (phase + 1) + num_phases - 1) / num_phases);
+
+      // Everything upstream has finished by the last phase, so its firings have at least the input they would have
+      // in the single appearance schedule.
+      u32 firings = 0;
+      while (fired[i] < target && (last_phase || simulation.CanFire(node)))
+      {
+        simulation.Fire(node);
+        fired[i]++;
+        firings++;
+      }
+
+      AddFirings(schedule, node, firings);
+    }
+  }
+
+  return schedule;
+}
+
+} // namespace StreamGraph
@@ -0,0 +1,35 @@
+#pragma once
+#include <vector>
+#include "common/types.h"
+#include "streamgraph/streamgraph.h"
+
+namespace StreamGraph
+{
+// One step of a schedule, firing a node's work function a number of times back to back.
+struct SchedulePhase
+{
+  Node* node;
+  u32 firings;
+};
+using Schedule = std::vector<SchedulePhase>;
+
+// Schedules fire the nodes of FlatGraph::GetFilterList, which is in stream order, so every node comes after the nodes
+// which feed it. Joins are only included when they are pull-driven, otherwise they forward tokens as they arrive.
+
+// Each node runs its init firings in list order, which leaves the channels ready for the steady state.
+Schedule BuildInitSchedule(const NodeList& filter_list);
+
+// Each node runs its multiplicity in list order.
+Schedule BuildSteadyStateSchedule(const NodeList& filter_list);
+
+// Demand-driven: each firing goes to the node furthest downstream which has input for it, so tokens are pushed
+// through to the output before more are produced. Keeps channels close to what the init schedule leaves in them.
+// Falls back to the phased schedule when nodes take turns so often that it would need more call sites.
+Schedule BuildPushSchedule(StreamGraph* streamgraph, const NodeList& filter_list);
+
+// Minimal latency: the steady state is split into phases, each firing every node its share of its multiplicity in
+// list order, so output appears after the first phase instead of at the end. Firings a node lacks input for carry
+// over to the next phase.
+Schedule BuildPhasedSchedule(StreamGraph* streamgraph, const NodeList& filter_list);
+
+} // namespace StreamGraph
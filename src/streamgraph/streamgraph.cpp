@@ -6,6 +6,7 @@
 #include "common/log.h"
 #include "common/string_helpers.h"
 #include "parser/ast.h"
+#include "streamgraph/flat_graph.h"
 #include "streamgraph/streamgraph_builder.h"
 Log_SetChannel(StreamGraph);
 
@@ -29,45 +30,15 @@ StreamGraph::~StreamGraph()
   delete m_root_node;
 }
 
-StreamGraph::FilterInstanceList StreamGraph::GetFilterInstanceList() const
+void StreamGraph::BuildFlatGraph()
 {
-  struct TheVisitor : Visitor
-  {
-    FilterInstanceList& m_list;
-
-    TheVisitor(FilterInstanceList& list_) : m_list(list_) {}
-
-    bool Visit(Filter* node) override final
-    {
-      m_list.push_back(node);
-      return true;
-    }
-
-    virtual bool Visit(Pipeline* node) override
-    {
-      for (Node* child : node->GetChildren())
-        child->Accept(this);
-
-      return true;
-    }
-
-    virtual bool Visit(SplitJoin* node) override
-    {
-      for (Node* child : node->GetChildren())
-        child->Accept(this);
-
-      return true;
-    }
-
-    virtual bool Visit(Split* node) override { return true; }
-
-    virtual bool Visit(Join* node) override { return true; }
-  };
+  m_flat_graph = std::make_unique<FlatGraph>(m_root_node);
+}
 
-  FilterInstanceList list;
-  TheVisitor visitor(list);
-  m_root_node->Accept(&visitor);
-  return list;
+const StreamGraph::FilterInstanceList& StreamGraph::GetFilterInstanceList() const
+{
+  assert(m_flat_graph);
+  return m_flat_graph->GetFilters();
 }
 
 llvm::Type* StreamGraph::GetProgramInputType() const
@@ -103,66 +74,16 @@ Node* StreamGraph::GetSinglePredecessor(Node* node) const
 
 NodeList StreamGraph::GetPredecessors(Node* node) const
 {
-  struct TheVisitor : Visitor
-  {
-    Node* search_node;
-    NodeList predecessors;
+  assert(m_flat_graph);
+  FlatGraph::NodeID id = m_flat_graph->GetNodeID(node);
+  if (id == FlatGraph::INVALID_NODE_ID)
+    return {};
 
-    TheVisitor(Node* search_node_) : search_node(search_node_) {}
-
-    bool Visit(Filter* node) override final
-    {
-      if (node->GetOutputConnection() == search_node)
-        predecessors.push_back(node);
+  NodeList predecessors;
+  for (const FlatGraph::Edge& edge : m_flat_graph->GetInputEdges(id))
+    predecessors.push_back(m_flat_graph->GetNode(edge.src));
 
-      return true;
-    }
-
-    bool Visit(Pipeline* node) override
-    {
-      for (Node* child : node->GetChildren())
-        child->Accept(this);
-
-      return true;
-    }
-
-    bool Visit(SplitJoin* node) override
-    {
-      node->GetSplitNode()->Accept(this);
-
-      for (Node* child : node->GetChildren())
-        child->Accept(this);
-
-      node->GetJoinNode()->Accept(this);
-      return true;
-    }
-
-    bool Visit(Split* node) override
-    {
-      for (Node* split_output : node->GetOutputs())
-      {
-        if (split_output == search_node)
-        {
-          predecessors.push_back(node);
-          break;
-        }
-      }
-
-      return true;
-    }
-
-    bool Visit(Join* node) override
-    {
-      if (node->GetOutputConnection() == search_node)
-        predecessors.push_back(node);
-
-      return true;
-    }
-  };
-
-  TheVisitor visitor(node);
-  m_root_node->Accept(&visitor);
-  return visitor.predecessors;
+  return predecessors;
 }
 
 void StreamGraph::WidenInput()
@@ -204,9 +125,13 @@ void StreamGraph::WidenChannels()
   m_root_node->WidenChannels();
 
   // Create new filter instances for those which are widened.
-  FilterInstanceList filters = GetFilterInstanceList();
+  const FilterInstanceList& filters = GetFilterInstanceList();
   for (Filter* filter : filters)
   {
+    // Fusion runs after widening, but don't trip over fused filters regardless.
+    if (filter->IsFused())
+      continue;
+
     if (filter->GetInputChannelWidth() != filter->GetFilterPermutation()->GetInputChannelWidth() ||
         filter->GetOutputChannelWidth() != filter->GetFilterPermutation()->GetOutputChannelWidth())
     {
@@ -233,6 +158,8 @@ void StreamGraph::WidenChannels()
                               existing_perm->GetInputType(), existing_perm->GetOutputType(),
                               existing_perm->GetPeekRate(), existing_perm->GetPopRate(), existing_perm->GetPushRate(),
                               filter->GetInputChannelWidth(), filter->GetOutputChannelWidth());
+      new_perm->SetPreworkRates(existing_perm->GetPreworkPeekRate(), existing_perm->GetPreworkPopRate(),
+                                existing_perm->GetPreworkPushRate());
       filter->m_filter_permutation = new_perm;
       m_filter_permutations.push_back(new_perm);
       Log_DevPrintf("Created new permutation of %s with i/o channel widths (%u/%u) -> %s",
@@ -257,6 +184,9 @@ void StreamGraph::WidenChannels()
       i++;
     }
   }
+
+  // Channel rates have changed.
+  BuildFlatGraph();
 }
 
 void FilterParameters::AddParameter(const AST::ParameterDeclaration* decl, const void* data, size_t data_len,
@@ -297,6 +227,18 @@ FilterPermutation::FilterPermutation(const std::string& name, const AST::FilterD
 {
 }
 
+bool FilterPermutation::HasPrework() const
+{
+  return m_filter_decl->HasPreworkBlock();
+}
+
+void FilterPermutation::SetPreworkRates(int peek_rate, int pop_rate, int push_rate)
+{
+  m_prework_peek_rate = peek_rate;
+  m_prework_pop_rate = pop_rate;
+  m_prework_push_rate = push_rate;
+}
+
 bool FilterPermutation::IsBuiltin() const
 {
   return m_filter_decl->IsBuiltin();
@@ -316,6 +258,21 @@ Filter::Filter(const std::string& instance_name, const FilterPermutation* filter
   m_push_rate = static_cast<u32>(m_filter_permutation->GetPushRate());
 }
 
+Filter::Filter(const std::string& name, llvm::Type* input_type, llvm::Type* output_type)
+  : Node(name, input_type, output_type), m_filter_permutation(nullptr), m_input_channel_width(1),
+    m_output_channel_width(1)
+{
+}
+
+Filter::~Filter()
+{
+  for (const FusedMember& member : m_fused_members)
+    delete member.filter;
+
+  delete m_fused_split;
+  delete m_fused_join;
+}
+
 bool Filter::Accept(Visitor* visitor)
 {
   return visitor->Visit(this);
@@ -350,15 +307,6 @@ std::string Filter::GetInputChannelName()
   return m_name;
 }
 
-void Filter::SteadySchedule()
-{
-}
-
-void Filter::AddMultiplicity(u32 count)
-{
-  m_multiplicity *= count;
-}
-
 void Filter::SetInputChannelWidth(u32 width)
 {
   m_input_channel_width = width;
@@ -466,47 +414,6 @@ std::string Pipeline::GetInputChannelName()
   return m_children.front()->GetInputChannelName();
 }
 
-void Pipeline::SteadySchedule()
-{
-  for (Node* child : m_children)
-    child->SteadySchedule();
-
-  Node* prev_child = m_children.front();
-  for (size_t i = 1; i < m_children.size(); i++)
-  {
-    Node* child = m_children[i];
-    u32 prev_send = prev_child->GetNetPush();
-    u32 next_recv = std::max(child->GetNetPeek(), child->GetNetPop());
-    if (prev_send != next_recv)
-    {
-      u32 gcd1 = gcd(prev_send, next_recv);
-      prev_send /= gcd1;
-      next_recv /= gcd1;
-
-      // Multiply previous children output to handle the new request size
-      for (size_t j = 0; j < i; j++)
-        m_children[j]->AddMultiplicity(next_recv);
-
-      child->AddMultiplicity(prev_send);
-    }
-
-    prev_child = child;
-  }
-
-  Node* first_child = m_children.front();
-  Node* last_child = m_children.back();
-  m_peek_rate = first_child->GetNetPeek();
-  m_pop_rate = first_child->GetNetPop();
-  m_push_rate = last_child->GetNetPush();
-}
-
-void Pipeline::AddMultiplicity(u32 count)
-{
-  m_multiplicity *= count;
-  for (Node* child : m_children)
-    child->AddMultiplicity(count);
-}
-
 void Pipeline::SetInputChannelWidth(u32 width)
 {
   assert(0 && "should not be called");
@@ -545,65 +452,6 @@ std::string SplitJoin::GetInputChannelName()
   return m_split_node->GetInputChannelName();
 }
 
-void SplitJoin::SteadySchedule()
-{
-  const Node* child_parent = m_split_node;
-  for (Node* child : m_children)
-    child->SteadySchedule();
-
-  // TODO: Fix this up for roundrobin without even distribution
-  Node* prev_child = m_children.front();
-  for (size_t i = 0; i < m_children.size(); i++)
-  {
-    Node* next = m_children[i];
-    u32 prev_send = m_split_node->GetNetPush() * u32(m_split_node->GetDistribution().at(i));
-    u32 next_recv = std::max(next->GetNetPeek(), next->GetNetPop());
-    if (prev_send != next_recv)
-    {
-      u32 gcd1 = gcd(prev_send, next_recv);
-      prev_send /= gcd1;
-      next_recv /= gcd1;
-
-      // Multiply previous children output to handle the new request size
-      m_split_node->AddMultiplicity(next_recv);
-      for (size_t j = 0; j < i; j++)
-        m_children[j]->AddMultiplicity(next_recv);
-      next->AddMultiplicity(prev_send);
-    }
-  }
-
-  // the join one is the one that determines how many times it needs to run, really...
-  // TODO: Matching against the first will break with variable distributions...
-  Node* first_child = m_children.front();
-  u32 prev_send = first_child->GetNetPush();
-  u32 next_recv = m_join_node->GetNetPop() * u32(m_join_node->GetDistribution().at(0));
-  if (prev_send != next_recv)
-  {
-    u32 gcd1 = gcd(prev_send, next_recv);
-    prev_send /= gcd1;
-    next_recv /= gcd1;
-
-    // Multiply previous children output to handle the new request size
-    m_split_node->AddMultiplicity(next_recv);
-    for (Node* child : m_children)
-      child->AddMultiplicity(next_recv);
-    m_join_node->AddMultiplicity(prev_send);
-  }
-
-  m_peek_rate = m_split_node->GetNetPeek();
-  m_pop_rate = m_split_node->GetNetPop();
-  m_push_rate = m_join_node->GetNetPush();
-}
-
-void SplitJoin::AddMultiplicity(u32 count)
-{
-  m_multiplicity *= count;
-  m_split_node->AddMultiplicity(count);
-  m_join_node->AddMultiplicity(count);
-  for (Node* child : m_children)
-    child->AddMultiplicity(count);
-}
-
 bool SplitJoin::AddChild(BuilderState* state, Node* node)
 {
   if (IsStream(node))
@@ -843,16 +691,6 @@ std::string Split::GetInputChannelName()
   return m_name;
 }
 
-void Split::SteadySchedule()
-{
-  assert(0 && "Should not be called");
-}
-
-void Split::AddMultiplicity(u32 count)
-{
-  m_multiplicity *= count;
-}
-
 void Split::SetDataType(llvm::Type* type)
 {
   m_input_type = type;
@@ -966,16 +804,6 @@ bool Join::Validate(BuilderState* state)
   return true;
 }
 
-void Join::SteadySchedule()
-{
-  assert(0 && "Should not be called");
-}
-
-void Join::AddMultiplicity(u32 count)
-{
-  m_multiplicity *= count;
-}
-
 void Join::SetInputChannelWidth(u32 width)
 {
   assert(0 && "should not be called");
@@ -27,6 +27,7 @@ namespace StreamGraph
 {
 class BuilderState;
 class FilterPermutation;
+class FlatGraph;
 class Node;
 class Filter;
 class Pipeline;
@@ -49,8 +50,12 @@ public:
   Node* GetRootNode() const { return m_root_node; }
   std::string Dump();
 
+  // Flat, indexed view of the graph. Built by SteadySchedule and rebuilt by passes which change the graph, so it is
+  // only valid after the first SteadySchedule.
+  const FlatGraph* GetFlatGraph() const { return m_flat_graph.get(); }
+
   // Get a list of all filter instances in the graph
-  FilterInstanceList GetFilterInstanceList() const;
+  const FilterInstanceList& GetFilterInstanceList() const;
 
   // Get a list of all unique filter (parameter permutations) in the graph
   const FilterPermutationList& GetFilterPermutationList() const { return m_filter_permutations; }
@@ -69,17 +74,54 @@ public:
   Node* GetSinglePredecessor(Node* node) const;
   NodeList GetPredecessors(Node* node) const;
 
+  // Solves the balance equations of the whole graph for the smallest number of firings of each filter, split and
+  // join per steady state, which leaves every channel as it found it. Also computes the fewest firings before the
+  // first steady state that leave each filter its peek window beyond what it pops, and run prework. Returns false if
+  // the rates are inconsistent, or either schedule doesn't fit in 32 bits.
+  bool SteadySchedule();
+
+  // Multiplies the firings of every node in the steady state by factor, so each steady state moves factor times as
+  // many tokens. Returns false, leaving the steady state unchanged, if it would no longer fit in 32 bits.
+  bool ScaleSteadyState(u32 factor);
+
+  // Largest factor ScaleSteadyState accepts.
+  u32 GetMaxSteadyStateScale() const;
+
   // Widens channels where possible.
   void WidenChannels();
 
+  // Fuses chains of pipeline filters, and splitjoins of single filters, into fused filters of at most max_filters
+  // members. Multiplicities are recomputed afterwards. Returns false if the fused graph can't be scheduled, which
+  // leaves it unusable.
+  bool FuseFilters(u32 max_filters);
+
+  // Replicates stateless filters which cost more than 1/max_ways of the graph behind a roundrobin split and join,
+  // so the replicas can run in parallel, as many as evenly divide the filter's multiplicity. Multiplicities are
+  // recomputed afterwards. Returns false if the new graph can't be scheduled, which leaves it unusable.
+  bool FissionFilters(u32 max_ways);
+
 private:
+  void BuildFlatGraph();
   void WidenInput();
   void WidenOutput();
 
+  // Fusion helpers, in streamgraph_fusion.cpp.
+  u32 FusePipeline(Pipeline* pipeline, u32 max_filters);
+  Filter* FuseSplitJoin(SplitJoin* splitjoin, u32 max_filters);
+  void ReplaceConnections(Node* old_node, Node* new_node);
+
+  // Fission helpers, in streamgraph_fission.cpp.
+  SplitJoin* FissionFilter(Filter* filter, u32 ways);
+
+  // Steady state helpers, in streamgraph_steady_state.cpp.
+  // Pipelines and splitjoins fire once per steady state, with the net rates of their first and last leaves.
+  void UpdateCompositeRates();
+
   Node* m_root_node;
   FilterPermutationList m_filter_permutations;
   Node* m_program_input_node;
   Node* m_program_output_node;
+  std::unique_ptr<FlatGraph> m_flat_graph;
 };
 
 std::unique_ptr<StreamGraph> BuildStreamGraph(Frontend::WrappedLLVMContext* context, ParserState* parser);
@@ -141,6 +183,13 @@ public:
   u32 GetInputChannelWidth() const { return m_input_channel_width; }
   u32 GetOutputChannelWidth() const { return m_output_channel_width; }
 
+  // Rates of the prework function, which replaces work for the first firing. Zero when there is no prework.
+  bool HasPrework() const;
+  int GetPreworkPeekRate() const { return m_prework_peek_rate; }
+  int GetPreworkPopRate() const { return m_prework_pop_rate; }
+  int GetPreworkPushRate() const { return m_prework_push_rate; }
+  void SetPreworkRates(int peek_rate, int pop_rate, int push_rate);
+
   bool IsBuiltin() const;
   bool IsCombinational() const { return m_combinational; }
   void SetCombinational() { m_combinational = true; }
@@ -154,6 +203,9 @@ private:
   int m_peek_rate;
   int m_pop_rate;
   int m_push_rate;
+  int m_prework_peek_rate = 0;
+  int m_prework_pop_rate = 0;
+  int m_prework_push_rate = 0;
   u32 m_input_channel_width;
   u32 m_output_channel_width;
   bool m_combinational = false;
@@ -178,6 +230,9 @@ public:
   u32 GetNetPush() const { return m_push_rate * m_multiplicity; }
   u32 GetMultiplicity() const { return m_multiplicity; }
 
+  // Firings before the first steady state, which fill the peek windows downstream and run prework.
+  u32 GetInitFirings() const { return m_init_firings; }
+
   virtual bool Accept(Visitor* visitor) = 0;
   virtual bool AddChild(BuilderState* state, Node* child) = 0;
   virtual bool Validate(BuilderState* state) = 0;
@@ -189,10 +244,6 @@ public:
   virtual Node* GetInputNode() = 0;
   virtual std::string GetInputChannelName() = 0;
 
-  // Schedule for steady state
-  virtual void SteadySchedule() = 0;
-  virtual void AddMultiplicity(u32 count) = 0;
-
   // Channel widening
   virtual void SetInputChannelWidth(u32 width) = 0;
   virtual void WidenChannels() = 0;
@@ -205,6 +256,7 @@ protected:
   u32 m_pop_rate = 0;
   u32 m_push_rate = 0;
   u32 m_multiplicity = 1;
+  u32 m_init_firings = 0;
 };
 
 class Filter : public Node
@@ -212,10 +264,26 @@ class Filter : public Node
   friend StreamGraph;
 
 public:
+  // A member of a fused filter, and the number of times it fires per firing of the fused filter.
+  struct FusedMember
+  {
+    Filter* filter;
+    u32 firings;
+  };
+  using FusedMemberList = std::vector<FusedMember>;
+
   Filter(const std::string& instance_name, const FilterPermutation* filter);
-  ~Filter() = default;
+  ~Filter();
 
+  // Fused filters have no permutation of their own. Members are either a chain, each feeding the next, or the
+  // branches of a splitjoin, between the fused split and join. The fused filter owns the members, split and join.
   const FilterPermutation* GetFilterPermutation() const { return m_filter_permutation; }
+  bool IsFused() const { return !m_fused_members.empty(); }
+  const FusedMemberList& GetFusedMembers() const { return m_fused_members; }
+  Split* GetFusedSplit() const { return m_fused_split; }
+  Join* GetFusedJoin() const { return m_fused_join; }
+  u32 GetFusedSplitFirings() const { return m_fused_split_firings; }
+  u32 GetFusedJoinFirings() const { return m_fused_join_firings; }
   bool HasOutputConnection() const { return (m_output_connection != nullptr); }
   Node* GetOutputConnection() const { return m_output_connection; }
   const std::string& GetOutputChannelName() const { return m_output_channel_name; }
@@ -230,22 +298,29 @@ public:
   Node* GetInputNode() override;
   std::string GetInputChannelName() override;
 
-  void SteadySchedule() override;
-  void AddMultiplicity(u32 count) override;
-
   void SetInputChannelWidth(u32 width) override;
   void WidenChannels() override;
 
 protected:
+  Filter(const std::string& name, llvm::Type* input_type, llvm::Type* output_type);
+
   const FilterPermutation* m_filter_permutation;
   Node* m_output_connection = nullptr;
   std::string m_output_channel_name;
   u32 m_input_channel_width;
   u32 m_output_channel_width;
+
+  FusedMemberList m_fused_members;
+  Split* m_fused_split = nullptr;
+  Join* m_fused_join = nullptr;
+  u32 m_fused_split_firings = 0;
+  u32 m_fused_join_firings = 0;
 };
 
 class Pipeline : public Node
 {
+  friend StreamGraph;
+
 public:
   Pipeline(const std::string& name);
   ~Pipeline() = default;
@@ -260,9 +335,6 @@ public:
   Node* GetInputNode() override;
   std::string GetInputChannelName() override;
 
-  void SteadySchedule() override;
-  void AddMultiplicity(u32 count) override;
-
   void SetInputChannelWidth(u32 width) override;
   void WidenChannels() override;
 
@@ -272,6 +344,8 @@ protected:
 
 class SplitJoin : public Node
 {
+  friend StreamGraph;
+
 public:
   SplitJoin(const std::string& name);
   ~SplitJoin() = default;
@@ -290,9 +364,6 @@ public:
   Node* GetInputNode() override;
   std::string GetInputChannelName() override;
 
-  void SteadySchedule() override;
-  void AddMultiplicity(u32 count) override;
-
   void SetInputChannelWidth(u32 width) override;
   void WidenChannels() override;
 
@@ -306,6 +377,7 @@ protected:
 class Split : public Node
 {
 public:
+  friend StreamGraph;
   friend SplitJoin;
   enum class Mode
   {
@@ -334,9 +406,6 @@ public:
   Node* GetInputNode() override;
   std::string GetInputChannelName() override;
 
-  void SteadySchedule() override;
-  void AddMultiplicity(u32 count) override;
-
   void SetInputChannelWidth(u32 width) override;
   void WidenChannels() override;
 
@@ -351,6 +420,7 @@ private:
 class Join : public Node
 {
 public:
+  friend StreamGraph;
   friend SplitJoin;
   Join(const std::string& name, const std::vector<int>& distribution);
   ~Join() = default;
@@ -375,9 +445,6 @@ public:
   Node* GetInputNode() override;
   std::string GetInputChannelName() override;
 
-  void SteadySchedule() override;
-  void AddMultiplicity(u32 count) override;
-
   void SetInputChannelWidth(u32 width) override;
   void WidenChannels() override;
 
@@ -115,7 +115,9 @@ bool Builder::GenerateStreamGraphFunctions()
   m_module->getOrInsertFunction("StreamGraphBuilder_AddFilter",
                                 llvm::FunctionType::get(m_context->GetVoidType(),
                                                         {m_context->GetPointerType(), m_context->GetIntType(),
-                                                         m_context->GetIntType(), m_context->GetIntType()},
+                                                         m_context->GetIntType(), m_context->GetIntType(),
+                                                         m_context->GetIntType(), m_context->GetIntType(),
+                                                         m_context->GetIntType()},
                                                         true));
   return true;
 }
@@ -242,7 +244,8 @@ void BuilderState::ExtractParameters(FilterParameters* out_params, const AST::St
   }
 }
 
-void BuilderState::AddFilter(const AST::FilterDeclaration* decl, int peek_rate, int pop_rate, int push_rate, va_list ap)
+void BuilderState::AddFilter(const AST::FilterDeclaration* decl, int peek_rate, int pop_rate, int push_rate,
+                             int prework_peek_rate, int prework_pop_rate, int prework_push_rate, va_list ap)
 {
   if (!HasTopNode())
   {
@@ -267,7 +270,8 @@ void BuilderState::AddFilter(const AST::FilterDeclaration* decl, int peek_rate,
     // These should match
     filter_perm = *iter;
     if (filter_perm->GetPeekRate() != peek_rate || filter_perm->GetPopRate() != pop_rate ||
-        filter_perm->GetPushRate() != push_rate)
+        filter_perm->GetPushRate() != push_rate || filter_perm->GetPreworkPeekRate() != prework_peek_rate ||
+        filter_perm->GetPreworkPopRate() != prework_pop_rate || filter_perm->GetPreworkPushRate() != prework_push_rate)
     {
       Error("Internal error, mismatched peek/push/pop rates for filter '%s'", decl->GetName().c_str());
       return;
@@ -279,6 +283,7 @@ void BuilderState::AddFilter(const AST::FilterDeclaration* decl, int peek_rate,
     std::string name = StringFromFormat("%s_%u", decl->GetName().c_str(), unsigned(m_filter_permutations.size() + 1));
     filter_perm = new FilterPermutation(name, decl, filter_params, filter_input_type, filter_output_type, peek_rate,
                                         pop_rate, push_rate, (pop_rate > 0) ? 1 : 0, (push_rate > 0) ? 1 : 0);
+    filter_perm->SetPreworkRates(prework_peek_rate, prework_pop_rate, prework_push_rate);
     m_filter_permutations.push_back(filter_perm);
   }
 
@@ -425,10 +430,13 @@ std::unique_ptr<StreamGraph> BuildStreamGraph(Frontend::WrappedLLVMContext* cont
   if (!builder_state)
     return nullptr;
 
-  builder_state->GetStartNode()->SteadySchedule();
+  auto streamgraph =
+    std::make_unique<StreamGraph>(builder_state->GetStartNode(), builder_state->GetFilterPermutations(),
+                                  builder_state->GetProgramInputNode(), builder_state->GetProgramOutputNode());
+  if (!streamgraph->SteadySchedule())
+    return nullptr;
 
-  return std::make_unique<StreamGraph>(builder_state->GetStartNode(), builder_state->GetFilterPermutations(),
-                                       builder_state->GetProgramInputNode(), builder_state->GetProgramOutputNode());
+  return streamgraph;
 }
 
 } // namespace Frontend
@@ -500,14 +508,16 @@ EXPORT void StreamGraphBuilder_Join(int num_args, ...)
   s_builder_state->SplitJoinJoin(distribution);
 }
 EXPORT void StreamGraphBuilder_AddFilter(const AST::FilterDeclaration* filter, int peek_rate, int pop_rate,
-                                         int push_rate, ...)
+                                         int push_rate, int prework_peek_rate, int prework_pop_rate,
+                                         int prework_push_rate, ...)
 {
   // Direct add to current
   va_list ap;
-  va_start(ap, push_rate);
+  va_start(ap, prework_push_rate);
   Log::Debug("StreamGraphBuilder", "StreamGraph AddFilter %s peek=%d pop=%d push=%d", filter->GetName().c_str(),
              peek_rate, pop_rate, push_rate);
-  s_builder_state->AddFilter(filter, peek_rate, pop_rate, push_rate, ap);
+  s_builder_state->AddFilter(filter, peek_rate, pop_rate, push_rate, prework_peek_rate, prework_pop_rate,
+                             prework_push_rate, ap);
   va_end(ap);
 }
 }
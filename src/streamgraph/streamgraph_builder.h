@@ -79,7 +79,8 @@ public:
   Node* GetProgramInputNode() const { return m_program_input_node; }
   Node* GetProgramOutputNode() const { return m_program_output_node; }
 
-  void AddFilter(const AST::FilterDeclaration* decl, int peek_rate, int pop_rate, int push_rate, va_list ap);
+  void AddFilter(const AST::FilterDeclaration* decl, int peek_rate, int pop_rate, int push_rate,
+                 int prework_peek_rate, int prework_pop_rate, int prework_push_rate, va_list ap);
   void BeginPipeline(const AST::PipelineDeclaration* decl);
   void EndPipeline();
   void BeginSplitJoin(const AST::SplitJoinDeclaration* decl);
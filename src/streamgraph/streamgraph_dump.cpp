@@ -2,6 +2,7 @@
 #include <cstdarg>
 #include <sstream>
 #include "common/string_helpers.h"
+#include "streamgraph/flat_graph.h"
 #include "streamgraph/streamgraph.h"
 
 namespace StreamGraph
@@ -9,7 +10,7 @@ namespace StreamGraph
 class StreamGraphDumpVisitor : public Visitor
 {
 public:
-  StreamGraphDumpVisitor() = default;
+  StreamGraphDumpVisitor(const FlatGraph* flat_graph) : m_flat_graph(flat_graph) {}
   ~StreamGraphDumpVisitor() = default;
 
   std::string ToString() const { return m_out.str(); }
@@ -25,8 +26,10 @@ public:
   void Indent();
   void Deindent();
   void WriteEdge(const Node* src, const Node* dst);
+  u32 GetNodeID(const Node* node) const;
 
 protected:
+  const FlatGraph* m_flat_graph;
   std::stringstream m_out;
   unsigned int m_indent = 0;
 };
@@ -71,11 +74,18 @@ void StreamGraphDumpVisitor::WriteEdge(const Node* src, const Node* dst)
   WriteLine("%s -> %s;", src->GetName().c_str(), dst->GetName().c_str());
 }
 
+u32 StreamGraphDumpVisitor::GetNodeID(const Node* node) const
+{
+  return m_flat_graph ? m_flat_graph->GetNodeID(node) : FlatGraph::INVALID_NODE_ID;
+}
+
 bool StreamGraphDumpVisitor::Visit(Filter* node)
 {
-  WriteLine("# %s peek %u(%u) pop %u(%u) push %u(%u) mult %u", node->GetName().c_str(), node->GetPeekRate(),
-            node->GetNetPeek(), node->GetPopRate(), node->GetNetPop(), node->GetPushRate(), node->GetNetPush(),
-            node->GetMultiplicity());
+  WriteLine("# %s id %u peek %u(%u) pop %u(%u) push %u(%u) mult %u init %u", node->GetName().c_str(),
+            GetNodeID(node), node->GetPeekRate(), node->GetNetPeek(), node->GetPopRate(), node->GetNetPop(),
+            node->GetPushRate(), node->GetNetPush(), node->GetMultiplicity(), node->GetInitFirings());
+  for (const Filter::FusedMember& member : node->GetFusedMembers())
+    WriteLine("#   fused %s (%u firings)", member.filter->GetName().c_str(), member.firings);
   WriteLine("%s [shape=ellipse];", node->GetName().c_str());
   WriteLine("%s [label=\"%s\\npeek %u(%u) pop %u(%u) push %u(%u)\\nmultiplicity %u\\ninput channel width: %u\\noutput "
             "channel width: %u\"];",
@@ -142,9 +152,9 @@ bool StreamGraphDumpVisitor::Visit(SplitJoin* node)
 
 bool StreamGraphDumpVisitor::Visit(Split* node)
 {
-  WriteLine("# %s peek %u(%u) pop %u(%u) push %u(%u) mult %u", node->GetName().c_str(), node->GetPeekRate(),
-            node->GetNetPeek(), node->GetPopRate(), node->GetNetPop(), node->GetPushRate(), node->GetNetPush(),
-            node->GetMultiplicity());
+  WriteLine("# %s id %u peek %u(%u) pop %u(%u) push %u(%u) mult %u", node->GetName().c_str(), GetNodeID(node),
+            node->GetPeekRate(), node->GetNetPeek(), node->GetPopRate(), node->GetNetPop(), node->GetPushRate(),
+            node->GetNetPush(), node->GetMultiplicity());
 
   std::stringstream distribution_str;
   for (int dist : node->GetDistribution())
@@ -164,9 +174,9 @@ bool StreamGraphDumpVisitor::Visit(Split* node)
 
 bool StreamGraphDumpVisitor::Visit(Join* node)
 {
-  WriteLine("# %s peek %u(%u) pop %u(%u) push %u(%u) mult %u", node->GetName().c_str(), node->GetPeekRate(),
-            node->GetNetPeek(), node->GetPopRate(), node->GetNetPop(), node->GetPushRate(), node->GetNetPush(),
-            node->GetMultiplicity());
+  WriteLine("# %s id %u peek %u(%u) pop %u(%u) push %u(%u) mult %u", node->GetName().c_str(), GetNodeID(node),
+            node->GetPeekRate(), node->GetNetPeek(), node->GetPopRate(), node->GetNetPop(), node->GetPushRate(),
+            node->GetNetPush(), node->GetMultiplicity());
 
   std::stringstream distribution_str;
   for (int dist : node->GetDistribution())
@@ -188,7 +198,7 @@ bool StreamGraphDumpVisitor::Visit(Join* node)
 
 std::string StreamGraph::Dump()
 {
-  StreamGraphDumpVisitor visitor;
+  StreamGraphDumpVisitor visitor(m_flat_graph.get());
   visitor.WriteLine("digraph G {");
   m_root_node->Accept(&visitor);
   visitor.WriteLine("}");
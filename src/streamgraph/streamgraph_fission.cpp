@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <cassert>
+#include "common/log.h"
+#include "common/string_helpers.h"
+#include "parser/ast.h"
+#include "streamgraph/streamgraph.h"
+Log_SetChannel(StreamGraph::Fission);
+
+namespace StreamGraph
+{
+// Estimated cost of a filter per steady state, by the number of tokens it moves.
+static u64 GetFilterCost(const Filter* filter)
+{
+  return u64(filter->GetMultiplicity()) *
+         (1 + u64(std::max(filter->GetPeekRate(), filter->GetPopRate())) + u64(filter->GetPushRate()));
+}
+
+// Replicas of a filter each see every ways'th group of inputs, so the filter can't carry anything between firings,
+// or look at inputs beyond what it pops.
+static bool CanFission(const Filter* filter)
+{
+  const FilterPermutation* perm = filter->GetFilterPermutation();
+  if (!perm || perm->IsBuiltin() || perm->HasPrework() || !perm->GetFilterDeclaration()->IsStateless())
+    return false;
+
+  return (filter->GetPopRate() > 0 && filter->GetPushRate() > 0 && filter->GetPeekRate() <= filter->GetPopRate());
+}
+
+// Picks the number of replicas, a divisor of the multiplicity so the steady state doesn't grow. Returns 1 when there
+// is none, and the filter is left alone.
+static u32 GetFissionWays(const Filter* filter, u32 max_ways)
+{
+  for (u32 ways = std::min(max_ways, filter->GetMultiplicity()); ways > 1; ways--)
+  {
+    if ((filter->GetMultiplicity() % ways) == 0)
+      return ways;
+  }
+
+  Log_DevPrintf("Not splitting %s, multiplicity %u has no divisor up to %u", filter->GetName().c_str(),
+                filter->GetMultiplicity(), max_ways);
+  return 1;
+}
+
+bool StreamGraph::FissionFilters(u32 max_ways)
+{
+  if (max_ways < 2)
+    return true;
+
+  // A filter is a bottleneck if it costs more than a fair share of the graph, split max_ways.
+  u64 total_cost = 0;
+  for (const Filter* filter : GetFilterInstanceList())
+    total_cost += GetFilterCost(filter);
+
+  struct TheVisitor : Visitor
+  {
+    StreamGraph* graph;
+    u32 max_ways;
+    u64 threshold;
+    u32 count = 0;
+
+    TheVisitor(StreamGraph* graph_, u32 max_ways_, u64 threshold_)
+      : graph(graph_), max_ways(max_ways_), threshold(threshold_)
+    {
+    }
+
+    // Returns the splitjoin replacing the filter, or null if it stays as it is.
+    Node* TryFission(Filter* filter)
+    {
+      if (GetFilterCost(filter) <= threshold || !CanFission(filter))
+        return nullptr;
+
+      u32 ways = GetFissionWays(filter, max_ways);
+      if (ways < 2)
+        return nullptr;
+
+      count++;
+      return graph->FissionFilter(filter, ways);
+    }
+
+    void FissionChildren(NodeList& children)
+    {
+      for (size_t i = 0; i < children.size(); i++)
+      {
+        Filter* filter = dynamic_cast<Filter*>(children[i]);
+        if (!filter)
+        {
+          children[i]->Accept(this);
+          continue;
+        }
+
+        Node* replacement = TryFission(filter);
+        if (replacement)
+          children[i] = replacement;
+      }
+    }
+
+    bool Visit(Pipeline* node) override
+    {
+      FissionChildren(node->m_children);
+      return true;
+    }
+
+    bool Visit(SplitJoin* node) override
+    {
+      FissionChildren(node->m_children);
+      return true;
+    }
+  };
+
+  TheVisitor visitor(this, max_ways, total_cost / max_ways);
+  Filter* root_filter = dynamic_cast<Filter*>(m_root_node);
+  if (root_filter)
+  {
+    Node* replacement = visitor.TryFission(root_filter);
+    if (replacement)
+      m_root_node = replacement;
+  }
+  else
+  {
+    m_root_node->Accept(&visitor);
+  }
+
+  Log_InfoPrintf("Split %u filters across replicas", visitor.count);
+  if (visitor.count > 0 && !SteadySchedule())
+  {
+    Log_ErrorPrintf("Failed to schedule the fissioned graph");
+    return false;
+  }
+
+  return true;
+}
+
+SplitJoin* StreamGraph::FissionFilter(Filter* filter, u32 ways)
+{
+  Log_DevPrintf("Splitting %s (multiplicity %u) into %u replicas", filter->GetName().c_str(), filter->GetMultiplicity(),
+                ways);
+
+  // The split takes the name of the filter, which is also the name of the input channel.
+  Split* split = new Split(filter->GetName(), Split::Mode::Roundrobin,
+                           std::vector<int>(ways, int(filter->GetPopRate())));
+  Join* join = new Join(StringFromFormat("%s_fission_join", filter->GetName().c_str()),
+                        std::vector<int>(ways, int(filter->GetPushRate())));
+  split->SetDataType(filter->GetInputType());
+  split->m_pop_rate = filter->GetPopRate() * ways;
+  join->SetDataType(filter->GetOutputType());
+  join->m_push_rate = filter->GetPushRate() * ways;
+  join->m_output_connection = filter->GetOutputConnection();
+  join->m_output_channel_name = filter->GetOutputChannelName();
+
+  SplitJoin* splitjoin = new SplitJoin(StringFromFormat("%s_fission", filter->GetName().c_str()));
+  splitjoin->m_input_type = filter->GetInputType();
+  splitjoin->m_output_type = filter->GetOutputType();
+  splitjoin->m_split_node = split;
+  splitjoin->m_join_node = join;
+  splitjoin->m_output_connection = filter->GetOutputConnection();
+
+  for (u32 i = 0; i < ways; i++)
+  {
+    Filter* replica =
+      new Filter(StringFromFormat("%s_replica%u", filter->GetName().c_str(), i + 1), filter->GetFilterPermutation());
+    split->m_outputs.push_back(replica);
+    split->m_output_channel_names.push_back(replica->GetInputChannelName());
+
+    join->AddIncomingStream();
+    replica->m_output_connection = join;
+    replica->m_output_channel_name = join->GetInputChannelName();
+    splitjoin->m_children.push_back(replica);
+  }
+
+  ReplaceConnections(filter, split);
+  delete filter;
+  return splitjoin;
+}
+
+} // namespace StreamGraph
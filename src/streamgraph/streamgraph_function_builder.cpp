@@ -59,10 +59,19 @@ bool StreamGraphFunctionBuilder::Visit(AST::FilterDeclaration* node)
   if (!peek_rate_val || !pop_rate_val || !push_rate_val)
     return false;
 
+  // Prework rates are zero when there is no prework block.
+  AST::FilterWorkBlock* prework = node->GetPreworkBlock();
+  llvm::Value* prework_peek_rate_val = GetRateValue(this, prework ? prework->GetPeekRateExpression() : nullptr);
+  llvm::Value* prework_pop_rate_val = GetRateValue(this, prework ? prework->GetPopRateExpression() : nullptr);
+  llvm::Value* prework_push_rate_val = GetRateValue(this, prework ? prework->GetPushRateExpression() : nullptr);
+  if (!prework_peek_rate_val || !prework_pop_rate_val || !prework_push_rate_val)
+    return false;
+
   // We're a filter, simply call AddFilter
   llvm::Function* call_func = GetModule()->getFunction("StreamGraphBuilder_AddFilter");
   std::vector<llvm::Value*> call_params = {m_context->CreateHostPointerValue(node), peek_rate_val, pop_rate_val,
-                                           push_rate_val};
+                                           push_rate_val, prework_peek_rate_val, prework_pop_rate_val,
+                                           prework_push_rate_val};
   AddStreamParameterValues(this, node, call_params);
   GetCurrentIRBuilder().CreateCall(call_func, call_params);
   GetCurrentIRBuilder().CreateRetVoid();
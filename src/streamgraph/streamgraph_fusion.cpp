@@ -0,0 +1,307 @@
+#include <algorithm>
+#include <cassert>
+#include "common/log.h"
+#include "common/string_helpers.h"
+#include "streamgraph/streamgraph.h"
+Log_SetChannel(StreamGraph::Fusion);
+
+namespace StreamGraph
+{
+// Local channels between members are allocated on the stack of the fused work function. Keeping them small lets
+// them be promoted to registers, or at worst stay in L1, instead of going through a global ring buffer.
+// This is in tokens per firing of the fused filter.
+static const u32 MAX_LOCAL_CHANNEL_SIZE = 256;
+
+// Members can't peek past what they pop, unless they read from the fused filter's input channel, since local
+// channels are fully drained every firing. Prework and builtins are not supported inside fused filters.
+static bool CanFuse(const Filter* filter, bool allow_peek)
+{
+  const FilterPermutation* perm = filter->GetFilterPermutation();
+  if (!perm || perm->IsBuiltin() || perm->HasPrework())
+    return false;
+
+  if (!allow_peek && filter->GetPeekRate() > filter->GetPopRate())
+    return false;
+
+  return true;
+}
+
+// Returns the filter of a splitjoin branch which is a single filter, or a pipeline of one.
+static Filter* GetBranchFilter(Node* node)
+{
+  Pipeline* pipeline = dynamic_cast<Pipeline*>(node);
+  if (pipeline)
+    return (pipeline->GetChildren().size() == 1) ? GetBranchFilter(pipeline->GetChildren().front()) : nullptr;
+
+  return dynamic_cast<Filter*>(node);
+}
+
+// Deletes the pipelines wrapping a splitjoin branch, once its filter has been taken by a fused filter.
+static void DeleteBranchWrappers(Node* node)
+{
+  Pipeline* pipeline = dynamic_cast<Pipeline*>(node);
+  if (!pipeline)
+    return;
+
+  DeleteBranchWrappers(pipeline->GetChildren().front());
+  delete pipeline;
+}
+
+// Computes the firings of each filter in a chain per firing of the fused filter, from their multiplicities.
+// Returns false if the chain isn't rate-matched, or a local channel would be too large.
+static bool GetChainFirings(const NodeList& nodes, size_t begin, size_t end, std::vector<u32>* firings)
+{
+  u32 divisor = nodes[begin]->GetMultiplicity();
+  for (size_t i = begin + 1; i < end; i++)
+    divisor = gcd(divisor, nodes[i]->GetMultiplicity());
+
+  firings->clear();
+  for (size_t i = begin; i < end; i++)
+    firings->push_back(nodes[i]->GetMultiplicity() / divisor);
+
+  for (size_t i = begin + 1; i < end; i++)
+  {
+    u32 tokens = nodes[i - 1]->GetPushRate() * firings->at(i - 1 - begin);
+    if (tokens == 0 || tokens != nodes[i]->GetPopRate() * firings->at(i - begin) || tokens > MAX_LOCAL_CHANNEL_SIZE)
+      return false;
+  }
+
+  return true;
+}
+
+bool StreamGraph::FuseFilters(u32 max_filters)
+{
+  if (max_filters < 2)
+    return true;
+
+  // Bottom-up, so branches are fused before the splitjoin containing them is considered.
+  struct TheVisitor : Visitor
+  {
+    StreamGraph* graph;
+    u32 max_filters;
+    u32 count = 0;
+
+    TheVisitor(StreamGraph* graph_, u32 max_filters_) : graph(graph_), max_filters(max_filters_) {}
+
+    void FuseChildren(NodeList& children)
+    {
+      for (size_t i = 0; i < children.size(); i++)
+      {
+        children[i]->Accept(this);
+
+        SplitJoin* splitjoin = dynamic_cast<SplitJoin*>(children[i]);
+        Filter* fused = splitjoin ? graph->FuseSplitJoin(splitjoin, max_filters) : nullptr;
+        if (fused)
+        {
+          children[i] = fused;
+          count++;
+        }
+      }
+    }
+
+    bool Visit(Pipeline* node) override
+    {
+      FuseChildren(node->m_children);
+      count += graph->FusePipeline(node, max_filters);
+      return true;
+    }
+
+    bool Visit(SplitJoin* node) override
+    {
+      FuseChildren(node->m_children);
+      return true;
+    }
+  };
+
+  TheVisitor visitor(this, max_filters);
+  m_root_node->Accept(&visitor);
+
+  SplitJoin* root_splitjoin = dynamic_cast<SplitJoin*>(m_root_node);
+  Filter* fused_root = root_splitjoin ? FuseSplitJoin(root_splitjoin, max_filters) : nullptr;
+  if (fused_root)
+  {
+    m_root_node = fused_root;
+    visitor.count++;
+  }
+
+  Log_InfoPrintf("Created %u fused filters", visitor.count);
+  if (visitor.count > 0 && !SteadySchedule())
+  {
+    Log_ErrorPrintf("Failed to schedule the fused graph");
+    return false;
+  }
+
+  return true;
+}
+
+u32 StreamGraph::FusePipeline(Pipeline* pipeline, u32 max_filters)
+{
+  NodeList& children = pipeline->m_children;
+  std::vector<u32> firings;
+  u32 count = 0;
+
+  for (size_t begin = 0; begin < children.size(); begin++)
+  {
+    Filter* first = dynamic_cast<Filter*>(children[begin]);
+    if (!first || !CanFuse(first, true))
+      continue;
+
+    // Grow the chain while the next filter can be fused, and its local channel stays small.
+    size_t end = begin + 1;
+    while (end < children.size() && (end - begin) < max_filters)
+    {
+      Filter* next = dynamic_cast<Filter*>(children[end]);
+      if (!next || !CanFuse(next, false) || !GetChainFirings(children, begin, end + 1, &firings))
+        break;
+
+      end++;
+    }
+    if ((end - begin) < 2)
+      continue;
+
+    GetChainFirings(children, begin, end, &firings);
+    Filter* last = static_cast<Filter*>(children[end - 1]);
+
+    // The fused filter keeps the name of the first, so the input channel name doesn't change.
+    Filter* fused = new Filter(first->GetName(), first->GetInputType(), last->GetOutputType());
+    fused->m_input_channel_width = first->GetInputChannelWidth();
+    fused->m_output_channel_width = last->GetOutputChannelWidth();
+    fused->m_pop_rate = first->GetPopRate() * firings.front();
+    if (first->GetPeekRate() > first->GetPopRate())
+      fused->m_peek_rate = fused->m_pop_rate - first->GetPopRate() + first->GetPeekRate();
+    fused->m_push_rate = last->GetPushRate() * firings.back();
+    fused->m_output_connection = last->GetOutputConnection();
+    fused->m_output_channel_name = last->GetOutputChannelName();
+    for (size_t i = begin; i < end; i++)
+    {
+      Log_DevPrintf("Fusing %s into %s (%u firings)", children[i]->GetName().c_str(), fused->GetName().c_str(),
+                    firings[i - begin]);
+      fused->m_fused_members.push_back({static_cast<Filter*>(children[i]), firings[i - begin]});
+    }
+
+    // The members now belong to the fused filter.
+    ReplaceConnections(first, fused);
+    children.erase(children.begin() + begin, children.begin() + end);
+    children.insert(children.begin() + begin, fused);
+    count++;
+  }
+
+  return count;
+}
+
+Filter* StreamGraph::FuseSplitJoin(SplitJoin* splitjoin, u32 max_filters)
+{
+  Split* split = splitjoin->GetSplitNode();
+  Join* join = splitjoin->GetJoinNode();
+  const NodeList& children = splitjoin->GetChildren();
+  if (children.empty() || children.size() > max_filters)
+    return nullptr;
+
+  std::vector<Filter*> branches;
+  u32 divisor = gcd(split->GetMultiplicity(), join->GetMultiplicity());
+  for (Node* child : children)
+  {
+    Filter* filter = GetBranchFilter(child);
+    if (!filter || !CanFuse(filter, false))
+      return nullptr;
+
+    branches.push_back(filter);
+    divisor = gcd(divisor, filter->GetMultiplicity());
+  }
+
+  // Check every branch is rate-matched with the split and join, since the splitjoin schedule only matches the join
+  // against the first branch.
+  u32 split_firings = split->GetMultiplicity() / divisor;
+  u32 join_firings = join->GetMultiplicity() / divisor;
+  Filter::FusedMemberList members;
+  for (size_t i = 0; i < branches.size(); i++)
+  {
+    Filter* filter = branches[i];
+    u32 firings = filter->GetMultiplicity() / divisor;
+    u32 in_tokens = split_firings * split->GetPushRate() * u32(split->GetDistribution().at(i));
+    u32 out_tokens = join_firings * u32(join->GetDistribution().at(i));
+    if (in_tokens != filter->GetPopRate() * firings || out_tokens != filter->GetPushRate() * firings ||
+        in_tokens == 0 || out_tokens == 0 || in_tokens > MAX_LOCAL_CHANNEL_SIZE || out_tokens > MAX_LOCAL_CHANNEL_SIZE)
+    {
+      return nullptr;
+    }
+
+    members.push_back({filter, firings});
+  }
+
+  // The fused filter takes the name of the split, which is also the name of the input channel.
+  Filter* fused = new Filter(split->GetName(), split->GetInputType(), join->GetOutputType());
+  fused->m_pop_rate = split->GetPopRate() * split_firings;
+  fused->m_push_rate = join->GetPushRate() * join_firings;
+  fused->m_output_connection = join->GetOutputConnection();
+  fused->m_output_channel_name = join->GetOutputChannelName();
+  fused->m_fused_members = std::move(members);
+  fused->m_fused_split = split;
+  fused->m_fused_join = join;
+  fused->m_fused_split_firings = split_firings;
+  fused->m_fused_join_firings = join_firings;
+  Log_DevPrintf("Fusing splitjoin %s into %s (%u branches)", splitjoin->GetName().c_str(), fused->GetName().c_str(),
+                unsigned(branches.size()));
+
+  // The split, join and branch filters now belong to the fused filter, the containers around them go.
+  ReplaceConnections(split, fused);
+  for (Node* child : children)
+    DeleteBranchWrappers(child);
+  delete splitjoin;
+  return fused;
+}
+
+void StreamGraph::ReplaceConnections(Node* old_node, Node* new_node)
+{
+  struct TheVisitor : Visitor
+  {
+    Node* old_node;
+    Node* new_node;
+
+    TheVisitor(Node* old_node_, Node* new_node_) : old_node(old_node_), new_node(new_node_) {}
+
+    bool Visit(Filter* node) override
+    {
+      if (node->m_output_connection == old_node)
+        node->m_output_connection = new_node;
+
+      return true;
+    }
+
+    bool Visit(Pipeline* node) override
+    {
+      for (Node* child : node->GetChildren())
+        child->Accept(this);
+
+      return true;
+    }
+
+    bool Visit(SplitJoin* node) override
+    {
+      node->GetSplitNode()->Accept(this);
+      for (Node* child : node->GetChildren())
+        child->Accept(this);
+      node->GetJoinNode()->Accept(this);
+      return true;
+    }
+
+    bool Visit(Split* node) override
+    {
+      std::replace(node->m_outputs.begin(), node->m_outputs.end(), old_node, new_node);
+      return true;
+    }
+
+    bool Visit(Join* node) override
+    {
+      if (node->m_output_connection == old_node)
+        node->m_output_connection = new_node;
+
+      return true;
+    }
+  };
+
+  TheVisitor visitor(old_node, new_node);
+  m_root_node->Accept(&visitor);
+}
+
+} // namespace StreamGraph
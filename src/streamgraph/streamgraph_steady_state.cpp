@@ -0,0 +1,375 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include "common/log.h"
+#include "common/string_helpers.h"
+#include "streamgraph/flat_graph.h"
+#include "streamgraph/streamgraph.h"
+Log_SetChannel(StreamGraph::SteadyState);
+
+namespace StreamGraph
+{
+namespace
+{
+// Firings of a node per firing of the first node of its component, kept in lowest terms.
+struct Rational
+{
+  u64 num;
+  u64 den;
+};
+}
+
+static u64 GCD(u64 a, u64 b)
+{
+  while (b != 0)
+  {
+    u64 t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+static bool CheckedMul(u64 a, u64 b, u64* result)
+{
+  if (a != 0 && b > UINT64_MAX / a)
+    return false;
+
+  *result = a * b;
+  return true;
+}
+
+// result = value * mul / div, reducing before multiplying so the terms stay as small as possible.
+static bool ScaleRational(const Rational& value, u64 mul, u64 div, Rational* result)
+{
+  u64 g1 = GCD(value.num, div);
+  u64 g2 = GCD(mul, value.den);
+  u64 num, den;
+  if (!CheckedMul(value.num / g1, mul / g2, &num) || !CheckedMul(value.den / g2, div / g1, &den))
+    return false;
+
+  u64 g = GCD(num, den);
+  result->num = num / g;
+  result->den = den / g;
+  return true;
+}
+
+static bool operator!=(const Rational& lhs, const Rational& rhs)
+{
+  return (lhs.num != rhs.num || lhs.den != rhs.den);
+}
+
+static u64 GetMaxRate(const Node* node)
+{
+  return std::max({u64(1), u64(node->GetPeekRate()), u64(node->GetPopRate()), u64(node->GetPushRate())});
+}
+
+// Multiplicities and net rates are 32-bit.
+static bool CheckFirings(const Node* node, u64 firings)
+{
+  if (firings > UINT32_MAX || firings * GetMaxRate(node) > UINT32_MAX)
+  {
+    Log_ErrorPrintf("Steady state of %s overflows, with %llu firings", node->GetName().c_str(),
+                    static_cast<unsigned long long>(firings));
+    return false;
+  }
+
+  return true;
+}
+
+// Prework replaces work for the first firing of a filter.
+static const FilterPermutation* GetPreworkPermutation(const Node* node)
+{
+  const Filter* filter = dynamic_cast<const Filter*>(node);
+  const FilterPermutation* perm = filter ? filter->GetFilterPermutation() : nullptr;
+  return (perm && perm->HasPrework()) ? perm : nullptr;
+}
+
+// Tokens the first firings of the edge's consumer need to have arrived on it, so that none of them runs short of
+// its peek window, and the steady state which follows starts with peek - pop tokens left over.
+static u64 GetInitTokensNeeded(const FlatGraph& graph, const FlatGraph::Edge& edge, u64 firings)
+{
+  const Node* dst = graph.GetNode(edge.dst);
+  const Filter* filter = dynamic_cast<const Filter*>(dst);
+  u64 window = filter ? std::max(filter->GetPeekRate(), edge.pop) : edge.pop;
+  u64 residue = window - edge.pop;
+
+  const FilterPermutation* prework = GetPreworkPermutation(dst);
+  if (!prework || firings == 0)
+    return firings * edge.pop + residue;
+
+  u64 prework_pop = u64(prework->GetPreworkPopRate());
+  u64 prework_window = std::max(u64(prework->GetPreworkPeekRate()), prework_pop);
+  return std::max(prework_window, prework_pop + (firings - 1) * edge.pop + residue);
+}
+
+// Fewest firings of the edge's producer which push at least tokens onto it. Returns false if it never can.
+static bool GetInitFiringsToProduce(const FlatGraph& graph, const FlatGraph::Edge& edge, u64 tokens, u64* firings)
+{
+  const FilterPermutation* prework = GetPreworkPermutation(graph.GetNode(edge.src));
+  u64 first_push = prework ? u64(prework->GetPreworkPushRate()) : edge.push;
+  if (tokens == 0 || first_push >= tokens)
+  {
+    *firings = (tokens == 0) ? 0 : 1;
+    return true;
+  }
+
+  if (edge.push == 0)
+    return false;
+
+  *firings = 1 + (tokens - first_push + edge.push - 1) / edge.push;
+  return true;
+}
+
+// Demand flows upstream: visit consumers before their producers, raising each producer's firings until it covers
+// what its consumers need. Splits and joins are treated as firing whole rotations, which never delivers more than
+// forwarding token by token does.
+static bool ComputeInitFirings(const FlatGraph& graph, std::vector<u64>* init_firings)
+{
+  // Filters with prework fire at least once, so the steady state only runs work.
+  std::vector<u32> num_outputs(graph.GetNodeCount());
+  init_firings->assign(graph.GetNodeCount(), 0);
+  for (FlatGraph::NodeID id = 0; id < graph.GetNodeCount(); id++)
+  {
+    num_outputs[id] = graph.GetOutputEdges(id).size();
+    (*init_firings)[id] = GetPreworkPermutation(graph.GetNode(id)) ? 1 : 0;
+  }
+
+  // Reverse topological order, starting from the nodes with no outputs.
+  std::deque<FlatGraph::NodeID> queue;
+  for (FlatGraph::NodeID id = 0; id < graph.GetNodeCount(); id++)
+  {
+    if (num_outputs[id] == 0)
+      queue.push_back(id);
+  }
+  while (!queue.empty())
+  {
+    FlatGraph::NodeID current = queue.front();
+    queue.pop_front();
+
+    for (const FlatGraph::Edge& edge : graph.GetInputEdges(current))
+    {
+      u64 firings;
+      if (!GetInitFiringsToProduce(graph, edge, GetInitTokensNeeded(graph, edge, (*init_firings)[current]), &firings))
+      {
+        Log_ErrorPrintf("%s never pushes the tokens %s needs before its first steady state",
+                        graph.GetNode(edge.src)->GetName().c_str(), graph.GetNode(edge.dst)->GetName().c_str());
+        return false;
+      }
+      if (firings > UINT32_MAX)
+      {
+        Log_ErrorPrintf("Init schedule of %s overflows", graph.GetNode(edge.src)->GetName().c_str());
+        return false;
+      }
+
+      (*init_firings)[edge.src] = std::max((*init_firings)[edge.src], firings);
+      if (--num_outputs[edge.src] == 0)
+        queue.push_back(edge.src);
+    }
+  }
+
+  return true;
+}
+
+bool StreamGraph::SteadySchedule()
+{
+  // The structure may have changed since the last schedule, e.g. by fusion or fission.
+  BuildFlatGraph();
+  const FlatGraph& graph = *m_flat_graph;
+  const u32 num_nodes = graph.GetNodeCount();
+
+  // Channels which carry nothing either way don't constrain the schedule, and are skipped below.
+  auto is_idle = [](const FlatGraph::Edge& edge) { return (edge.push == 0 && edge.pop == 0); };
+  for (FlatGraph::NodeID id = 0; id < num_nodes; id++)
+  {
+    for (const FlatGraph::Edge& edge : graph.GetOutputEdges(id))
+    {
+      if (!is_idle(edge) && (edge.push == 0 || edge.pop == 0))
+      {
+        Log_ErrorPrintf("Channel from %s to %s can't be balanced, with %u pushed and %u popped per firing",
+                        graph.GetNode(edge.src)->GetName().c_str(), graph.GetNode(edge.dst)->GetName().c_str(),
+                        edge.push, edge.pop);
+        return false;
+      }
+    }
+  }
+
+  // Balance equations: for every channel, push * firings(src) == pop * firings(dst). Propagate relative firing
+  // rates out from one node of each connected component, checking channels which close a cycle (splitjoins) agree.
+  std::vector<Rational> rates(num_nodes, Rational{0, 1});
+  std::vector<u64> repetitions(num_nodes, 0);
+  std::vector<bool> visited(num_nodes, false);
+  for (FlatGraph::NodeID start = 0; start < num_nodes; start++)
+  {
+    if (visited[start])
+      continue;
+
+    std::vector<FlatGraph::NodeID> component;
+    std::deque<FlatGraph::NodeID> queue;
+    rates[start] = Rational{1, 1};
+    visited[start] = true;
+    queue.push_back(start);
+    while (!queue.empty())
+    {
+      FlatGraph::NodeID current = queue.front();
+      queue.pop_front();
+      component.push_back(current);
+
+      // Returns false if the rates disagree or overflow.
+      auto visit_edge = [&](const FlatGraph::Edge& edge, bool forward) {
+        if (is_idle(edge))
+          return true;
+
+        FlatGraph::NodeID other = forward ? edge.dst : edge.src;
+        Rational other_rate;
+        if (!(forward ? ScaleRational(rates[current], edge.push, edge.pop, &other_rate) :
+                        ScaleRational(rates[current], edge.pop, edge.push, &other_rate)))
+        {
+          Log_ErrorPrintf("Steady state of %s overflows", graph.GetNode(other)->GetName().c_str());
+          return false;
+        }
+
+        if (!visited[other])
+        {
+          rates[other] = other_rate;
+          visited[other] = true;
+          queue.push_back(other);
+        }
+        else if (rates[other] != other_rate)
+        {
+          Log_ErrorPrintf("Rates are inconsistent on the channel from %s to %s, no steady state exists",
+                          graph.GetNode(edge.src)->GetName().c_str(), graph.GetNode(edge.dst)->GetName().c_str());
+          return false;
+        }
+
+        return true;
+      };
+
+      for (const FlatGraph::Edge& edge : graph.GetOutputEdges(current))
+      {
+        if (!visit_edge(edge, true))
+          return false;
+      }
+      for (const FlatGraph::Edge& edge : graph.GetInputEdges(current))
+      {
+        if (!visit_edge(edge, false))
+          return false;
+      }
+    }
+
+    // Smallest integer solution: multiply out the denominators, then divide by the common factor.
+    u64 denominator_lcm = 1;
+    for (FlatGraph::NodeID index : component)
+    {
+      u64 den = rates[index].den / GCD(denominator_lcm, rates[index].den);
+      if (!CheckedMul(denominator_lcm, den, &denominator_lcm))
+      {
+        Log_ErrorPrintf("Steady state of %s overflows", graph.GetNode(index)->GetName().c_str());
+        return false;
+      }
+    }
+
+    u64 divisor = 0;
+    for (FlatGraph::NodeID index : component)
+    {
+      if (!CheckedMul(rates[index].num, denominator_lcm / rates[index].den, &repetitions[index]))
+      {
+        Log_ErrorPrintf("Steady state of %s overflows", graph.GetNode(index)->GetName().c_str());
+        return false;
+      }
+      divisor = GCD(divisor, repetitions[index]);
+    }
+    for (FlatGraph::NodeID index : component)
+      repetitions[index] /= divisor;
+  }
+
+  std::vector<u64> init_firings;
+  if (!ComputeInitFirings(graph, &init_firings))
+    return false;
+
+  for (FlatGraph::NodeID id = 0; id < num_nodes; id++)
+  {
+    if (!CheckFirings(graph.GetNode(id), repetitions[id]) || !CheckFirings(graph.GetNode(id), init_firings[id]))
+      return false;
+  }
+
+  for (FlatGraph::NodeID id = 0; id < num_nodes; id++)
+  {
+    Node* node = graph.GetNode(id);
+    node->m_multiplicity = u32(repetitions[id]);
+    node->m_init_firings = u32(init_firings[id]);
+    Log_DevPrintf("%s fires %u times per steady state, %u times before", node->GetName().c_str(),
+                  node->m_multiplicity, node->m_init_firings);
+  }
+
+  UpdateCompositeRates();
+  return true;
+}
+
+bool StreamGraph::ScaleSteadyState(u32 factor)
+{
+  const NodeList& nodes = m_flat_graph->GetNodes();
+  for (const Node* node : nodes)
+  {
+    if (!CheckFirings(node, u64(node->GetMultiplicity()) * factor))
+      return false;
+  }
+
+  for (Node* node : nodes)
+    node->m_multiplicity *= factor;
+
+  UpdateCompositeRates();
+  Log_InfoPrintf("Scaled steady state by %u", factor);
+  return true;
+}
+
+u32 StreamGraph::GetMaxSteadyStateScale() const
+{
+  u64 max_scale = UINT32_MAX;
+  for (const Node* node : m_flat_graph->GetNodes())
+  {
+    u64 net_rate = u64(std::max(node->GetMultiplicity(), u32(1))) * GetMaxRate(node);
+    max_scale = std::min(max_scale, u64(UINT32_MAX) / net_rate);
+  }
+
+  return u32(max_scale);
+}
+
+void StreamGraph::UpdateCompositeRates()
+{
+  struct CompositeVisitor : Visitor
+  {
+    bool Visit(Pipeline* node) override
+    {
+      for (Node* child : node->GetChildren())
+        child->Accept(this);
+
+      Node* first_child = node->GetChildren().front();
+      Node* last_child = node->GetChildren().back();
+      node->m_multiplicity = 1;
+      node->m_peek_rate = first_child->GetNetPeek();
+      node->m_pop_rate = first_child->GetNetPop();
+      node->m_push_rate = last_child->GetNetPush();
+      return true;
+    }
+
+    bool Visit(SplitJoin* node) override
+    {
+      for (Node* child : node->GetChildren())
+        child->Accept(this);
+
+      node->m_multiplicity = 1;
+      node->m_peek_rate = node->GetSplitNode()->GetNetPeek();
+      node->m_pop_rate = node->GetSplitNode()->GetNetPop();
+      node->m_push_rate = node->GetJoinNode()->GetNetPush();
+      return true;
+    }
+  };
+
+  CompositeVisitor composite;
+  m_root_node->Accept(&composite);
+}
+
+} // namespace StreamGraph